@@ -29,6 +29,7 @@
 #include <linux/fault-inject.h>
 #include <linux/list_sort.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/block.h>
@@ -2041,6 +2042,14 @@ void blk_start_request(struct request *req)
 	if (unlikely(blk_bidi_rq(req)))
 		req->next_rq->resid_len = blk_rq_bytes(req->next_rq);
 
+	/*
+	 * Only small reads size the adaptive poll window; the length has
+	 * to be looked at now, it is used up by the time it completes.
+	 */
+	if (blk_queue_poll(req->q) && rq_data_dir(req) == READ &&
+	    blk_rq_bytes(req) <= PAGE_SIZE)
+		req->issue_time_ns = ktime_to_ns(ktime_get());
+
 	blk_add_timer(req);
 }
 EXPORT_SYMBOL(blk_start_request);
@@ -2302,6 +2311,7 @@ static void blk_finish_request(struct request *req, int error)
 
 
 	blk_account_io_done(req);
+	blk_poll_account(req);
 
 	if (req->end_io)
 		req->end_io(req, error);
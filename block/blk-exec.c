@@ -72,6 +72,11 @@ void blk_execute_rq_nowait(struct request_queue *q, struct gendisk *bd_disk,
 }
 EXPORT_SYMBOL_GPL(blk_execute_rq_nowait);
 
+static bool blk_sync_rq_done(void *data)
+{
+	return completion_done(data);
+}
+
 /**
  * blk_execute_rq - insert a request into queue for execution
  * @q:		queue to insert the request in
@@ -106,6 +111,8 @@ int blk_execute_rq(struct request_queue *q, struct gendisk *bd_disk,
 	rq->end_io_data = &wait;
 	blk_execute_rq_nowait(q, bd_disk, rq, at_head, blk_end_sync_rq);
 
+	blk_poll_wait(q, blk_sync_rq_done, &wait);
+
 	/* Prevent hang_check timer from firing at us during very long I/O */
 	hang_check = sysctl_hung_task_timeout_secs;
 	if (hang_check)
@@ -0,0 +1,91 @@
+/*
+ * Hybrid polling for synchronous waiters. A task that has one small
+ * request outstanding on a fast device can spin for the completion
+ * instead of paying for a sleep and a wakeup, as long as the device
+ * usually completes within a short window.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+
+#include "blk.h"
+
+/*
+ * Never spin for longer than this in adaptive mode. A device that is
+ * slower than this on average gains nothing from polling.
+ */
+#define BLK_POLL_MAX_NS		(100 * NSEC_PER_USEC)
+
+/**
+ * blk_poll_account - account the service time of a completed request
+ * @rq: request being completed
+ *
+ * Description:
+ *     Feeds the issue to completion time of small reads into a running
+ *     average (weight 1/8) that sizes the adaptive spin window. Only
+ *     requests that blk_start_request() stamped, i.e. reads of at most a
+ *     page started while polling was enabled, are accounted. Called with
+ *     the queue lock held.
+ */
+void blk_poll_account(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	u64 lat;
+
+	if (!rq->issue_time_ns)
+		return;
+
+	lat = ktime_to_ns(ktime_get()) - rq->issue_time_ns;
+	if (q->poll_mean_ns)
+		q->poll_mean_ns = (7 * q->poll_mean_ns + lat) >> 3;
+	else
+		q->poll_mean_ns = lat;
+}
+
+/**
+ * blk_poll_wait - spin for a completion before going to sleep
+ * @q: queue the awaited I/O was issued to
+ * @done: returns true once the awaited I/O has completed
+ * @data: argument for @done
+ *
+ * Description:
+ *     If polling is enabled on @q, busy-wait until @done returns true, for
+ *     at most the configured poll delay or, in adaptive mode, twice the
+ *     mean service time of small reads. Gives up early if the task needs
+ *     to reschedule. Returns true if the I/O completed while spinning;
+ *     otherwise the caller goes on to sleep as usual.
+ *
+ *     The hit and miss counters are updated without the queue lock and
+ *     are only meant as a rough guide for tuning.
+ */
+bool blk_poll_wait(struct request_queue *q, bool (*done)(void *), void *data)
+{
+	u64 spin_ns, start;
+
+	if (!q || !blk_queue_poll(q))
+		return false;
+
+	if (q->poll_delay)
+		spin_ns = (u64)q->poll_delay * NSEC_PER_USEC;
+	else {
+		spin_ns = 2 * ACCESS_ONCE(q->poll_mean_ns);
+		if (!spin_ns || spin_ns > BLK_POLL_MAX_NS)
+			return false;
+	}
+
+	start = ktime_to_ns(ktime_get());
+	while (!done(data)) {
+		if (need_resched() ||
+		    ktime_to_ns(ktime_get()) - start > spin_ns) {
+			q->poll_misses++;
+			return false;
+		}
+		cpu_relax();
+	}
+
+	q->poll_hits++;
+	return true;
+}
+EXPORT_SYMBOL(blk_poll_wait);
@@ -14,26 +14,45 @@
 
 static DEFINE_PER_CPU(struct list_head, blk_cpu_done);
 
+/* passes over the per-cpu done list in one blk_done_softirq() */
+#define BLK_DONE_MAX_PASSES	4
+
 /*
  * Softirq action handler - move entries to local list and loop over them
- * while passing them to the queue registered handler.
+ * while passing them to the queue registered handler. Completions that
+ * were queued while we ran are finished in the same batch instead of one
+ * softirq each. The number of passes is bounded, and what is left after
+ * that goes to a fresh softirq, so a steady interrupt stream still gets
+ * __do_softirq's restart limit and the handoff to ksoftirqd.
  */
 static void blk_done_softirq(struct softirq_action *h)
 {
 	struct list_head *cpu_list, local_list;
+	int pass = 0;
 
-	local_irq_disable();
 	cpu_list = &__get_cpu_var(blk_cpu_done);
-	list_replace_init(cpu_list, &local_list);
-	local_irq_enable();
 
-	while (!list_empty(&local_list)) {
-		struct request *rq;
+	local_irq_disable();
+	while (!list_empty(cpu_list)) {
+		if (pass++ == BLK_DONE_MAX_PASSES) {
+			raise_softirq_irqoff(BLOCK_SOFTIRQ);
+			break;
+		}
+		list_replace_init(cpu_list, &local_list);
+		local_irq_enable();
+
+		while (!list_empty(&local_list)) {
+			struct request *rq;
+
+			rq = list_entry(local_list.next, struct request,
+					csd.list);
+			list_del_init(&rq->csd.list);
+			rq->q->softirq_done_fn(rq);
+		}
 
-		rq = list_entry(local_list.next, struct request, csd.list);
-		list_del_init(&rq->csd.list);
-		rq->q->softirq_done_fn(rq);
+		local_irq_disable();
 	}
+	local_irq_enable();
 }
 
 #if defined(CONFIG_SMP) && defined(CONFIG_USE_GENERIC_SMP_HELPERS)
@@ -32,6 +32,7 @@ bool __blk_end_bidi_request(struct request *rq, int error,
 void blk_rq_timed_out_timer(unsigned long data);
 void blk_delete_timer(struct request *);
 void blk_add_timer(struct request *);
+void blk_poll_account(struct request *);
 void __generic_unplug_device(struct request_queue *);
 
 /*
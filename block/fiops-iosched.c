@@ -11,6 +11,8 @@
 #include <linux/rbtree.h>
 #include <linux/ioprio.h>
 #include <linux/blktrace_api.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "blk.h"
 
 #define VIOS_SCALE_SHIFT 10
@@ -23,6 +25,11 @@
 
 #define VIOS_PRIO_SCALE (5)
 
+/* idle window for sync readers, off by default */
+#define FIOPS_SLICE_IDLE (0)
+
+#define sample_valid(samples)	((samples) > 80)
+
 struct fiops_rb_root {
 	struct rb_root rb;
 	struct rb_node *left;
@@ -49,10 +56,29 @@ struct fiops_data {
 
 	struct work_struct unplug_work;
 
+	/*
+	 * ioc whose last sync read we are waiting on, and then idling
+	 * for its next one
+	 */
+	struct fiops_ioc *active_ioc;
+	struct timer_list idle_slice_timer;
+
 	unsigned int read_scale;
 	unsigned int write_scale;
 	unsigned int sync_scale;
 	unsigned int async_scale;
+	unsigned int slice_idle;
+
+	struct list_head list;	/* on fiops_data_list, for debugfs */
+};
+
+/* think time: gap between a sync completion and the next sync request */
+struct fiops_ttime {
+	unsigned long last_end_request;
+
+	unsigned long ttime_total;
+	unsigned long ttime_samples;
+	unsigned long ttime_mean;
 };
 
 struct fiops_ioc {
@@ -72,14 +98,23 @@ struct fiops_ioc {
 	pid_t pid;
 	unsigned short ioprio;
 	enum wl_prio_t wl_type;
+
+	struct fiops_ttime ttime;
+
+	/* statistics, see the debugfs ioc_stats file */
+	unsigned long nr_dispatched[2];
+	u64 wait_time;	/* usec between insert and dispatch */
 };
 
 #define ioc_service_tree(ioc) (&((ioc)->fiopsd->service_tree[(ioc)->wl_type]))
 #define RQ_CIC(rq)		icq_to_cic((rq)->elv.icq)
+/* insertion time in usec, kept in an unsigned long (wraps harmlessly) */
+#define RQ_INSERT_US(rq)	((unsigned long) ((rq)->elv.priv[0]))
 
 enum ioc_state_flags {
 	FIOPS_IOC_FLAG_on_rr = 0,	/* on round-robin busy list */
 	FIOPS_IOC_FLAG_prio_changed,	/* task priority has changed */
+	FIOPS_IOC_FLAG_idle_window,	/* think time small enough to idle */
 };
 
 #define FIOPS_IOC_FNS(name)						\
@@ -98,6 +133,7 @@ static inline int fiops_ioc_##name(const struct fiops_ioc *ioc)	\
 
 FIOPS_IOC_FNS(on_rr);
 FIOPS_IOC_FNS(prio_changed);
+FIOPS_IOC_FNS(idle_window);
 #undef FIOPS_IOC_FNS
 
 #define fiops_log_ioc(fiopsd, ioc, fmt, args...)	\
@@ -351,15 +387,31 @@ static u64 fiops_dispatch_request(struct fiops_data *fiopsd,
 	fiopsd->in_flight[rq_is_sync(rq)]++;
 	ioc->in_flight++;
 
+	ioc->nr_dispatched[rq_is_sync(rq)]++;
+	ioc->wait_time += (unsigned long) ktime_to_us(ktime_get()) -
+		RQ_INSERT_US(rq);
+
 	return fiops_scaled_vios(fiopsd, ioc, rq);
 }
 
+static void fiops_clear_active_ioc(struct fiops_data *fiopsd)
+{
+	if (!fiopsd->active_ioc)
+		return;
+
+	fiops_log_ioc(fiopsd, fiopsd->active_ioc, "clear active");
+	fiopsd->active_ioc = NULL;
+	del_timer(&fiopsd->idle_slice_timer);
+}
+
 static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 {
 	struct fiops_ioc *ioc;
 	int dispatched = 0;
 	int i;
 
+	fiops_clear_active_ioc(fiopsd);
+
 	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
 		while (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
 			ioc = fiops_rb_first(&fiopsd->service_tree[i]);
@@ -427,22 +479,66 @@ static void fiops_charge_vios(struct fiops_data *fiopsd,
 	fiops_update_min_vios(service_tree);
 }
 
+/*
+ * Whether to keep the device for ioc after it dispatched its last queued
+ * request rq: ioc must be a sync reader with a small think time, and
+ * still due for service, i.e. nobody of a higher class is waiting and
+ * nobody in its class has had less service than it plus one request.
+ */
+static bool fiops_should_idle(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc, struct request *rq)
+{
+	struct fiops_ioc *first;
+	int i;
+
+	if (!fiopsd->slice_idle || !fiops_ioc_idle_window(ioc))
+		return false;
+	if (rq_data_dir(rq) != READ || !rq_is_sync(rq))
+		return false;
+	if (!list_empty(&ioc->fifo))
+		return false;
+
+	for (i = RT_WORKLOAD; i > ioc->wl_type; i--)
+		if (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb))
+			return false;
+
+	first = fiops_rb_first(ioc_service_tree(ioc));
+	return !first || (s64)(ioc->vios - first->vios) <= VIOS_SCALE;
+}
+
 static int fiops_dispatch_requests(struct request_queue *q, int force)
 {
 	struct fiops_data *fiopsd = q->elevator->elevator_data;
 	struct fiops_ioc *ioc;
+	struct request *rq;
 	u64 vios;
 
 	if (unlikely(force))
 		return fiops_forced_dispatch(fiopsd);
 
-	ioc = fiops_select_ioc(fiopsd);
-	if (!ioc)
-		return 0;
+	ioc = fiopsd->active_ioc;
+	if (ioc) {
+		/* its last read is still in flight, or we are idling */
+		if (list_empty(&ioc->fifo))
+			return 0;
+		del_timer(&fiopsd->idle_slice_timer);
+		fiopsd->active_ioc = NULL;
+		fiops_log_ioc(fiopsd, ioc, "idle window hit");
+	} else {
+		ioc = fiops_select_ioc(fiopsd);
+		if (!ioc)
+			return 0;
+	}
 
+	rq = rq_entry_fifo(ioc->fifo.next);
 	vios = fiops_dispatch_request(fiopsd, ioc);
 
 	fiops_charge_vios(fiopsd, ioc, vios);
+
+	if (fiops_should_idle(fiopsd, ioc, rq)) {
+		fiops_log_ioc(fiopsd, ioc, "set active");
+		fiopsd->active_ioc = ioc;
+	}
 	return 1;
 }
 
@@ -483,12 +579,53 @@ static void fiops_init_prio_data(struct fiops_ioc *cic)
 	fiops_clear_ioc_prio_changed(cic);
 }
 
+static void fiops_update_io_thinktime(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc)
+{
+	struct fiops_ttime *ttime = &ioc->ttime;
+	unsigned long elapsed = jiffies - ttime->last_end_request;
+
+	elapsed = min(elapsed, 2UL * fiopsd->slice_idle);
+
+	ttime->ttime_samples = (7 * ttime->ttime_samples + 256) / 8;
+	ttime->ttime_total = (7 * ttime->ttime_total + 256 * elapsed) / 8;
+	ttime->ttime_mean = (ttime->ttime_total + 128) / ttime->ttime_samples;
+}
+
+/*
+ * Idle for an ioc only while its think time stays within slice_idle, and
+ * not once its tasks are gone.
+ */
+static void fiops_update_idle_window(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc)
+{
+	int enable_idle = fiops_ioc_idle_window(ioc);
+
+	if (!fiopsd->slice_idle || !atomic_read(&ioc->icq.ioc->nr_tasks))
+		enable_idle = 0;
+	else if (sample_valid(ioc->ttime.ttime_samples))
+		enable_idle = ioc->ttime.ttime_mean <= fiopsd->slice_idle;
+
+	if (enable_idle)
+		fiops_mark_ioc_idle_window(ioc);
+	else
+		fiops_clear_ioc_idle_window(ioc);
+}
+
 static void fiops_insert_request(struct request_queue *q, struct request *rq)
 {
 	struct fiops_ioc *ioc = RQ_CIC(rq);
+	struct fiops_data *fiopsd = ioc->fiopsd;
 
 	fiops_init_prio_data(ioc);
 
+	rq->elv.priv[0] = (void *) (unsigned long) ktime_to_us(ktime_get());
+
+	if (rq_is_sync(rq)) {
+		fiops_update_io_thinktime(fiopsd, ioc);
+		fiops_update_idle_window(fiopsd, ioc);
+	}
+
 	list_add_tail(&rq->queuelist, &ioc->fifo);
 
 	fiops_add_rq_rb(rq);
@@ -515,6 +652,18 @@ static void fiops_completed_request(struct request_queue *q, struct request *rq)
 	fiops_log_ioc(fiopsd, ioc, "in_flight %d, busy queues %d",
 		ioc->in_flight, fiopsd->busy_queues);
 
+	if (rq_is_sync(rq))
+		ioc->ttime.last_end_request = jiffies;
+
+	/* the active ioc's read is done, give it slice_idle to send another */
+	if (fiopsd->active_ioc == ioc && !ioc->in_flight &&
+			list_empty(&ioc->fifo)) {
+		fiops_log_ioc(fiopsd, ioc, "arm idle timer");
+		mod_timer(&fiopsd->idle_slice_timer,
+			jiffies + fiopsd->slice_idle);
+		return;
+	}
+
 	if (fiopsd->in_flight[0] + fiopsd->in_flight[1] == 0)
 		fiops_schedule_dispatch(fiopsd);
 }
@@ -594,10 +743,105 @@ static int fiops_allow_merge(struct request_queue *q, struct request *rq,
 	return cic == RQ_CIC(rq);
 }
 
+#ifdef CONFIG_DEBUG_FS
+static LIST_HEAD(fiops_data_list);
+static DEFINE_MUTEX(fiops_data_mutex);
+static struct dentry *fiops_debugfs_root;
+
+static void fiops_debugfs_add(struct fiops_data *fiopsd)
+{
+	mutex_lock(&fiops_data_mutex);
+	list_add_tail(&fiopsd->list, &fiops_data_list);
+	mutex_unlock(&fiops_data_mutex);
+}
+
+static void fiops_debugfs_del(struct fiops_data *fiopsd)
+{
+	mutex_lock(&fiops_data_mutex);
+	list_del(&fiopsd->list);
+	mutex_unlock(&fiops_data_mutex);
+}
+
+/*
+ * One line per ioc of every queue using fiops: service received (vios),
+ * requests dispatched, total time its requests waited in the scheduler,
+ * mean think time and whether we idle for it.
+ */
+static int fiops_ioc_stats_show(struct seq_file *m, void *v)
+{
+	static const char *wl_name[FIOPS_PRIO_NR] = { "idle", "be", "rt" };
+	struct fiops_data *fiopsd;
+	struct request_queue *q;
+	struct io_cq *icq;
+	struct fiops_ioc *ioc;
+
+	mutex_lock(&fiops_data_mutex);
+	list_for_each_entry(fiopsd, &fiops_data_list, list) {
+		q = fiopsd->queue;
+		seq_printf(m, "queue %s\n", q->backing_dev_info.dev ?
+			dev_name(q->backing_dev_info.dev) : "?");
+		seq_printf(m, "%8s %4s %4s %16s %10s %10s %12s %8s %4s\n",
+			"pid", "wl", "prio", "vios", "sync", "async",
+			"wait_us", "ttime_ms", "idle");
+
+		spin_lock_irq(q->queue_lock);
+		list_for_each_entry(icq, &q->icq_list, q_node) {
+			ioc = icq_to_cic(icq);
+			seq_printf(m, "%8d %4s %4u %16llu %10lu %10lu %12llu "
+				"%8u %4d\n", ioc->pid, wl_name[ioc->wl_type],
+				ioc->ioprio, (unsigned long long)ioc->vios,
+				ioc->nr_dispatched[1], ioc->nr_dispatched[0],
+				(unsigned long long)ioc->wait_time,
+				jiffies_to_msecs(ioc->ttime.ttime_mean),
+				fiops_ioc_idle_window(ioc));
+		}
+		spin_unlock_irq(q->queue_lock);
+	}
+	mutex_unlock(&fiops_data_mutex);
+
+	return 0;
+}
+
+static int fiops_ioc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fiops_ioc_stats_show, NULL);
+}
+
+static const struct file_operations fiops_ioc_stats_fops = {
+	.open		= fiops_ioc_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void fiops_debugfs_init(void)
+{
+	fiops_debugfs_root = debugfs_create_dir("fiops", NULL);
+	if (IS_ERR_OR_NULL(fiops_debugfs_root))
+		return;
+
+	debugfs_create_file("ioc_stats", S_IRUSR, fiops_debugfs_root, NULL,
+			    &fiops_ioc_stats_fops);
+}
+
+static void fiops_debugfs_exit(void)
+{
+	debugfs_remove_recursive(fiops_debugfs_root);
+}
+#else
+static inline void fiops_debugfs_add(struct fiops_data *fiopsd) { }
+static inline void fiops_debugfs_del(struct fiops_data *fiopsd) { }
+static inline void fiops_debugfs_init(void) { }
+static inline void fiops_debugfs_exit(void) { }
+#endif
+
 static void fiops_exit_queue(struct elevator_queue *e)
 {
 	struct fiops_data *fiopsd = e->elevator_data;
 
+	fiops_debugfs_del(fiopsd);
+
+	del_timer_sync(&fiopsd->idle_slice_timer);
 	cancel_work_sync(&fiopsd->unplug_work);
 
 	kfree(fiopsd);
@@ -614,6 +858,24 @@ static void fiops_kick_queue(struct work_struct *work)
 	spin_unlock_irq(q->queue_lock);
 }
 
+static void fiops_idle_slice_timer(unsigned long data)
+{
+	struct fiops_data *fiopsd = (struct fiops_data *)data;
+	struct fiops_ioc *ioc;
+	unsigned long flags;
+
+	spin_lock_irqsave(fiopsd->queue->queue_lock, flags);
+
+	ioc = fiopsd->active_ioc;
+	if (ioc && !ioc->in_flight && list_empty(&ioc->fifo)) {
+		fiops_log_ioc(fiopsd, ioc, "idle window expired");
+		fiopsd->active_ioc = NULL;
+	}
+	fiops_schedule_dispatch(fiopsd);
+
+	spin_unlock_irqrestore(fiopsd->queue->queue_lock, flags);
+}
+
 static void *fiops_init_queue(struct request_queue *q)
 {
 	struct fiops_data *fiopsd;
@@ -630,10 +892,17 @@ static void *fiops_init_queue(struct request_queue *q)
 
 	INIT_WORK(&fiopsd->unplug_work, fiops_kick_queue);
 
+	init_timer(&fiopsd->idle_slice_timer);
+	fiopsd->idle_slice_timer.function = fiops_idle_slice_timer;
+	fiopsd->idle_slice_timer.data = (unsigned long) fiopsd;
+
 	fiopsd->read_scale = VIOS_READ_SCALE;
 	fiopsd->write_scale = VIOS_WRITE_SCALE;
 	fiopsd->sync_scale = VIOS_SYNC_SCALE;
 	fiopsd->async_scale = VIOS_ASYNC_SCALE;
+	fiopsd->slice_idle = FIOPS_SLICE_IDLE;
+
+	fiops_debugfs_add(fiopsd);
 
 	return fiopsd;
 }
@@ -651,6 +920,20 @@ static void fiops_init_icq(struct io_cq *icq)
 
 	ioc->pid = current->pid;
 	fiops_mark_ioc_prio_changed(ioc);
+
+	ioc->ttime.last_end_request = jiffies;
+	if (fiopsd->slice_idle)
+		fiops_mark_ioc_idle_window(ioc);
+}
+
+static void fiops_exit_icq(struct io_cq *icq)
+{
+	struct fiops_ioc *ioc = icq_to_cic(icq);
+
+	if (ioc->fiopsd->active_ioc == ioc) {
+		fiops_clear_active_ioc(ioc->fiopsd);
+		fiops_schedule_dispatch(ioc->fiopsd);
+	}
 }
 
 /*
@@ -681,6 +964,7 @@ SHOW_FUNCTION(fiops_read_scale_show, fiopsd->read_scale);
 SHOW_FUNCTION(fiops_write_scale_show, fiopsd->write_scale);
 SHOW_FUNCTION(fiops_sync_scale_show, fiopsd->sync_scale);
 SHOW_FUNCTION(fiops_async_scale_show, fiopsd->async_scale);
+SHOW_FUNCTION(fiops_slice_idle_show, jiffies_to_msecs(fiopsd->slice_idle));
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)				\
@@ -702,6 +986,18 @@ STORE_FUNCTION(fiops_sync_scale_store, &fiopsd->sync_scale, 1, 100);
 STORE_FUNCTION(fiops_async_scale_store, &fiopsd->async_scale, 1, 100);
 #undef STORE_FUNCTION
 
+static ssize_t fiops_slice_idle_store(struct elevator_queue *e,
+	const char *page, size_t count)
+{
+	struct fiops_data *fiopsd = e->elevator_data;
+	unsigned int __data;
+	int ret = fiops_var_store(&__data, (page), count);
+
+	/* msec, 0 turns idling off */
+	fiopsd->slice_idle = msecs_to_jiffies(min(__data, 1000U));
+	return ret;
+}
+
 #define FIOPS_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, fiops_##name##_show, fiops_##name##_store)
 
@@ -710,6 +1006,7 @@ static struct elv_fs_entry fiops_attrs[] = {
 	FIOPS_ATTR(write_scale),
 	FIOPS_ATTR(sync_scale),
 	FIOPS_ATTR(async_scale),
+	FIOPS_ATTR(slice_idle),
 	__ATTR_NULL
 };
 
@@ -725,6 +1022,7 @@ static struct elevator_type iosched_fiops = {
 		.elevator_former_req_fn =	elv_rb_former_request,
 		.elevator_latter_req_fn =	elv_rb_latter_request,
 		.elevator_init_icq_fn =		fiops_init_icq,
+		.elevator_exit_icq_fn =		fiops_exit_icq,
 		.elevator_init_fn =		fiops_init_queue,
 		.elevator_exit_fn =		fiops_exit_queue,
 	},
@@ -737,11 +1035,16 @@ static struct elevator_type iosched_fiops = {
 
 static int __init fiops_init(void)
 {
-	return elv_register(&iosched_fiops);
+	int ret = elv_register(&iosched_fiops);
+
+	if (!ret)
+		fiops_debugfs_init();
+	return ret;
 }
 
 static void __exit fiops_exit(void)
 {
+	fiops_debugfs_exit();
 	elv_unregister(&iosched_fiops);
 }
 
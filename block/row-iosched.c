@@ -26,6 +26,11 @@
 #include <linux/compiler.h>
 #include <linux/blktrace_api.h>
 #include <linux/jiffies.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/log2.h>
+
+#include "blk-cgroup.h"
 
 /*
  * enum row_queue_prio - Priorities of the ROW queues
@@ -69,10 +74,37 @@ static const int queue_quantum[] = {
 	2	/* ROWQ_PRIO_LOW_SWRITE */
 };
 
+/* Names of the queues in latency_stats, as in the quantum attributes */
+static const char *const queue_name[] = {
+	"hp_read",	/* ROWQ_PRIO_HIGH_READ */
+	"rp_read",	/* ROWQ_PRIO_REG_READ */
+	"hp_swrite",	/* ROWQ_PRIO_HIGH_SWRITE */
+	"rp_swrite",	/* ROWQ_PRIO_REG_SWRITE */
+	"rp_write",	/* ROWQ_PRIO_REG_WRITE */
+	"lp_read",	/* ROWQ_PRIO_LOW_READ */
+	"lp_swrite"	/* ROWQ_PRIO_LOW_SWRITE */
+};
+
 /* Default values for idling on read queues */
 #define ROW_IDLE_TIME_MSEC 10	/* msec */
 #define ROW_READ_FREQ_MSEC 50	/* msec */
 
+/*
+ * Default dispatch latency target of the high and regular priority read
+ * queues. A read that has waited longer is dispatched ahead of everything
+ * else.
+ */
+#define ROW_READ_LATENCY_TARGET_MSEC 100	/* msec */
+/* Upper limit, keeps the target in usec well within a long */
+#define ROW_READ_LATENCY_TARGET_MAX_MSEC 10000	/* msec */
+
+/*
+ * Dispatch latency histogram: bucket i counts the requests that waited
+ * less than 2^(i + ROW_LAT_MIN_SHIFT) usec, the last bucket the rest.
+ */
+#define ROW_LAT_MIN_SHIFT	6	/* 64 usec */
+#define ROW_LAT_BUCKETS		16	/* up to 2 sec */
+
 /**
  * struct rowq_idling_data -  parameters for idling on the queue
  * @last_insert_time:	time the last request was inserted
@@ -85,6 +117,18 @@ struct rowq_idling_data {
 	bool			begin_idling;
 };
 
+/**
+ * struct rowq_latency_stats - dispatch latency of the queue
+ * @hist:		latency histogram, see ROW_LAT_BUCKETS
+ * @nr_target_missed:	number of requests dispatched after the
+ *			latency target had passed
+ *
+ */
+struct rowq_latency_stats {
+	unsigned long		hist[ROW_LAT_BUCKETS];
+	unsigned long		nr_target_missed;
+};
+
 /**
  * struct row_queue - requests grouping structure
  * @rdata:		parent row_data structure
@@ -94,6 +138,7 @@ struct rowq_idling_data {
  *			the current dispatch cycle
  * @slice:		number of requests to dispatch in a cycle
  * @idle_data:		data for idling on queues
+ * @lat_stats:		dispatch latency statistics
  *
  */
 struct row_queue {
@@ -106,6 +151,8 @@ struct row_queue {
 
 	/* used only for READ queues */
 	struct rowq_idling_data	idle_data;
+
+	struct rowq_latency_stats	lat_stats;
 };
 
 /**
@@ -136,6 +183,11 @@ struct idling_data {
  *			scheduler, nr_reqs[1] holds the number of all WRITE
  *			requests in scheduler
  * @cycle_flags:	used for marking unserved queueus
+ * @prio_classes:	place requests in the high/low priority queues
+ *			according to the submitter's blkio cgroup or
+ *			I/O priority class
+ * @read_latency_target: dispatch latency target of the high and
+ *			regular read queues (msec), 0 for none
  *
  */
 struct row_data {
@@ -152,9 +204,14 @@ struct row_data {
 	unsigned int			nr_reqs[2];
 
 	unsigned int			cycle_flags;
+
+	int				prio_classes;
+	int				read_latency_target;
 };
 
 #define RQ_ROWQ(rq) ((struct row_queue *) ((rq)->elv.priv[0]))
+/* insertion time in usec, kept in an unsigned long (wraps harmlessly) */
+#define RQ_INSERT_US(rq) ((unsigned long) ((rq)->elv.priv[1]))
 
 #define row_log(q, fmt, args...)   \
 	blk_add_trace_msg(q, "%s():" fmt , __func__, ##args)
@@ -230,6 +287,25 @@ static inline void row_restart_disp_cycle(struct row_data *rd)
 	row_log(rd->dispatch_queue, "Restarting cycle");
 }
 
+static inline unsigned long row_now_us(void)
+{
+	return (unsigned long) ktime_to_us(ktime_get());
+}
+
+/*
+ * row_rq_wait_us() - Time a request has spent in the scheduler (usec)
+ */
+static inline unsigned long row_rq_wait_us(struct request *rq,
+					   unsigned long now)
+{
+	return now - RQ_INSERT_US(rq);
+}
+
+static inline bool row_rowq_has_target(enum row_queue_prio qnum)
+{
+	return qnum == ROWQ_PRIO_HIGH_READ || qnum == ROWQ_PRIO_REG_READ;
+}
+
 static inline void row_get_next_queue(struct row_data *rd)
 {
 	rd->curr_queue++;
@@ -254,6 +330,7 @@ static void row_add_request(struct request_queue *q,
 	list_add_tail(&rq->queuelist, &rqueue->fifo);
 	rd->nr_reqs[rq_data_dir(rq)]++;
 	rq_set_fifo_time(rq, jiffies); /* for statistics*/
+	rq->elv.priv[1] = (void *) row_now_us();
 
 	if (queue_idling_enabled[rqueue->prio]) {
 		if (delayed_work_pending(&rd->read_idle.idle_work))
@@ -299,9 +376,21 @@ static void row_remove_request(struct request_queue *q,
  */
 static void row_dispatch_insert(struct row_data *rd)
 {
+	struct row_queue *rqueue = &rd->row_queues[rd->curr_queue].rqueue;
 	struct request *rq;
+	unsigned long wait;
+	int bucket;
+
+	rq = rq_entry_fifo(rqueue->fifo.next);
+
+	wait = row_rq_wait_us(rq, row_now_us());
+	bucket = wait ? fls_long(wait) - ROW_LAT_MIN_SHIFT : 0;
+	bucket = clamp(bucket, 0, ROW_LAT_BUCKETS - 1);
+	rqueue->lat_stats.hist[bucket]++;
+	if (rd->read_latency_target && row_rowq_has_target(rd->curr_queue) &&
+	    wait > rd->read_latency_target * USEC_PER_MSEC)
+		rqueue->lat_stats.nr_target_missed++;
 
-	rq = rq_entry_fifo(rd->row_queues[rd->curr_queue].rqueue.fifo.next);
 	row_remove_request(rd->dispatch_queue, rq);
 	elv_dispatch_add_tail(rd->dispatch_queue, rq);
 	rd->row_queues[rd->curr_queue].rqueue.nr_dispatched++;
@@ -359,6 +448,31 @@ static int row_dispatch_requests(struct request_queue *q, int force)
 
 	currq = rd->curr_queue;
 
+	/*
+	 * A read queue whose oldest request is past the latency target is
+	 * served first, starving the lower queues until it catches up
+	 */
+	if (rd->read_latency_target) {
+		unsigned long now = row_now_us();
+
+		for (i = 0; i < ROWQ_MAX_PRIO; i++) {
+			struct list_head *fifo = &rd->row_queues[i].rqueue.fifo;
+
+			if (!row_rowq_has_target(i) || list_empty(fifo))
+				continue;
+			if (row_rq_wait_us(rq_entry_fifo(fifo->next), now) <=
+			    rd->read_latency_target * USEC_PER_MSEC)
+				continue;
+
+			row_log_rowq(rd, currq,
+				" Preempting for rowq%d past latency target", i);
+			rd->curr_queue = i;
+			row_dispatch_insert(rd);
+			ret = 1;
+			goto done;
+		}
+	}
+
 	/*
 	 * Find the first unserved queue (with higher priority then currq)
 	 * that is not empty
@@ -477,6 +591,9 @@ static void *row_init_queue(struct request_queue *q)
 	rdata->curr_queue = ROWQ_PRIO_HIGH_READ;
 	rdata->dispatch_queue = q;
 
+	rdata->prio_classes = 1;
+	rdata->read_latency_target = ROW_READ_LATENCY_TARGET_MSEC;
+
 	rdata->nr_reqs[READ] = rdata->nr_reqs[WRITE] = 0;
 
 	return rdata;
@@ -516,6 +633,29 @@ static void row_merged_requests(struct request_queue *q, struct request *rq,
 	rqueue->rdata->nr_reqs[rq_data_dir(rq)]--;
 }
 
+/*
+ * row_get_prio_class() - Priority hint for the submitting task
+ *
+ * A task in a blkio cgroup weighted below the default (such as Android's
+ * background group) is IOPRIO_CLASS_IDLE. Otherwise the task's own I/O
+ * priority class is used, so RT tasks get the high priority queues.
+ */
+static int row_get_prio_class(void)
+{
+	struct io_context *ioc = current->io_context;
+#ifdef CONFIG_BLK_CGROUP
+	unsigned int weight;
+
+	rcu_read_lock();
+	weight = task_blkio_cgroup(current)->weight;
+	rcu_read_unlock();
+
+	if (weight < BLKIO_WEIGHT_DEFAULT)
+		return IOPRIO_CLASS_IDLE;
+#endif
+	return ioc ? task_ioprio_class(ioc) : IOPRIO_CLASS_BE;
+}
+
 /*
  * get_queue_type() - Get queue type for a given request
  *
@@ -523,19 +663,33 @@ static void row_merged_requests(struct request_queue *q, struct request *rq,
  * ROW queue the given request should be added to (and
  * dispatched from leter on)
  *
- * TODO: Right now only 3 queues are used REG_READ, REG_WRITE
- * and REG_SWRITE
+ * Reads and sync writes go to the high or low priority queue of their
+ * kind when the submitter has an RT or idle priority hint (see
+ * row_get_prio_class()), async writes always to REG_WRITE
  */
-static enum row_queue_prio get_queue_type(struct request *rq)
+static enum row_queue_prio get_queue_type(struct row_data *rd,
+					  struct request *rq)
 {
 	const int data_dir = rq_data_dir(rq);
 	const bool is_sync = rq_is_sync(rq);
+	int prio_class = IOPRIO_CLASS_BE;
+
+	if (rd->prio_classes && (data_dir == READ || is_sync))
+		prio_class = row_get_prio_class();
 
-	if (data_dir == READ)
+	if (data_dir == READ) {
+		if (prio_class == IOPRIO_CLASS_RT)
+			return ROWQ_PRIO_HIGH_READ;
+		if (prio_class == IOPRIO_CLASS_IDLE)
+			return ROWQ_PRIO_LOW_READ;
 		return ROWQ_PRIO_REG_READ;
-	else if (is_sync)
+	} else if (is_sync) {
+		if (prio_class == IOPRIO_CLASS_RT)
+			return ROWQ_PRIO_HIGH_SWRITE;
+		if (prio_class == IOPRIO_CLASS_IDLE)
+			return ROWQ_PRIO_LOW_SWRITE;
 		return ROWQ_PRIO_REG_SWRITE;
-	else
+	} else
 		return ROWQ_PRIO_REG_WRITE;
 }
 
@@ -550,11 +704,12 @@ static int
 row_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
 {
 	struct row_data *rd = (struct row_data *)q->elevator->elevator_data;
+	enum row_queue_prio qnum = get_queue_type(rd, rq);
 	unsigned long flags;
 
 	spin_lock_irqsave(q->queue_lock, flags);
 	rq->elv.priv[0] =
-		(void *)(&rd->row_queues[get_queue_type(rq)]);
+		(void *)(&rd->row_queues[qnum]);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
 	return 0;
@@ -599,6 +754,8 @@ SHOW_FUNCTION(row_lp_swrite_quantum_show,
 	rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].disp_quantum, 0);
 SHOW_FUNCTION(row_read_idle_show, rowd->read_idle.idle_time, 1);
 SHOW_FUNCTION(row_read_idle_freq_show, rowd->read_idle.freq, 0);
+SHOW_FUNCTION(row_prio_classes_show, rowd->prio_classes, 0);
+SHOW_FUNCTION(row_read_latency_target_show, rowd->read_latency_target, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -639,9 +796,93 @@ STORE_FUNCTION(row_lp_swrite_quantum_store,
 			1, INT_MAX, 1);
 STORE_FUNCTION(row_read_idle_store, &rowd->read_idle.idle_time, 1, INT_MAX, 1);
 STORE_FUNCTION(row_read_idle_freq_store, &rowd->read_idle.freq, 1, INT_MAX, 0);
+STORE_FUNCTION(row_prio_classes_store, &rowd->prio_classes, 0, 1, 0);
+STORE_FUNCTION(row_read_latency_target_store, &rowd->read_latency_target,
+			0, ROW_READ_LATENCY_TARGET_MAX_MSEC, 0);
 
 #undef STORE_FUNCTION
 
+/*
+ * row_lat_percentile() - Upper bound (usec) of the histogram bucket that
+ * holds the pct'th percentile, or 0 if the last (open) bucket does
+ */
+static unsigned long row_lat_percentile(struct rowq_latency_stats *stats,
+					unsigned long total, int pct)
+{
+	unsigned long sum = 0, want = DIV_ROUND_UP(total * pct, 100);
+	int i;
+
+	for (i = 0; i < ROW_LAT_BUCKETS - 1; i++) {
+		sum += stats->hist[i];
+		if (sum >= want)
+			break;
+	}
+
+	return i < ROW_LAT_BUCKETS - 1 ? 1UL << (i + ROW_LAT_MIN_SHIFT) : 0;
+}
+
+static int row_lat_print(char *page, int len, unsigned long usec)
+{
+	if (!usec)
+		return len + scnprintf(page + len, PAGE_SIZE - len, " >%lu",
+			1UL << (ROW_LAT_BUCKETS - 1 + ROW_LAT_MIN_SHIFT));
+	return len + scnprintf(page + len, PAGE_SIZE - len, " %lu", usec);
+}
+
+/*
+ * Per queue: requests dispatched, 50th/90th/99th percentile dispatch
+ * latency (usec, rounded up to a power of two) and, for the queues with
+ * a latency target, the number of requests dispatched past it. Writing
+ * anything clears the statistics.
+ */
+static ssize_t row_latency_stats_show(struct elevator_queue *e, char *page)
+{
+	struct row_data *rowd = e->elevator_data;
+	struct rowq_latency_stats *stats;
+	unsigned long total;
+	int i, j, len = 0;
+
+	for (i = 0; i < ROWQ_MAX_PRIO; i++) {
+		stats = &rowd->row_queues[i].rqueue.lat_stats;
+		for (total = 0, j = 0; j < ROW_LAT_BUCKETS; j++)
+			total += stats->hist[j];
+
+		len += scnprintf(page + len, PAGE_SIZE - len, "%s %lu",
+				 queue_name[i], total);
+		if (total) {
+			len = row_lat_print(page, len,
+				row_lat_percentile(stats, total, 50));
+			len = row_lat_print(page, len,
+				row_lat_percentile(stats, total, 90));
+			len = row_lat_print(page, len,
+				row_lat_percentile(stats, total, 99));
+		} else
+			len += scnprintf(page + len, PAGE_SIZE - len,
+					 " 0 0 0");
+		if (row_rowq_has_target(i))
+			len += scnprintf(page + len, PAGE_SIZE - len, " %lu",
+					 stats->nr_target_missed);
+		len += scnprintf(page + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+static ssize_t row_latency_stats_store(struct elevator_queue *e,
+		const char *page, size_t count)
+{
+	struct row_data *rowd = e->elevator_data;
+	int i;
+
+	spin_lock_irq(rowd->dispatch_queue->queue_lock);
+	for (i = 0; i < ROWQ_MAX_PRIO; i++)
+		memset(&rowd->row_queues[i].rqueue.lat_stats, 0,
+		       sizeof(struct rowq_latency_stats));
+	spin_unlock_irq(rowd->dispatch_queue->queue_lock);
+
+	return count;
+}
+
 #define ROW_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, row_##name##_show, \
 				      row_##name##_store)
@@ -656,6 +897,9 @@ static struct elv_fs_entry row_attrs[] = {
 	ROW_ATTR(lp_swrite_quantum),
 	ROW_ATTR(read_idle),
 	ROW_ATTR(read_idle_freq),
+	ROW_ATTR(prio_classes),
+	ROW_ATTR(read_latency_target),
+	ROW_ATTR(latency_stats),
 	__ATTR_NULL
 };
 
@@ -40,6 +40,10 @@
 #include <linux/notifier.h>
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
+#include <linux/spinlock.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 #ifdef CONFIG_INTERNAL_ISP_START_CAMERA
 #include <linux/uaccess.h>
@@ -159,6 +163,80 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * Thread group leaders are kept on one list per range of oom_score_adj
+ * values, so that victim selection only visits tasks it may kill instead
+ * of every process in the system.  A bucket is 32 values wide, which
+ * gives each of the Android process classes its own bucket.
+ */
+#define LOWMEM_ADJ_BUCKET_SHIFT		5
+#define LOWMEM_ADJ_BUCKETS		\
+	(((OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN) >> LOWMEM_ADJ_BUCKET_SHIFT) + 1)
+
+static struct list_head lowmem_adj_buckets[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static bool lowmem_adj_index_ready;
+
+static inline int lowmem_adj_bucket(int oom_score_adj)
+{
+	return (oom_score_adj - OOM_SCORE_ADJ_MIN) >> LOWMEM_ADJ_BUCKET_SHIFT;
+}
+
+/*
+ * Called after the task is forked and whenever its oom_score_adj changed.
+ * The value is read under lowmem_adj_lock, so concurrent writers leave the
+ * task in the bucket of the last value.  A task that release_task() has
+ * already unhashed is not put back.  Tasks forked before the driver is
+ * initialised are skipped here and added by lowmem_adj_index_init().
+ */
+void lowmem_adj_index_update(struct task_struct *task)
+{
+	struct task_struct *leader;
+
+	rcu_read_lock();
+	leader = task->group_leader;
+	spin_lock(&lowmem_adj_lock);
+	if (lowmem_adj_index_ready && pid_alive(leader) &&
+	    thread_group_leader(leader))
+		list_move_tail(&leader->lmk_adj_node,
+			&lowmem_adj_buckets[lowmem_adj_bucket(
+				leader->signal->oom_score_adj)]);
+	spin_unlock(&lowmem_adj_lock);
+	rcu_read_unlock();
+}
+
+/*
+ * Called from release_task() once @task is unhashed.  An update that saw
+ * it alive under lowmem_adj_lock has linked it by the time we get the
+ * lock, and any later update fails its pid_alive() check, so the node
+ * must be checked and removed under the lock.
+ */
+void lowmem_adj_index_remove(struct task_struct *task)
+{
+	spin_lock(&lowmem_adj_lock);
+	if (!list_empty(&task->lmk_adj_node))
+		list_del_init(&task->lmk_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+static void __init lowmem_adj_index_init(void)
+{
+	struct task_struct *tsk;
+	int i;
+
+	spin_lock(&lowmem_adj_lock);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_buckets[i]);
+	lowmem_adj_index_ready = true;
+	spin_unlock(&lowmem_adj_lock);
+
+	/* Pick up the tasks forked before the index existed */
+	rcu_read_lock();
+	for_each_process(tsk)
+		lowmem_adj_index_update(tsk);
+	rcu_read_unlock();
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -224,6 +302,8 @@ extern atomic_t zswap_stored_pages;
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *tsk;
+	u64 start, scan_start;
+	int bucket, min_bucket, nr_scanned = 0, nr_selected = 0;
 #ifdef ENHANCED_LMK_ROUTINE
 	struct task_struct *selected[LOWMEM_DEATHPENDING_DEPTH] = {NULL,};
 #else
@@ -249,6 +329,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	struct reclaim_state *reclaim_state = current->reclaim_state;
 	struct zone *zone;
 
+	start = local_clock();
 #if defined(CONFIG_ZRAM_FOR_ANDROID) || defined(CONFIG_ZSWAP)
 	other_file -= total_swapcache_pages;
 #endif
@@ -321,91 +402,131 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	atomic_set(&s_reclaim.lmk_running, 1);
 #endif
-	read_lock(&tasklist_lock);
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	scan_start = local_clock();
+	min_bucket = lowmem_adj_bucket(min_score_adj);
+	/*
+	 * The index lock is only held for one bucket at a time, so that forks,
+	 * exits and adj writes wait for at most that.  RCU keeps the selected
+	 * tasks around between buckets until they are pinned below.
+	 */
+	rcu_read_lock();
+	for (bucket = LOWMEM_ADJ_BUCKETS - 1; bucket >= min_bucket; bucket--) {
+		/*
+		 * Every task in a lower bucket has a lower oom_score_adj than the
+		 * ones already selected, so stop once the selection is full.
+		 */
 #ifdef ENHANCED_LMK_ROUTINE
-		int is_exist_oom_task = 0;
+		if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH)
+			break;
+#else
+		if (selected)
+			break;
 #endif
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+		spin_lock(&lowmem_adj_lock);
+		list_for_each_entry(tsk, &lowmem_adj_buckets[bucket], lmk_adj_node) {
+			struct task_struct *p;
+			int oom_score_adj;
+#ifdef ENHANCED_LMK_ROUTINE
+			int is_exist_oom_task = 0;
+#endif
+			nr_scanned++;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
 
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
+			oom_score_adj = p->signal->oom_score_adj;
+			if (oom_score_adj < min_score_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
 #if defined(CONFIG_ZSWAP)
-		if (atomic_read(&zswap_stored_pages)) {
-			lowmem_print(3, "shown tasksize : %d\n", tasksize);
-			tasksize += atomic_read(&zswap_pool_pages) * get_mm_counter(p->mm, MM_SWAPENTS)
-				/ atomic_read(&zswap_stored_pages);
-			lowmem_print(3, "real tasksize : %d\n", tasksize);
-		}
+			if (atomic_read(&zswap_stored_pages)) {
+				lowmem_print(3, "shown tasksize : %d\n", tasksize);
+				tasksize += atomic_read(&zswap_pool_pages) * get_mm_counter(p->mm, MM_SWAPENTS)
+					/ atomic_read(&zswap_stored_pages);
+				lowmem_print(3, "real tasksize : %d\n", tasksize);
+			}
 #endif
 
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
 
 #ifdef ENHANCED_LMK_ROUTINE
-		if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH) {
-			for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-				if (!selected[i]) {
-					is_exist_oom_task = 1;
-					max_selected_oom_idx = i;
-					break;
-				}
-			}
-		} else if (selected_oom_score_adj[max_selected_oom_idx] < oom_score_adj ||
-			(selected_oom_score_adj[max_selected_oom_idx] == oom_score_adj &&
-			selected_tasksize[max_selected_oom_idx] < tasksize)) {
-			is_exist_oom_task = 1;
-		}
-
-		if (is_exist_oom_task) {
-			selected[max_selected_oom_idx] = p;
-			selected_tasksize[max_selected_oom_idx] = tasksize;
-			selected_oom_score_adj[max_selected_oom_idx] = oom_score_adj;
-
-			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
-				all_selected_oom++;
-
-			if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH) {
+			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH) {
 				for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-					if (selected_oom_score_adj[i] < selected_oom_score_adj[max_selected_oom_idx])
-						max_selected_oom_idx = i;
-					else if (selected_oom_score_adj[i] == selected_oom_score_adj[max_selected_oom_idx] &&
-						selected_tasksize[i] < selected_tasksize[max_selected_oom_idx])
+					if (!selected[i]) {
+						is_exist_oom_task = 1;
 						max_selected_oom_idx = i;
+						break;
+					}
 				}
+			} else if (selected_oom_score_adj[max_selected_oom_idx] < oom_score_adj ||
+				(selected_oom_score_adj[max_selected_oom_idx] == oom_score_adj &&
+				selected_tasksize[max_selected_oom_idx] < tasksize)) {
+				is_exist_oom_task = 1;
 			}
 
-			lowmem_print(2, "select %d (%s), adj %d, \
-					size %d, to kill\n",
-				p->pid, p->comm, oom_score_adj, tasksize);
-		}
+			if (is_exist_oom_task) {
+				selected[max_selected_oom_idx] = p;
+				selected_tasksize[max_selected_oom_idx] = tasksize;
+				selected_oom_score_adj[max_selected_oom_idx] = oom_score_adj;
+
+				if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
+					all_selected_oom++;
+
+				if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH) {
+					for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+						if (selected_oom_score_adj[i] < selected_oom_score_adj[max_selected_oom_idx])
+							max_selected_oom_idx = i;
+						else if (selected_oom_score_adj[i] == selected_oom_score_adj[max_selected_oom_idx] &&
+							selected_tasksize[i] < selected_tasksize[max_selected_oom_idx])
+							max_selected_oom_idx = i;
+					}
+				}
+
+				lowmem_print(2, "select %d (%s), adj %d, \
+						size %d, to kill\n",
+					p->pid, p->comm, oom_score_adj, tasksize);
+			}
 #else
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
+			if (selected) {
+				if (oom_score_adj < selected_oom_score_adj)
+					continue;
+				if (oom_score_adj == selected_oom_score_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_score_adj, tasksize);
 #endif
+		}
+		spin_unlock(&lowmem_adj_lock);
 	}
+#ifdef ENHANCED_LMK_ROUTINE
+	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+		if (selected[i]) {
+			get_task_struct(selected[i]);
+			nr_selected++;
+		}
+	}
+#else
+	if (selected) {
+		get_task_struct(selected);
+		nr_selected++;
+	}
+#endif
+	rcu_read_unlock();
+	trace_lowmem_scan(min_score_adj, LOWMEM_ADJ_BUCKETS - 1 - bucket,
+			  nr_scanned, nr_selected, local_clock() - scan_start);
+
 #ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
 		if (selected[i]) {
@@ -414,6 +535,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 				     selected[i]->pid, selected[i]->comm,
 				     selected_oom_score_adj[i],
 				     selected_tasksize[i]);
+			trace_lowmem_kill(selected[i], selected_oom_score_adj[i],
+					  selected_tasksize[i],
+					  local_clock() - start);
 			lowmem_deathpending[i] = selected[i];
 			lowmem_deathpending_timeout = jiffies + HZ;
 			send_sig(SIGKILL, selected[i], 0);
@@ -423,6 +547,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #ifdef LMK_COUNT_READ
 			lmk_count++;
 #endif
+			put_task_struct(selected[i]);
 		}
 	}
 #else
@@ -430,6 +555,8 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_score_adj, selected_tasksize);
+		trace_lowmem_kill(selected, selected_oom_score_adj,
+				  selected_tasksize, local_clock() - start);
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
@@ -439,11 +566,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #ifdef LMK_COUNT_READ
 		lmk_count++;
 #endif
+		put_task_struct(selected);
 	}
 #endif
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	atomic_set(&s_reclaim.lmk_running, 0);
 #endif
@@ -1016,6 +1143,7 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_adj_index_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 #ifdef CONFIG_MEMORY_HOTPLUG
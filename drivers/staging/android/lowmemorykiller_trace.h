@@ -0,0 +1,76 @@
+/*
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_scan,
+	TP_PROTO(int min_score_adj, int nr_buckets, int nr_scanned,
+		 int nr_selected, u64 duration),
+	TP_ARGS(min_score_adj, nr_buckets, nr_scanned, nr_selected, duration),
+
+	TP_STRUCT__entry(
+		__field(int, min_score_adj)
+		__field(int, nr_buckets)
+		__field(int, nr_scanned)
+		__field(int, nr_selected)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->min_score_adj = min_score_adj;
+		__entry->nr_buckets = nr_buckets;
+		__entry->nr_scanned = nr_scanned;
+		__entry->nr_selected = nr_selected;
+		__entry->duration = duration;
+	),
+	TP_printk("min_adj=%d buckets=%d scanned=%d selected=%d duration=%lluns",
+		  __entry->min_score_adj, __entry->nr_buckets,
+		  __entry->nr_scanned, __entry->nr_selected,
+		  (unsigned long long)__entry->duration)
+);
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *task, int oom_score_adj, int tasksize,
+		 u64 latency),
+	TP_ARGS(task, oom_score_adj, tasksize, latency),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, oom_score_adj)
+		__field(int, tasksize)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->pid = task->pid;
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->oom_score_adj = oom_score_adj;
+		__entry->tasksize = tasksize;
+		__entry->latency = latency;
+	),
+	TP_printk("pid=%d comm=%s oom_score_adj=%d size=%d latency=%lluns",
+		  __entry->pid, __entry->comm, __entry->oom_score_adj,
+		  __entry->tasksize, (unsigned long long)__entry->latency)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
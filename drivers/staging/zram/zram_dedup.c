@@ -0,0 +1,189 @@
+/*
+ * Compressed RAM block device - deduplication of compressed objects
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Identical pages compress to identical objects, so pages are matched
+ * by comparing their compressed form: it is much shorter than the page
+ * and is already at hand once the write path has compressed it.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* Average number of pages per hash bucket */
+#define ZRAM_PAGES_PER_HASH	64
+
+u32 zram_dedup_checksum(unsigned char *mem, unsigned int len)
+{
+	return jhash(mem, len, 0);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			unsigned char *mem, unsigned int len)
+{
+	unsigned char *cmem;
+	bool match;
+
+	if (entry->len != len)
+		return false;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(cmem, mem, len);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look for an object with the same compressed content. On success the
+ * returned entry carries an extra reference for the caller.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, unsigned char *mem,
+				unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, checksum);
+	struct zram_entry *entry;
+	struct rb_node *node;
+
+	spin_lock(&hash->lock);
+	node = hash->rb_root.rb_node;
+	while (node) {
+		entry = rb_entry(node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		node = checksum < entry->checksum ?
+			node->rb_left : node->rb_right;
+	}
+
+	/* Checksums can collide, so walk every entry that shares it */
+	if (node) {
+		struct rb_node *prev;
+
+		while ((prev = rb_prev(node)) &&
+		       rb_entry(prev, struct zram_entry,
+				rb_node)->checksum == checksum)
+			node = prev;
+
+		for (; node; node = rb_next(node)) {
+			entry = rb_entry(node, struct zram_entry, rb_node);
+			if (entry->checksum != checksum)
+				break;
+			if (zram_dedup_match(zram, entry, mem, len)) {
+				entry->refcount++;
+				spin_unlock(&hash->lock);
+				atomic64_inc(&zram->stats.dedup_hits);
+				return entry;
+			}
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/* Wrap a freshly stored object in an entry with a single reference */
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, checksum);
+	struct zram_entry *entry, *cur;
+	struct rb_node **link, *parent = NULL;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&hash->lock);
+	link = &hash->rb_root.rb_node;
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, link);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference. The object is freed with the last one, in which
+ * case true is returned.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, entry->checksum);
+
+	spin_lock(&hash->lock);
+	if (--entry->refcount) {
+		spin_unlock(&hash->lock);
+		return false;
+	}
+	rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+
+	return true;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = roundup_pow_of_two(
+			max_t(size_t, num_pages / ZRAM_PAGES_PER_HASH, 1));
+	zram->hash = vzalloc(zram->hash_size * sizeof(struct zram_hash));
+	if (!zram->hash) {
+		pr_err("Error allocating dedup hash table\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+/* All entries must have been put already */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
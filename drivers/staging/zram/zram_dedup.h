@@ -0,0 +1,48 @@
+/*
+ * Compressed RAM block device - deduplication of compressed objects
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+
+struct zram;
+
+/*
+ * A compressed object that may be shared by several table slots. When
+ * dedup is enabled, table.handle points to one of these instead of
+ * holding the zsmalloc handle directly.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 len;
+	u32 checksum;
+	unsigned long refcount;	/* protected by the bucket lock */
+	unsigned long handle;	/* zsmalloc handle of the object */
+};
+
+/* Hash bucket, entries are kept in an rbtree ordered by checksum */
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
+u32 zram_dedup_checksum(unsigned char *mem, unsigned int len);
+struct zram_entry *zram_dedup_find(struct zram *zram, unsigned char *mem,
+				unsigned int len, u32 checksum);
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				unsigned int len, u32 checksum);
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+#endif
@@ -23,13 +23,17 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -42,68 +46,318 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v + 1;
+	return zram->table[index].value & BIT(flag);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v - 1;
+	zram->table[index].value |= BIT(flag);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_clear_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	zram->table[index].value &= ~BIT(flag);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
 {
-	zram_stat64_add(zram, v, 1);
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
-static int zram_test_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+/*
+ * Per-slot lock. Protects the handle, size and flags of a table entry
+ * so that I/O to different slots never contends on a device-wide lock.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
 {
-	return zram->table[index].flags & BIT(flag);
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_slot_unlock(struct zram *zram, u32 index)
 {
-	zram->table[index].flags |= BIT(flag);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Called with the slot lock held */
+static void zram_accessed(struct zram *zram, u32 index)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram->table[index].ac_time = jiffies;
 }
 
-static int page_zero_filled(void *ptr)
+static unsigned long zram_alloc_block(struct zram *zram)
 {
-	unsigned int pos;
+	unsigned long blk;
+
+	/* Block 0 is never handed out, so a written back slot has a handle */
+	do {
+		blk = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+		if (blk >= zram->nr_pages)
+			return 0;
+	} while (test_and_set_bit(blk, zram->bitmap));
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk, zram->bitmap));
+}
+#else
+static inline void zram_accessed(struct zram *zram, u32 index) {}
+static inline void zram_free_block(struct zram *zram, unsigned long blk) {}
+#endif
+
+/* zsmalloc handle of a compressed slot, looking through dedup entries */
+static unsigned long zram_get_zs_handle(struct zram *zram, void *handle)
+{
+	if (zram->use_dedup)
+		return ((struct zram_entry *)handle)->handle;
+
+	return (unsigned long)handle;
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
+{
+	unsigned int pos, last_pos = PAGE_SIZE / sizeof(unsigned long) - 1;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	/* Most pages that differ do so at either end, check the tail early */
+	if (val != page[last_pos])
+		return 0;
+
+	for (pos = 1; pos < last_pos; pos++) {
+		if (val != page[pos])
 			return 0;
 	}
 
+	*element = val;
+
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned long pos;
+
+	if (likely(!value)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+static void zram_comp_strm_free(struct zram_comp_strm *zstrm)
+{
+	if (zstrm->tfm)
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_comp_strm *zram_comp_strm_alloc(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	if (IS_ERR(zstrm->tfm)) {
+		zstrm->tfm = NULL;
+		zram_comp_strm_free(zstrm);
+		return NULL;
+	}
+
+	/* Incompressible data can make the output larger than a page */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->buffer) {
+		zram_comp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle compression stream, sleeping until one is released if
+ * all are busy. Streams are allocated up front by zram_init_device()
+ * and zram_set_max_comp_streams() so the I/O path never allocates.
+ */
+static struct zram_comp_strm *zram_comp_strm_find(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&zram->strm_lock);
+		if (!list_empty(&zram->idle_strm)) {
+			zstrm = list_entry(zram->idle_strm.next,
+					struct zram_comp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&zram->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&zram->strm_lock);
+		wait_event(zram->strm_wait, !list_empty(&zram->idle_strm));
+	}
+}
+
+static void zram_comp_strm_release(struct zram *zram,
+				   struct zram_comp_strm *zstrm)
+{
+	spin_lock(&zram->strm_lock);
+	list_add(&zstrm->list, &zram->idle_strm);
+	spin_unlock(&zram->strm_lock);
+	wake_up(&zram->strm_wait);
+}
+
+/* Called with no I/O in flight, i.e. every stream is idle */
+static void zram_comp_strm_destroy(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (!list_empty(&zram->idle_strm)) {
+		zstrm = list_entry(zram->idle_strm.next,
+				struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_comp_strm_free(zstrm);
+	}
+	zram->avail_strm = 0;
+}
+
+/* Called with init_lock held for writing, so no stream is busy */
+static int zram_comp_strm_resize(struct zram *zram, int num)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (zram->avail_strm > num) {
+		zstrm = list_entry(zram->idle_strm.next,
+				struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_comp_strm_free(zstrm);
+		zram->avail_strm--;
+	}
+
+	while (zram->avail_strm < num) {
+		zstrm = zram_comp_strm_alloc(zram);
+		if (!zstrm)
+			return -ENOMEM;
+		list_add(&zstrm->list, &zram->idle_strm);
+		zram->avail_strm++;
+	}
+
+	return 0;
+}
+
+/* Called with init_lock held for writing */
+int zram_set_max_comp_streams(struct zram *zram, int num)
+{
+	int ret = 0;
+
+	if (zram->init_done) {
+		ret = zram_comp_strm_resize(zram, num);
+		/* Show what we got if growing failed part way */
+		if (ret)
+			num = zram->avail_strm;
+	}
+	zram->max_strm = num;
+
+	return ret;
+}
+
+/*
+ * Decompression keeps no state between calls for the algorithms zram
+ * offers, but the crypto API only allows one user of a tfm at a time.
+ * Reads therefore get a tfm of their own per CPU. They run with the
+ * slot lock held, i.e. preemption disabled, so they never wait for
+ * writers holding the compression streams.
+ */
+static void zram_decomp_tfm_free(struct zram *zram)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	if (!zram->decomp_tfm)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		tfm = *per_cpu_ptr(zram->decomp_tfm, cpu);
+		if (tfm)
+			crypto_free_comp(tfm);
+	}
+	free_percpu(zram->decomp_tfm);
+	zram->decomp_tfm = NULL;
+}
+
+static int zram_decomp_tfm_alloc(struct zram *zram)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	zram->decomp_tfm = alloc_percpu(struct crypto_comp *);
+	if (!zram->decomp_tfm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(tfm)) {
+			zram_decomp_tfm_free(zram);
+			return PTR_ERR(tfm);
+		}
+		*per_cpu_ptr(zram->decomp_tfm, cpu) = tfm;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the stats slot of the device's compressor, claiming a free one
+ * on first use. Slots survive device resets so that algorithms can be
+ * compared after switching between them.
+ */
+static struct zram_comp_stats *zram_get_comp_stats(struct zram *zram)
+{
+	struct zram_comp_stats *cstats;
+	int i;
+
+	for (i = 0; i < ZRAM_MAX_COMP_STATS; i++) {
+		cstats = &zram->comp_stats[i];
+		if (!cstats->name[0] || !strcmp(cstats->name, zram->compressor))
+			break;
+	}
+
+	/* Out of slots, recycle the last one */
+	if (i == ZRAM_MAX_COMP_STATS)
+		memset(cstats, 0, sizeof(*cstats));
+
+	if (!cstats->name[0])
+		strlcpy(cstats->name, zram->compressor, sizeof(cstats->name));
+
+	return cstats;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,197 +387,388 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* Called with the slot lock held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
+	size_t size;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	/* Only a block of the backing device is held */
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, (unsigned long)handle);
+		atomic64_dec(&zram->stats.bd_count);
+		zram->table[index].handle = NULL;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same filled pages, handle holds
+	 * the fill word. Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!handle)
+			atomic_dec(&zram->stats.pages_zero);
+		atomic_dec(&zram->stats.pages_same);
+		zram->table[index].handle = NULL;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
+	size = zram_get_obj_size(zram, index);
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
+		atomic_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	zs_free(zram->mem_pool, (unsigned long)handle);
+	if (zram->use_dedup) {
+		/* Other slots still use the object */
+		if (!zram_dedup_put(zram, handle))
+			atomic64_sub(size, &zram->stats.dedup_saved);
+	} else {
+		zs_free(zram->mem_pool, (unsigned long)handle);
+	}
 
-	if (zram->table[index].size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	if (size <= PAGE_SIZE / 2)
+		atomic_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+	atomic64_sub(size, &zram->stats.compr_size);
+	atomic_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = NULL;
-	zram->table[index].size = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+static inline int is_partial_io(struct bio_vec *bvec)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	return bvec->bv_len != PAGE_SIZE;
+}
 
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Tracks the bios of one backing device operation */
+struct zram_bio_ctl {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
+static void zram_bio_ctl_init(struct zram_bio_ctl *ctl)
+{
+	atomic_set(&ctl->pending, 1);
+	ctl->error = 0;
+	init_completion(&ctl->done);
+}
 
-	flush_dcache_page(page);
+static void zram_bio_end_io(struct bio *bio, int err)
+{
+	struct zram_bio_ctl *ctl = bio->bi_private;
+
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ctl->error = -EIO;
+	if (atomic_dec_and_test(&ctl->pending))
+		complete(&ctl->done);
+	bio_put(bio);
 }
 
-static inline int is_partial_io(struct bio_vec *bvec)
+static struct bio *zram_bio_alloc(struct zram *zram, unsigned long blk,
+				  int nr_pages)
 {
-	return bvec->bv_len != PAGE_SIZE;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, min_t(int, nr_pages, BIO_MAX_PAGES));
+	if (!bio)
+		return NULL;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	return bio;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+static void zram_bio_submit(struct zram_bio_ctl *ctl, struct bio *bio, int rw)
 {
-	int ret;
-	size_t clen;
-	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	bio->bi_end_io = zram_bio_end_io;
+	bio->bi_private = ctl;
+	atomic_inc(&ctl->pending);
+	submit_bio(rw, bio);
+}
 
-	page = bvec->bv_page;
+/* Wait for all bios submitted through @ctl */
+static int zram_bio_wait(struct zram_bio_ctl *ctl)
+{
+	if (!atomic_dec_and_test(&ctl->pending))
+		wait_for_completion(&ctl->done);
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
-	}
+	return ctl->error;
+}
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
+/*
+ * Read a written back slot into @page. Returns -EAGAIN if the slot
+ * left the backing device meanwhile; the caller then looks it up again.
+ */
+static int zram_read_from_bdev(struct zram *zram, u32 index,
+			       struct page *page)
+{
+	struct zram_bio_ctl ctl;
+	unsigned long blk;
+	struct bio *bio;
+
+	zram_slot_lock(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_slot_unlock(zram, index);
+		return -EAGAIN;
 	}
+	blk = (unsigned long)zram->table[index].handle;
+	zram_slot_unlock(zram, index);
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
+	bio = zram_bio_alloc(zram, blk, 1);
+	if (!bio)
+		return -ENOMEM;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
-	}
+	zram_bio_ctl_init(&ctl);
+	zram_bio_submit(&ctl, bio, READ);
+	atomic64_inc(&zram->stats.bd_reads);
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
+	return zram_bio_wait(&ctl);
+}
 
-	cmem = zs_map_object(zram->mem_pool, (unsigned long)zram->table[index].handle, ZS_MM_RW);
+/* Same as zram_read_from_bdev() but into a kernel buffer */
+static int zram_read_from_bdev_mem(struct zram *zram, u32 index,
+				   unsigned char *mem)
+{
+	struct page *page;
+	void *src;
+	int ret;
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
 
-	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
-		kfree(uncmem);
+	ret = zram_read_from_bdev(zram, index, page);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
 	}
+	__free_page(page);
 
-	zs_unmap_object(zram->mem_pool, (unsigned long)zram->table[index].handle);
-	kunmap_atomic(user_mem);
+	return ret;
+}
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+static int zram_bvec_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+				    u32 index, int offset)
+{
+	struct page *page;
+	unsigned char *src, *dst;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, index, bvec->bv_page);
+		goto out;
 	}
 
-	flush_dcache_page(page);
+	/* Read the whole page, then copy out the requested part */
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
 
-	return 0;
+	ret = zram_read_from_bdev(zram, index, page);
+	if (!ret) {
+		src = kmap_atomic(page);
+		dst = kmap_atomic(bvec->bv_page);
+		memcpy(dst + bvec->bv_offset, src + offset, bvec->bv_len);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+
+out:
+	if (!ret)
+		flush_dcache_page(bvec->bv_page);
+	return ret;
+}
+#else
+static inline int zram_read_from_bdev_mem(struct zram *zram, u32 index,
+					  unsigned char *mem)
+{
+	return -EIO;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+static inline int zram_bvec_read_from_bdev(struct zram *zram,
+				struct bio_vec *bvec, u32 index, int offset)
 {
-	int ret;
-	size_t clen = PAGE_SIZE;
+	return -EIO;
+}
+#endif
+
+/*
+ * Decompress the object stored in slot @index into @mem. The slot lock
+ * is held across the copy so a concurrent write or free of the same
+ * slot cannot release the object from under us. Returns -EAGAIN if
+ * the slot is on the backing device, which is read in sleepable
+ * context by the caller.
+ */
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
+{
+	int ret = 0;
+	unsigned int clen = PAGE_SIZE;
+	struct zram_comp_stats *cstats = zram->cur_comp_stats;
 	struct zobj_header *zheader;
 	unsigned char *cmem;
+	unsigned long zs_handle;
+	void *handle;
+	u64 start;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
+	zram_slot_lock(zram, index);
+	handle = zram->table[index].handle;
+	if (!handle || zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_slot_unlock(zram, index);
+		zram_fill_page(mem, PAGE_SIZE, (unsigned long)handle);
 		return 0;
 	}
 
-	cmem = zs_map_object(zram->mem_pool, (unsigned long)zram->table[index].handle, ZS_MM_RO);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_slot_unlock(zram, index);
+		return -EAGAIN;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
-		return 0;
+	} else {
+		zs_handle = zram_get_zs_handle(zram, handle);
+		cmem = zs_map_object(zram->mem_pool, zs_handle, ZS_MM_RO);
+		start = local_clock();
+		ret = crypto_comp_decompress(*this_cpu_ptr(zram->decomp_tfm),
+					     cmem + sizeof(*zheader),
+					     zram_get_obj_size(zram, index),
+					     mem, &clen);
+		atomic64_add(local_clock() - start, &cstats->decompress_ns);
+		atomic64_inc(&cstats->nr_decompress);
+		zs_unmap_object(zram->mem_pool, zs_handle);
+		if (!ret && clen != PAGE_SIZE)
+			ret = -EINVAL;
 	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, (unsigned long)zram->table[index].handle);
+	zram_slot_unlock(zram, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		atomic64_inc(&zram->stats.failed_reads);
 		return ret;
 	}
 
 	return 0;
 }
 
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *uncmem = NULL;
+
+	page = bvec->bv_page;
+
+again:
+	zram_slot_lock(zram, index);
+	if (unlikely(!zram->table[index].handle) ||
+	    zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = (unsigned long)zram->table[index].handle;
+
+		zram_slot_unlock(zram, index);
+		handle_same_page(bvec, element);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_slot_unlock(zram, index);
+		ret = zram_bvec_read_from_bdev(zram, bvec, index, offset);
+		if (ret == -EAGAIN)
+			goto again;
+		return ret;
+	}
+	zram_accessed(zram, index);
+	zram_slot_unlock(zram, index);
+
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	user_mem = kmap_atomic(page);
+	if (!is_partial_io(bvec))
+		uncmem = user_mem;
+
+	ret = zram_decompress_page(zram, uncmem, index);
+
+	if (is_partial_io(bvec)) {
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
+		kfree(uncmem);
+	}
+	kunmap_atomic(user_mem);
+
+	/* Written back since the check above */
+	if (ret == -EAGAIN)
+		goto again;
+	if (ret)
+		return ret;
+
+	flush_dcache_page(page);
+
+	return 0;
+}
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
-	size_t clen;
+	unsigned int clen = PAGE_SIZE * 2;
+	unsigned long element, zs_handle;
+	struct zram_entry *entry;
+	u32 checksum = 0;
 	void *handle;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct page *page, *page_store = NULL;
+	struct zram_comp_strm *zstrm;
+	struct zram_comp_stats *cstats = zram->cur_comp_stats;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	u64 start;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
+	/* May sleep, so grab the stream before mapping the page */
+	zstrm = zram_comp_strm_find(zram);
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -336,47 +781,56 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		do {
+			ret = zram_decompress_page(zram, uncmem, index);
+			if (ret == -EAGAIN)
+				ret = zram_read_from_bdev_mem(zram, index,
+							      uncmem);
+		} while (ret == -EAGAIN);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_slot_lock(zram, index);
+		zram_free_page(zram, index);
+		zram->table[index].handle = (void *)element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_slot_unlock(zram, index);
+		if (!element)
+			atomic_inc(&zram->stats.pages_zero);
+		atomic_inc(&zram->stats.pages_same);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	start = local_clock();
+	ret = crypto_comp_compress(zstrm->tfm, uncmem, PAGE_SIZE,
+				   zstrm->buffer, &clen);
+	atomic64_add(local_clock() - start, &cstats->compress_ns);
+	atomic64_inc(&cstats->nr_compress);
 
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (user_mem)
+		kunmap_atomic(user_mem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -396,78 +850,380 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
 		handle = page_store;
-		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
+		src = is_partial_io(bvec) ? uncmem : kmap_atomic(page);
+		memcpy(cmem, src, PAGE_SIZE);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src);
+		kunmap_atomic(cmem);
 		goto memstore;
 	}
 
-	handle = (void *)zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
-	if (!handle) {
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(zstrm->buffer, clen);
+		entry = zram_dedup_find(zram, zstrm->buffer, clen, checksum);
+		if (entry) {
+			handle = entry;
+			atomic64_add(clen, &zram->stats.dedup_saved);
+			goto memstore;
+		}
+	}
+
+	zs_handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+			      GFP_NOIO | __GFP_HIGHMEM);
+	if (!zs_handle) {
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
-	cmem = zs_map_object(zram->mem_pool, (unsigned long)handle, ZS_MM_WO);
+	cmem = zs_map_object(zram->mem_pool, zs_handle, ZS_MM_WO);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, zs_handle);
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, (unsigned long)handle);
+	handle = (void *)zs_handle;
+	if (zram->use_dedup) {
+		entry = zram_dedup_insert(zram, zs_handle, clen, checksum);
+		if (!entry) {
+			zs_free(zram->mem_pool, zs_handle);
+			pr_info("Error allocating dedup entry for "
+				"page: %u\n", index);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = entry;
 	}
 
+memstore:
+	zram_comp_strm_release(zram, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_slot_lock(zram, index);
+	zram_free_page(zram, index);
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	if (page_store)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_accessed(zram, index);
+	zram_slot_unlock(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+	atomic64_add(PAGE_SIZE, &cstats->orig_size);
+	atomic64_add(clen, &cstats->compr_size);
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic_inc(&zram->stats.pages_stored);
+	if (page_store)
+		atomic_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		atomic_inc(&zram->stats.good_compress);
 
 out:
+	if (zstrm)
+		zram_comp_strm_release(zram, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Pages of one writeback batch, see zram_writeback() */
+struct zram_wb_batch {
+	struct page *pages[ZRAM_WB_BATCH];
+	u32 index[ZRAM_WB_BATCH];
+	unsigned long blk[ZRAM_WB_BATCH];
+	int nr;
+};
+
+/* Mark slot @index for writeback if @mode selects it */
+static bool zram_wb_claim(struct zram *zram, u32 index, enum zram_wb_mode mode)
 {
-	int ret;
+	bool claim = false;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+	zram_slot_lock(zram, index);
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		goto out;
+
+	switch (mode) {
+	case ZRAM_WB_IDLE:
+		claim = zram_test_flag(zram, index, ZRAM_IDLE);
+		break;
+	case ZRAM_WB_HUGE:
+		claim = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+		break;
+	case ZRAM_WB_HUGE_IDLE:
+		claim = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) &&
+			zram_test_flag(zram, index, ZRAM_IDLE);
+		break;
+	}
+
+	if (claim)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+out:
+	zram_slot_unlock(zram, index);
+	return claim;
+}
+
+static void zram_wb_unclaim(struct zram *zram, u32 index)
+{
+	zram_slot_lock(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_slot_unlock(zram, index);
+}
+
+/*
+ * Write the batch out, merging consecutive blocks into one bio, then
+ * switch each slot over to its block unless it was freed, rewritten
+ * or (for idle writeback) accessed while the I/O was in flight.
+ */
+static int zram_wb_flush(struct zram *zram, struct zram_wb_batch *batch,
+			 enum zram_wb_mode mode)
+{
+	struct zram_bio_ctl ctl;
+	struct bio *bio = NULL;
+	u32 index;
+	int i, ret;
+
+	zram_bio_ctl_init(&ctl);
+	for (i = 0; i < batch->nr; i++) {
+		if (bio && batch->blk[i] == batch->blk[i - 1] + 1 &&
+		    bio_add_page(bio, batch->pages[i], PAGE_SIZE, 0))
+			continue;
+
+		if (bio)
+			zram_bio_submit(&ctl, bio, WRITE);
+		bio = zram_bio_alloc(zram, batch->blk[i], batch->nr - i);
+		if (!bio) {
+			ctl.error = -ENOMEM;
+			break;
+		}
+		bio_add_page(bio, batch->pages[i], PAGE_SIZE, 0);
+	}
+	if (bio)
+		zram_bio_submit(&ctl, bio, WRITE);
+
+	ret = zram_bio_wait(&ctl);
+	if (!ret)
+		atomic64_add(batch->nr, &zram->stats.bd_writes);
+
+	for (i = 0; i < batch->nr; i++) {
+		index = batch->index[i];
+
+		zram_slot_lock(zram, index);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    (mode != ZRAM_WB_HUGE &&
+		     !zram_test_flag(zram, index, ZRAM_IDLE))) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_slot_unlock(zram, index);
+			zram_free_block(zram, batch->blk[i]);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram->table[index].handle = (void *)batch->blk[i];
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_slot_unlock(zram, index);
+		atomic64_inc(&zram->stats.bd_count);
+	}
+	batch->nr = 0;
+
+	return ret;
+}
+
+/*
+ * Move the slots selected by @mode to the backing device, ZRAM_WB_BATCH
+ * pages at a time. Called with init_lock held for reading on an
+ * initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	struct zram_wb_batch *batch;
+	unsigned long index, blk;
+	int i, err, ret = 0;
+	void *mem;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		batch->pages[i] = alloc_page(GFP_KERNEL);
+		if (!batch->pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	mutex_lock(&zram->wb_lock);
+	for (index = 0; index < nr_pages && !ret; index++) {
+		/* No atomic mapping or slot lock is held between slots */
+		cond_resched();
+
+		if (!zram_wb_claim(zram, index, mode))
+			continue;
+
+		blk = zram_alloc_block(zram);
+		if (!blk) {
+			zram_wb_unclaim(zram, index);
+			ret = -ENOSPC;
+			break;
+		}
+
+		mem = kmap_atomic(batch->pages[batch->nr]);
+		err = zram_decompress_page(zram, mem, index);
+		kunmap_atomic(mem);
+		if (err) {
+			zram_wb_unclaim(zram, index);
+			zram_free_block(zram, blk);
+			continue;
+		}
+
+		batch->index[batch->nr] = index;
+		batch->blk[batch->nr] = blk;
+		if (++batch->nr == ZRAM_WB_BATCH)
+			ret = zram_wb_flush(zram, batch, mode);
+	}
+	if (batch->nr) {
+		err = zram_wb_flush(zram, batch, mode);
+		if (!ret)
+			ret = err;
 	}
+	mutex_unlock(&zram->wb_lock);
 
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		if (batch->pages[i])
+			__free_page(batch->pages[i]);
+	}
+	kfree(batch);
 	return ret;
 }
 
+/*
+ * Mark slots last accessed at or before @cutoff (jiffies) idle. Called
+ * with init_lock held for reading on an initialized device.
+ */
+void zram_mark_idle(struct zram *zram, unsigned long cutoff)
+{
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long index;
+
+	for (index = 0; index < nr_pages; index++) {
+		zram_slot_lock(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB) &&
+		    time_before_eq(zram->table[index].ac_time, cutoff))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_slot_unlock(zram, index);
+		cond_resched();
+	}
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/* Called with init_lock held for writing, before initialization */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct file *backing_dev;
+	struct block_device *bdev;
+	struct inode *inode;
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	int err;
+
+	backing_dev = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = blkdev_get_by_dev(inode->i_rdev,
+			FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		err = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto put;
+	}
+
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto free;
+
+	zram_reset_bdev(zram);
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	pr_info("Using backing device %s, %lu pages\n", path, nr_pages);
+
+	return 0;
+
+free:
+	vfree(bitmap);
+put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out:
+	filp_close(backing_dev, NULL);
+	return err;
+}
+#else
+static inline void zram_reset_bdev(struct zram *zram) {}
+#endif
+
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
+}
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -483,10 +1239,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -562,7 +1318,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -584,23 +1340,25 @@ void __zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_comp_strm_destroy(zram);
+	zram_decomp_tfm_free(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
+		else if (zram->use_dedup)
+			zram_dedup_put(zram, handle);
 		else
 			zs_free(zram->mem_pool, (unsigned long)handle);
 	}
+	zram_dedup_fini(zram);
+	zram_reset_bdev(zram);
 
 	vfree(zram->table);
 	zram->table = NULL;
@@ -635,20 +1393,27 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
+	ret = zram_comp_strm_resize(zram, zram->max_strm);
+	if (ret) {
+		/* Carry on with fewer streams as long as there is one */
+		if (!zram->avail_strm) {
+			pr_err("Error allocating %s compression stream\n",
+				zram->compressor);
+			goto fail_no_table;
+		}
+		pr_warning("Using %d of %d compression streams\n",
+			zram->avail_strm, zram->max_strm);
+		zram->max_strm = zram->avail_strm;
+		ret = 0;
 	}
 
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_decomp_tfm_alloc(zram);
+	if (ret) {
+		pr_err("Error allocating %s decompression tfms\n",
+			zram->compressor);
 		goto fail_no_table;
 	}
+	zram->cur_comp_stats = zram_get_comp_stats(zram);
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
@@ -663,13 +1428,18 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name, GFP_KERNEL,
+					NULL);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
 	zram->init_done = 1;
 	up_write(&zram->init_lock);
 
@@ -692,8 +1462,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_slot_unlock(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -705,9 +1477,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->strm_lock);
+	INIT_LIST_HEAD(&zram->idle_strm);
+	init_waitqueue_head(&zram->strm_wait);
+	zram->max_strm = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_WRITEBACK
+	mutex_init(&zram->wb_lock);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -777,6 +1555,8 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	zram_reset_bdev(zram);
 }
 
 unsigned int zram_get_num_devices(void)
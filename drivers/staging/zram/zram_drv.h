@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/zsmalloc.h>
 
-#include "../zsmalloc/zsmalloc.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -43,6 +46,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm, any crypto_comp name can be used */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -66,13 +72,34 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the higher bits hold zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT 24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
+	ZRAM_UNCOMPRESSED = ZRAM_FLAG_SHIFT,
+
+	/*
+	 * Page is one machine word repeated; the word is kept in
+	 * table.handle and no memory is allocated
+	 */
+	ZRAM_SAME,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Slot lock bit, see zram_slot_lock() */
+	ZRAM_ACCESS,
+
+	/* Page lives on the backing device, table.handle is its block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since the last idle marking */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -82,33 +109,92 @@ enum zram_pageflags {
 /* Allocated for each disk page */
 struct table {
 	void *handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	unsigned long value;	/* object size and zram_pageflags */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	unsigned long ac_time;	/* jiffies at last read or write */
+#endif
 } __attribute__((aligned(4)));
 
+/* Pages written to the backing device per batch of bios */
+#define ZRAM_WB_BATCH		32
+
+/* What zram_writeback() moves to the backing device */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,		/* slots marked idle */
+	ZRAM_WB_HUGE,		/* incompressible slots */
+	ZRAM_WB_HUGE_IDLE,	/* incompressible slots marked idle */
+};
+
+/*
+ * Compression context. A device keeps a pool of these so that writes
+ * to different slots can be compressed in parallel.
+ */
+struct zram_comp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;		/* compressed output, two pages */
+	struct list_head list;	/* entry in zram->idle_strm */
+};
+
+/* Number of algorithms whose stats are tracked per device */
+#define ZRAM_MAX_COMP_STATS	4
+
+/*
+ * Per-algorithm compressor stats. Unlike zram_stats these are kept
+ * across device resets, so algorithms can be compared side by side.
+ */
+struct zram_comp_stats {
+	char name[CRYPTO_MAX_ALG_NAME];
+	atomic64_t nr_compress;		/* pages fed to the compressor */
+	atomic64_t compress_ns;		/* time spent compressing */
+	atomic64_t orig_size;		/* bytes stored, before compression */
+	atomic64_t compr_size;		/* --do--, after compression */
+	atomic64_t nr_decompress;	/* pages decompressed */
+	atomic64_t decompress_ns;	/* time spent decompressing */
+};
+
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;	/* compressed size of pages stored */
+	atomic64_t num_reads;	/* failed + successful */
+	atomic64_t num_writes;	/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
+	atomic64_t notify_free;	/* no. of swap slot free notifications */
+	atomic64_t dedup_hits;	/* no. of writes that shared an object */
+	atomic64_t dedup_saved;	/* compressed bytes not stored thanks to dedup */
+	atomic64_t bd_count;	/* no. of pages on the backing device */
+	atomic64_t bd_reads;	/* no. of pages read from the backing device */
+	atomic64_t bd_writes;	/* no. of pages written to it */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of same filled pages, zero included */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
-	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct table *table;	/* each slot is protected by ZRAM_ACCESS */
+	spinlock_t strm_lock;	/* protect idle_strm and avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait; /* writers waiting for an idle stream */
+	int avail_strm;		/* streams allocated, idle or busy */
+	int max_strm;		/* streams to allocate at init */
+	struct crypto_comp * __percpu *decomp_tfm; /* reads, no pool needed */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	struct zram_comp_stats comp_stats[ZRAM_MAX_COMP_STATS];
+	struct zram_comp_stats *cur_comp_stats;
+	/* Share identical compressed objects between slots, see zram_dedup.c */
+	bool use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;	/* set through sysfs before init */
+	struct block_device *bdev;
+	unsigned long *bitmap;		/* used blocks of bdev, block 0 unused */
+	unsigned long nr_pages;		/* size of bdev in pages */
+	struct mutex wb_lock;		/* one writeback pass at a time */
+#endif
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -131,5 +217,11 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern int zram_set_max_comp_streams(struct zram *zram, int num);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram, unsigned long cutoff);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
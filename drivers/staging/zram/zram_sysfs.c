@@ -13,22 +13,16 @@
  */
 
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
+#include <linux/jiffies.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/crypto.h>
+#include <linux/math64.h>
 
 #include "zram_drv.h"
 
-static u64 zram_stat64_read(struct zram *zram, u64 *v)
-{
-	u64 val;
-
-	spin_lock(&zram->stat64_lock);
-	val = *v;
-	spin_unlock(&zram->stat64_lock);
-
-	return val;
-}
-
 static struct zram *dev_to_zram(struct device *dev)
 {
 	int i;
@@ -129,7 +123,7 @@ static ssize_t num_reads_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_reads));
+		(u64)atomic64_read(&zram->stats.num_reads));
 }
 
 static ssize_t num_writes_show(struct device *dev,
@@ -138,7 +132,7 @@ static ssize_t num_writes_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_writes));
+		(u64)atomic64_read(&zram->stats.num_writes));
 }
 
 static ssize_t invalid_io_show(struct device *dev,
@@ -147,7 +141,7 @@ static ssize_t invalid_io_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.invalid_io));
+		(u64)atomic64_read(&zram->stats.invalid_io));
 }
 
 static ssize_t notify_free_show(struct device *dev,
@@ -156,7 +150,7 @@ static ssize_t notify_free_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.notify_free));
+		(u64)atomic64_read(&zram->stats.notify_free));
 }
 
 static ssize_t zero_pages_show(struct device *dev,
@@ -164,7 +158,63 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_same));
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->use_dedup);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret, val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		up_write(&zram->init_lock);
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = !!val;
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t dedup_hits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.dedup_hits));
+}
+
+static ssize_t dedup_saved_bytes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.dedup_saved));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -173,7 +223,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)(atomic_read(&zram->stats.pages_stored)) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -182,7 +232,7 @@ static ssize_t compr_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.compr_size));
+		(u64)atomic64_read(&zram->stats.compr_size));
 }
 
 static ssize_t mem_used_total_show(struct device *dev,
@@ -197,6 +247,259 @@ static ssize_t mem_used_total_show(struct device *dev,
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+	zs_compact(zram->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->max_strm);
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret, num;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = kstrtoint(buf, 10, &num);
+	if (ret)
+		return ret;
+
+	if (num < 1)
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	ret = zram_set_max_comp_streams(zram, num);
+	up_write(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+/* Algorithms offered by comp_algorithm_show(), if the crypto API has them */
+static const char * const zram_comp_algs[] = {
+	"lzo",
+	"lz4",
+	"deflate",
+	NULL
+};
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	bool listed = false;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	for (i = 0; zram_comp_algs[i]; i++) {
+		if (!strcmp(zram->compressor, zram_comp_algs[i])) {
+			sz += sprintf(buf + sz, "[%s] ", zram_comp_algs[i]);
+			listed = true;
+		} else if (crypto_has_comp(zram_comp_algs[i], 0, 0)) {
+			sz += sprintf(buf + sz, "%s ", zram_comp_algs[i]);
+		}
+	}
+	if (!listed)
+		sz += sprintf(buf + sz, "[%s] ", zram->compressor);
+	up_read(&zram->init_lock);
+
+	/* Replace the trailing space with a newline */
+	buf[sz - 1] = '\n';
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
+	if (!crypto_has_comp(name, 0, 0))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		up_write(&zram->init_lock);
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * One line per algorithm used on this device since it was created:
+ * name, pages compressed, stored/original size in percent, average ns
+ * per compression, pages decompressed, average ns per decompression.
+ */
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; i < ZRAM_MAX_COMP_STATS; i++) {
+		struct zram_comp_stats *cstats = &zram->comp_stats[i];
+		u64 nr_comp, nr_decomp, orig, compr;
+
+		if (!cstats->name[0])
+			break;
+
+		nr_comp = atomic64_read(&cstats->nr_compress);
+		nr_decomp = atomic64_read(&cstats->nr_decompress);
+		orig = atomic64_read(&cstats->orig_size);
+		compr = atomic64_read(&cstats->compr_size);
+
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz,
+			"%s %llu %llu %llu %llu %llu\n", cstats->name, nr_comp,
+			orig ? div64_u64(compr * 100, orig) : 0,
+			nr_comp ? div64_u64(atomic64_read(&cstats->compress_ns),
+					    nr_comp) : 0,
+			nr_decomp,
+			nr_decomp ?
+			div64_u64(atomic64_read(&cstats->decompress_ns),
+				  nr_decomp) : 0);
+	}
+
+	return sz;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+	char *p;
+
+	down_read(&zram->init_lock);
+	if (!zram->backing_dev) {
+		up_read(&zram->init_lock);
+		return sprintf(buf, "none\n");
+	}
+
+	p = d_path(&zram->backing_dev->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+	} else {
+		ret = strlen(p);
+		memmove(buf, p, ret);
+		buf[ret++] = '\n';
+	}
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	char *path;
+	int ret;
+
+	path = kstrndup(buf, len, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized device\n");
+		ret = -EBUSY;
+	} else {
+		ret = zram_set_backing_dev(zram, strim(path));
+	}
+	up_write(&zram->init_lock);
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+/* "all", or the number of seconds a slot must be unused to be idle */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long cutoff = jiffies;
+	unsigned int secs;
+	int ret;
+
+	if (!sysfs_streq(buf, "all")) {
+		ret = kstrtouint(buf, 10, &secs);
+		if (ret)
+			return ret;
+		cutoff -= secs * HZ;
+	}
+
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		zram_mark_idle(zram, cutoff);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	enum zram_wb_mode mode;
+	int ret;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "huge_idle"))
+		mode = ZRAM_WB_HUGE_IDLE;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		ret = zram_writeback(zram, mode);
+	else
+		ret = -EINVAL;
+	up_read(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+/* Pages currently on the backing device, read from it, written to it */
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu %llu %llu\n",
+		(u64)atomic64_read(&zram->stats.bd_count),
+		(u64)atomic64_read(&zram->stats.bd_reads),
+		(u64)atomic64_read(&zram->stats.bd_writes));
+}
+#endif
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
@@ -206,9 +509,27 @@ static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+static DEVICE_ATTR(dedup_hits, S_IRUGO, dedup_hits_show, NULL);
+static DEVICE_ATTR(dedup_saved_bytes, S_IRUGO, dedup_saved_bytes_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -219,9 +540,23 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dedup_hits.attr,
+	&dev_attr_dedup_saved_bytes.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+#endif
 	NULL,
 };
 
@@ -130,6 +130,7 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct request_queue *poll_queue; /* queue of last bio, for polling */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -423,6 +424,9 @@ static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 	if (dio->is_async && dio->rw == READ)
 		bio_set_pages_dirty(bio);
 
+	if (!dio->is_async)
+		dio->poll_queue = bdev_get_queue(bio->bi_bdev);
+
 	if (sdio->submit_io)
 		sdio->submit_io(dio->rw, bio, dio->inode,
 			       sdio->logical_offset_in_bio);
@@ -449,11 +453,26 @@ static inline void dio_cleanup(struct dio *dio, struct dio_submit *sdio)
  * all bios have been issued so that dio->refcount can only decrease.  This
  * requires that that the caller hold a reference on the dio.
  */
+static bool dio_poll_done(void *data)
+{
+	struct dio *dio = data;
+
+	return ACCESS_ONCE(dio->refcount) <= 1 ||
+		ACCESS_ONCE(dio->bio_list) != NULL;
+}
+
 static struct bio *dio_await_one(struct dio *dio)
 {
 	unsigned long flags;
 	struct bio *bio = NULL;
 
+	/*
+	 * On a queue with polling enabled, spin for a bit before sleeping.
+	 * The condition is rechecked under bio_lock below either way.
+	 */
+	if (!dio_poll_done(dio))
+		blk_poll_wait(dio->poll_queue, dio_poll_done, dio);
+
 	spin_lock_irqsave(&dio->bio_lock, flags);
 
 	/*
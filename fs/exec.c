@@ -972,6 +972,7 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+		lowmem_adj_index_update(tsk);
 	}
 
 	sig->group_exit_task = NULL;
@@ -70,6 +70,10 @@ static UINT32 get_current_msec(void)
 #define PRINT_TIME(n)
 #endif
 
+static UINT32 find_next_bitmap_bit(struct super_block *sb, UINT32 start, UINT32 end, INT32 used);
+static UINT32 pick_free_extent(struct super_block *sb, INT32 num_alloc);
+static void take_free_extent(struct super_block *sb, UINT32 start, UINT32 len);
+
 static void __set_sb_dirty(struct super_block *sb)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
@@ -93,22 +97,6 @@ static INT8 *reserved_names[] = {
 	NULL
 };
 
-static UINT8 free_bit[] = {
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 7, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2,
-	0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3,
-	0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2,
-	0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
-	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0          
-};
-
 static UINT8 used_bit[] = {
 	0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3,
 	2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 1, 2, 2, 3, 2, 3, 3, 4,
@@ -1265,13 +1253,15 @@ INT32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info)
 	return FFS_SUCCESS;
 }
 
-INT32 ffsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
+/*
+ * Walk the cluster chain of @inode to @clu_offset. Sets *clu to
+ * CLUSTER_32(~0) if the chain ends before it, with *last_clu the last
+ * cluster of the chain. Only reads the FAT, so callers need to hold
+ * just the inode's map_lock.
+ */
+static INT32 walk_cluster_chain(struct inode *inode, INT32 clu_offset, UINT32 *clu,
+								UINT32 *last_clu, INT32 *num_clusters)
 {
-	INT32 num_clusters, num_alloced, modified = FALSE;
-	UINT32 last_clu, sector;
-	CHAIN_T new_clu;
-	DENTRY_T *ep;
-	ENTRY_SET_CACHE_T *es = NULL;
 	struct super_block *sb = inode->i_sb;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 	FILE_ID_T *fid = &(EXFAT_I(inode)->fid);
@@ -1279,17 +1269,17 @@ INT32 ffsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
 	fid->rwoffset = (INT64)(clu_offset) << p_fs->cluster_size_bits;
 
 	if (EXFAT_I(inode)->mmu_private == 0)
-		num_clusters = 0;
+		*num_clusters = 0;
 	else
-		num_clusters = (INT32)((EXFAT_I(inode)->mmu_private-1) >> p_fs->cluster_size_bits) + 1;
+		*num_clusters = (INT32)((EXFAT_I(inode)->mmu_private-1) >> p_fs->cluster_size_bits) + 1;
 
-	*clu = last_clu = fid->start_clu;
+	*clu = *last_clu = fid->start_clu;
 
 	if (fid->flags == 0x03) {
 		if ((clu_offset > 0) && (*clu != CLUSTER_32(~0))) {
-			last_clu += clu_offset - 1;
+			*last_clu += clu_offset - 1;
 
-			if (clu_offset == num_clusters)
+			if (clu_offset == *num_clusters)
 				*clu = CLUSTER_32(~0);
 			else
 				*clu += clu_offset;
@@ -1302,13 +1292,52 @@ INT32 ffsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
 		}
 
 		while ((clu_offset > 0) && (*clu != CLUSTER_32(~0))) {
-			last_clu = *clu;
+			*last_clu = *clu;
 			if (FAT_read(sb, *clu, clu) == -1)
 				return FFS_MEDIAERR;
 			clu_offset--;
 		}
 	}
 
+	return FFS_SUCCESS;
+}
+
+/* ffsMapCluster() without allocation: *clu is CLUSTER_32(~0) past the chain */
+INT32 ffsLookupCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
+{
+	INT32 num_clusters;
+	UINT32 last_clu;
+	FS_INFO_T *p_fs = &(EXFAT_SB(inode->i_sb)->fs_info);
+	FILE_ID_T *fid = &(EXFAT_I(inode)->fid);
+
+	if (walk_cluster_chain(inode, clu_offset, clu, &last_clu, &num_clusters))
+		return FFS_MEDIAERR;
+
+	if (*clu != CLUSTER_32(~0)) {
+		fid->hint_last_off = (INT32)(fid->rwoffset >> p_fs->cluster_size_bits);
+		fid->hint_last_clu = *clu;
+	}
+
+	if (p_fs->dev_ejected)
+		return FFS_MEDIAERR;
+
+	return FFS_SUCCESS;
+}
+
+INT32 ffsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
+{
+	INT32 num_clusters, num_alloced, modified = FALSE;
+	UINT32 last_clu, sector;
+	CHAIN_T new_clu;
+	DENTRY_T *ep;
+	ENTRY_SET_CACHE_T *es = NULL;
+	struct super_block *sb = inode->i_sb;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	FILE_ID_T *fid = &(EXFAT_I(inode)->fid);
+
+	if (walk_cluster_chain(inode, clu_offset, clu, &last_clu, &num_clusters))
+		return FFS_MEDIAERR;
+
 	if (*clu == CLUSTER_32(~0)) {
 		fs_set_vol_flags(sb, VOL_DIRTY);
 
@@ -1841,13 +1870,15 @@ INT32 fat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_chai
 
 INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_chain)
 {
-	INT32 num_clusters = 0;
+	INT32 num_clusters = 0, run;
 	UINT32 hint_clu, new_clu, last_clu = CLUSTER_32(~0);
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	hint_clu = p_chain->dir;
 	if (hint_clu == CLUSTER_32(~0)) {
-		hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
+		hint_clu = pick_free_extent(sb, num_alloc);
+		if (hint_clu == CLUSTER_32(~0))
+			hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
 		if (hint_clu == CLUSTER_32(~0))
 			return 0;
 	} else if (hint_clu >= p_fs->num_clusters) {
@@ -1867,27 +1898,34 @@ INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_ch
 			}
 		}
 
-		if (set_alloc_bitmap(sb, new_clu-2) != FFS_SUCCESS)
-			return -1;
+		/* take as much of the free run at new_clu as is still wanted */
+		run = find_next_bitmap_bit(sb, new_clu-2, new_clu-2+num_alloc, TRUE) - (new_clu-2);
+		take_free_extent(sb, new_clu-2, run);
 
-		num_clusters++;
-
-		if (p_chain->flags == 0x01) {
-			if(FAT_write(sb, new_clu, CLUSTER_32(~0)) < 0)
+		for ( ; run > 0; run--, new_clu++) {
+			if (set_alloc_bitmap(sb, new_clu-2) != FFS_SUCCESS)
 				return -1;
-		}
 
-		if (p_chain->dir == CLUSTER_32(~0)) {
-			p_chain->dir = new_clu;
-		} else {
+			num_clusters++;
+
 			if (p_chain->flags == 0x01) {
-				if(FAT_write(sb, last_clu, new_clu) < 0)
+				if(FAT_write(sb, new_clu, CLUSTER_32(~0)) < 0)
 					return -1;
 			}
+
+			if (p_chain->dir == CLUSTER_32(~0)) {
+				p_chain->dir = new_clu;
+			} else {
+				if (p_chain->flags == 0x01) {
+					if(FAT_write(sb, last_clu, new_clu) < 0)
+						return -1;
+				}
+			}
+			last_clu = new_clu;
+			num_alloc--;
 		}
-		last_clu = new_clu;
 
-		if ((--num_alloc) == 0) {
+		if (num_alloc == 0) {
 			p_fs->clu_srch_ptr = hint_clu;
 			if (p_fs->used_clusters != (UINT32) ~0)
 				p_fs->used_clusters += num_clusters;
@@ -1896,7 +1934,7 @@ INT32 exfat_alloc_cluster(struct super_block *sb, INT32 num_alloc, CHAIN_T *p_ch
 			return(num_clusters);
 		}
 
-		hint_clu = new_clu + 1;
+		hint_clu = last_clu + 1;
 		if (hint_clu >= p_fs->num_clusters) {
 			hint_clu = 2;
 
@@ -2013,6 +2051,9 @@ void exfat_free_cluster(struct super_block *sb, CHAIN_T *p_chain, INT32 do_relse
 		} while ((clu != CLUSTER_32(0)) && (clu != CLUSTER_32(~0)));
 	}
 
+	if (num_clusters)
+		p_fs->free_extent_stale = TRUE;
+
 	if (p_fs->used_clusters != (UINT32) ~0)
 		p_fs->used_clusters -= num_clusters;
 }
@@ -2174,6 +2215,7 @@ INT32 load_alloc_bitmap(struct super_block *sb)
 				}
 
 				p_fs->pbr_bh = NULL;
+				load_free_extents(sb);
 				return FFS_SUCCESS;
 			}
 		}
@@ -2253,43 +2295,169 @@ INT32 clr_alloc_bitmap(struct super_block *sb, UINT32 clu)
 #endif
 }
 
-UINT32 test_alloc_bitmap(struct super_block *sb, UINT32 clu)
+/*
+ * Bitmap index of the first bit in [start, end) that is set if @used, or
+ * clear otherwise; @end if there is none. Scans a word at a time.
+ */
+static UINT32 find_next_bitmap_bit(struct super_block *sb, UINT32 start, UINT32 end, INT32 used)
 {
-	INT32 i, map_i, map_b;
-	UINT32 clu_base, clu_free;
-	UINT8 k, clu_mask;
+	UINT32 map_i, base, lim, bit;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
 
-	clu_base = (clu & ~(0x7)) + 2;
-	clu_mask = (1 << (clu - clu_base + 2)) - 1;
+	if (end > p_fs->num_clusters - 2)
+		end = p_fs->num_clusters - 2;
 
-	map_i = clu >> (p_bd->sector_size_bits + 3);
-	map_b = (clu >> 3) & p_bd->sector_size_mask;
+	while (start < end) {
+		map_i = start >> (p_bd->sector_size_bits + 3);
+		base = map_i << (p_bd->sector_size_bits + 3);
+		lim = min_t(UINT32, end - base, p_bd->sector_size << 3);
 
-	for (i = 2; i < p_fs->num_clusters; i += 8) {
-		k = *(((UINT8 *) p_fs->vol_amap[map_i]->b_data) + map_b);
-		if (clu_mask > 0) {
-			k |= clu_mask;
-			clu_mask = 0;
-		}
-		if (k < 0xFF) {
-			clu_free = clu_base + free_bit[k];
-			if (clu_free < p_fs->num_clusters)
-				return(clu_free);
+		if (used)
+			bit = find_next_bit_le(p_fs->vol_amap[map_i]->b_data, lim, start - base);
+		else
+			bit = find_next_zero_bit_le(p_fs->vol_amap[map_i]->b_data, lim, start - base);
+		if (bit < lim)
+			return(base + bit);
+
+		start = base + lim;
+	}
+
+	return(end);
+}
+
+UINT32 test_alloc_bitmap(struct super_block *sb, UINT32 clu)
+{
+	UINT32 clu_free, total;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	total = p_fs->num_clusters - 2;
+	if (clu >= total)
+		clu = 0;
+
+	clu_free = find_next_bitmap_bit(sb, clu, total, FALSE);
+	if (clu_free == total) {
+		clu_free = find_next_bitmap_bit(sb, 0, clu, FALSE);
+		if (clu_free == clu)
+			return(CLUSTER_32(~0));
+	}
+
+	return(clu_free + 2);
+}
+
+/*
+ * The free extent cache keeps the MAX_FREE_EXTENTS largest runs of free
+ * clusters (as bitmap indices), largest first. It is built when the bitmap
+ * is loaded and trimmed as clusters are allocated; frees only mark it
+ * stale, and it is rebuilt once used up. It is only a hint for where to
+ * start a chain: exfat_alloc_cluster() takes clusters from what
+ * test_alloc_bitmap() finds in the bitmap itself.
+ */
+static void insert_free_extent(FS_INFO_T *p_fs, UINT32 start, UINT32 len)
+{
+	INT32 i;
+
+	i = p_fs->num_free_extents;
+	if (i == MAX_FREE_EXTENTS) {
+		if (len <= p_fs->free_extent[i-1].len)
+			return;
+		i--;
+	} else {
+		p_fs->num_free_extents++;
+	}
+
+	for ( ; (i > 0) && (p_fs->free_extent[i-1].len < len); i--)
+		p_fs->free_extent[i] = p_fs->free_extent[i-1];
+
+	p_fs->free_extent[i].start = start;
+	p_fs->free_extent[i].len = len;
+}
+
+void load_free_extents(struct super_block *sb)
+{
+	UINT32 start, end, total;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	p_fs->num_free_extents = 0;
+	p_fs->free_extent_stale = FALSE;
+
+	total = p_fs->num_clusters - 2;
+	start = find_next_bitmap_bit(sb, 0, total, FALSE);
+	while (start < total) {
+		end = find_next_bitmap_bit(sb, start, total, TRUE);
+		insert_free_extent(p_fs, start, end - start);
+		start = find_next_bitmap_bit(sb, end, total, FALSE);
+	}
+}
+
+/*
+ * Where to start a new chain. A request of known size goes to the
+ * smallest cached extent that holds it; a single cluster, i.e. a file
+ * that will grow through get_block, goes to the largest one, so that it
+ * can stay contiguous.
+ */
+static UINT32 pick_free_extent(struct super_block *sb, INT32 num_alloc)
+{
+	INT32 i;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if ((p_fs->num_free_extents == 0) && p_fs->free_extent_stale)
+		load_free_extents(sb);
+	if (p_fs->num_free_extents == 0)
+		return(CLUSTER_32(~0));
+
+	i = 0;
+	if (num_alloc > 1) {
+		while ((i+1 < p_fs->num_free_extents) &&
+			   (p_fs->free_extent[i+1].len >= (UINT32) num_alloc))
+			i++;
+	}
+
+	return(p_fs->free_extent[i].start + 2);
+}
+
+/*
+ * Drop [start, start+len) from the cache, keeping the larger leftover of
+ * each extent it overlaps. Once clusters between two cached extents have
+ * been freed, one allocated run can span both.
+ */
+static void take_free_extent(struct super_block *sb, UINT32 start, UINT32 len)
+{
+	INT32 i, taken = FALSE;
+	UINT32 e_start, e_end, head, tail;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	i = 0;
+	while (i < p_fs->num_free_extents) {
+		e_start = p_fs->free_extent[i].start;
+		e_end = e_start + p_fs->free_extent[i].len;
+		if ((start >= e_end) || (start + len <= e_start)) {
+			i++;
+			continue;
 		}
-		clu_base += 8;
 
-		if (((++map_b) >= p_bd->sector_size) || (clu_base >= p_fs->num_clusters)) {
-			if ((++map_i) >= p_fs->map_sectors) {
-				clu_base = 2;
-				map_i = 0;
-			}
-			map_b = 0;
+		head = (start > e_start) ? start - e_start : 0;
+		tail = (start + len < e_end) ? e_end - (start + len) : 0;
+
+		p_fs->num_free_extents--;
+		memmove(&p_fs->free_extent[i], &p_fs->free_extent[i+1],
+				(p_fs->num_free_extents - i) * sizeof(FREE_EXTENT_T));
+
+		if (head >= tail) {
+			if (head)
+				insert_free_extent(p_fs, e_start, head);
+		} else {
+			insert_free_extent(p_fs, start + len, tail);
 		}
+		taken = TRUE;
+
+		/* the leftover is outside the range, but may have moved up */
+		i = 0;
 	}
 
-	return(CLUSTER_32(~0));
+	/* used up: rescan for the runs that did not fit in the cache */
+	if (taken && (p_fs->num_free_extents == 0))
+		p_fs->free_extent_stale = TRUE;
 }
 
 void sync_alloc_bitmap(struct super_block *sb)
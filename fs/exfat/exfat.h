@@ -94,6 +94,8 @@ extern "C" {
 
 #define DIR_DELETED		0xFFFF0321
 
+#define MAX_FREE_EXTENTS	16
+
 #define CLUSTER_16(x)           ((UINT16)(x))
 #define CLUSTER_32(x)           ((UINT32)(x))
 
@@ -359,6 +361,11 @@ extern "C" {
 		CHAIN_T     clu;
 	} UENTRY_T;
 
+	typedef struct {
+		UINT32      start;
+		UINT32      len;
+	} FREE_EXTENT_T;
+
 	typedef struct __FS_STRUCT_T {
 		UINT32      mounted;
 		struct super_block *sb;
@@ -428,12 +435,17 @@ extern "C" {
 
 		UINT32      clu_srch_ptr;           
 		UINT32      used_clusters;          
+
+		FREE_EXTENT_T free_extent[MAX_FREE_EXTENTS];
+		INT32       num_free_extents;
+		UINT32      free_extent_stale;
 		UENTRY_T    hint_uentry;            
 
 		UINT32      dev_ejected;            
 
 		FS_FUNC_T	*fs_func;
 
+		struct semaphore FAT_cache_sem;
 		BUF_CACHE_T FAT_cache_array[FAT_CACHE_SIZE];
 		BUF_CACHE_T FAT_cache_lru_list;
 		BUF_CACHE_T FAT_cache_hash_list[FAT_CACHE_HASH_SIZE];
@@ -475,6 +487,7 @@ extern "C" {
 	INT32 ffsSetAttr(struct inode *inode, UINT32 attr);
 	INT32 ffsGetStat(struct inode *inode, DIR_ENTRY_T *info);
 	INT32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info);
+	INT32 ffsLookupCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu);
 	INT32 ffsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu);
 
 	INT32 ffsCreateDir(struct inode *inode, UINT8 *path, FILE_ID_T *fid);
@@ -505,6 +518,7 @@ extern "C" {
 	INT32   clr_alloc_bitmap(struct super_block *sb, UINT32 clu);
 	UINT32 test_alloc_bitmap(struct super_block *sb, UINT32 clu);
 	void   sync_alloc_bitmap(struct super_block *sb);
+	void   load_free_extents(struct super_block *sb);
 
 	INT32  load_upcase_table(struct super_block *sb);
 	void   free_upcase_table(struct super_block *sb);
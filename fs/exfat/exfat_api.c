@@ -62,6 +62,10 @@ INT32 FsShutdown(void)
 	return(ffsShutdown());
 }
 
+/*
+ * z_sem only guards the fs_struct[] slots. A volume is mounted, used and
+ * unmounted under its own v_sem, so a slow card doesn't hold up others.
+ */
 INT32 FsMountVol(struct super_block *sb)
 {
 	INT32 err, drv;
@@ -72,7 +76,14 @@ INT32 FsMountVol(struct super_block *sb)
 		if (!fs_struct[drv].mounted) break;
 	}
 
-	if (drv >= MAX_DRIVE) return(FFS_ERROR);
+	if (drv >= MAX_DRIVE) {
+		sm_V(&z_sem);
+		return(FFS_ERROR);
+	}
+
+	fs_struct[drv].mounted = TRUE;
+
+	sm_V(&z_sem);
 
 	sm_P(&(fs_struct[drv].v_sem));
 
@@ -81,16 +92,19 @@ INT32 FsMountVol(struct super_block *sb)
 		err = ffsMountVol(sb, drv);
 	}
 
-	sm_V(&(fs_struct[drv].v_sem));
-
 	if (!err) {
-		fs_struct[drv].mounted = TRUE;
 		fs_struct[drv].sb = sb;
 	} else {
 		buf_shutdown(sb);
 	}
 
-	sm_V(&z_sem);
+	sm_V(&(fs_struct[drv].v_sem));
+
+	if (err) {
+		sm_P(&z_sem);
+		fs_struct[drv].mounted = FALSE;
+		sm_V(&z_sem);
+	}
 
 	return(err);
 }
@@ -100,17 +114,17 @@ INT32 FsUmountVol(struct super_block *sb)
 	INT32 err;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&z_sem);
-
 	sm_P(&(fs_struct[p_fs->drv].v_sem));
 
 	err = ffsUmountVol(sb);
 	buf_shutdown(sb);
+	fs_struct[p_fs->drv].sb = NULL;
 
 	sm_V(&(fs_struct[p_fs->drv].v_sem));
 
+	sm_P(&z_sem);
+
 	fs_struct[p_fs->drv].mounted = FALSE;
-	fs_struct[p_fs->drv].sb = NULL;
 
 	sm_V(&z_sem);
 
@@ -221,6 +235,7 @@ INT32 FsWriteFile(struct inode *inode, FILE_ID_T *fid, void *buffer, UINT64 coun
 	return(err);
 }
 
+/* the caller holds the inode's map_lock */
 INT32 FsTruncateFile(struct inode *inode, UINT64 old_size, UINT64 new_size)
 {
 	INT32 err;
@@ -331,6 +346,14 @@ INT32 FsMapCluster(struct inode *inode, INT32 clu_offset, UINT32 *clu)
 
 	if (clu == NULL) return(FFS_ERROR);
 
+	/*
+	 * The caller holds the inode's map_lock, which is enough to find a
+	 * cluster the file already has; v_sem is only needed to allocate.
+	 */
+	err = ffsLookupCluster(inode, clu_offset, clu);
+	if (err || (*clu != CLUSTER_32(~0)))
+		return(err);
+
 	sm_P(&(fs_struct[p_fs->drv].v_sem));
 
 	err = ffsMapCluster(inode, clu_offset, clu);
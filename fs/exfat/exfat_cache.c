@@ -19,6 +19,7 @@
 #include "exfat_config.h"
 #include "exfat_global.h"
 #include "exfat_data.h"
+#include "exfat_oal.h"
 
 #include "exfat_cache.h"
 #include "exfat_super.h"
@@ -26,8 +27,11 @@
 
 extern FS_STRUCT_T      fs_struct[];
 
-#define sm_P(s)
-#define sm_V(s)
+/*
+ * The FAT cache has a lock of its own, since cluster chains of existing
+ * files are walked under just the inode's map_lock. The buffer cache is
+ * only reached from FFS calls holding the volume's v_sem.
+ */
 
 static INT32 __FAT_read(struct super_block *sb, UINT32 loc, UINT32 *content);
 static INT32 __FAT_write(struct super_block *sb, UINT32 loc, UINT32 content);
@@ -55,6 +59,8 @@ INT32 buf_init(struct super_block *sb)
 
 	INT32 i;
 
+	sm_init(&p_fs->FAT_cache_sem);
+
 	p_fs->FAT_cache_lru_list.next = p_fs->FAT_cache_lru_list.prev = &p_fs->FAT_cache_lru_list;
 
 	for (i = 0; i < FAT_CACHE_SIZE; i++) {
@@ -108,12 +114,13 @@ INT32 buf_shutdown(struct super_block *sb)
 INT32 FAT_read(struct super_block *sb, UINT32 loc, UINT32 *content)
 {
 	INT32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	ret = __FAT_read(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 
 	return(ret);
 }
@@ -121,12 +128,13 @@ INT32 FAT_read(struct super_block *sb, UINT32 loc, UINT32 *content)
 INT32 FAT_write(struct super_block *sb, UINT32 loc, UINT32 content)
 {
 	INT32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	ret = __FAT_write(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 
 	return(ret);
 }
@@ -400,7 +408,7 @@ void FAT_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -417,7 +425,7 @@ void FAT_release_all(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 }
 
 void FAT_sync(struct super_block *sb)
@@ -425,7 +433,7 @@ void FAT_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -436,7 +444,7 @@ void FAT_sync(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 }
 
 static BUF_CACHE_T *FAT_cache_find(struct super_block *sb, UINT32 sec)
@@ -499,12 +507,8 @@ UINT8 *buf_getblk(struct super_block *sb, UINT32 sec)
 {
 	UINT8 *buf;
 
-	sm_P(&b_sem);
-
 	buf = __buf_getblk(sb, sec);
 
-	sm_V(&b_sem);
-
 	return(buf);
 } 
 
@@ -548,44 +552,32 @@ void buf_modify(struct super_block *sb, UINT32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) {
 		sector_write(sb, sec, bp->buf_bh, 0);
 	}
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 } 
 
 void buf_lock(struct super_block *sb, UINT32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) bp->flag |= LOCKBIT;
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 }
 
 void buf_unlock(struct super_block *sb, UINT32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) bp->flag &= ~(LOCKBIT);
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 }
 
 void buf_release(struct super_block *sb, UINT32 sec)
@@ -593,8 +585,6 @@ void buf_release(struct super_block *sb, UINT32 sec)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) {
 		bp->drv = -1;
@@ -608,8 +598,6 @@ void buf_release(struct super_block *sb, UINT32 sec)
 
 		move_to_lru(bp, &p_fs->buf_cache_lru_list);
 	}
-
-	sm_V(&b_sem);
 }
 
 void buf_release_all(struct super_block *sb)
@@ -617,8 +605,6 @@ void buf_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
 		if (bp->drv == p_fs->drv) {
@@ -633,8 +619,6 @@ void buf_release_all(struct super_block *sb)
 		}
 		bp = bp->next;
 	}
-
-	sm_V(&b_sem);
 }
 
 void buf_sync(struct super_block *sb)
@@ -642,8 +626,6 @@ void buf_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
 		if ((bp->drv == p_fs->drv) && (bp->flag & DIRTYBIT)) {
@@ -652,8 +634,6 @@ void buf_sync(struct super_block *sb)
 		}
 		bp = bp->next;
 	}
-
-	sm_V(&b_sem);
 }
 
 static BUF_CACHE_T *buf_cache_find(struct super_block *sb, UINT32 sec)
@@ -824,9 +824,15 @@ static int exfat_unlink(struct inode *dir, struct dentry *dentry)
 
 	ts = CURRENT_TIME_SEC;
 
+	/*
+	 * The fid's directory position is what get_block uses to update the
+	 * entry when it allocates, so keep mappings out while it goes away.
+	 */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 	EXFAT_I(inode)->fid.size = i_size_read(inode);
 
 	err = FsRemoveEntry(dir, &(EXFAT_I(inode)->fid));
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 	if (err) {
 		if (err == FFS_PERMISSIONERR)
 			err = -EPERM;
@@ -999,9 +1005,12 @@ static int exfat_rmdir(struct inode *dir, struct dentry *dentry)
 
 	ts = CURRENT_TIME_SEC;
 
+	/* the directory's chain is freed here, keep mappings out */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 	EXFAT_I(inode)->fid.size = i_size_read(inode);
 
 	err = FsRemoveDir(dir, &(EXFAT_I(inode)->fid));
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 	if (err) {
 		if (err == FFS_INVALIDPATH)
 			err = -EINVAL;
@@ -1052,9 +1061,22 @@ static int exfat_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 	ts = CURRENT_TIME_SEC;
 
+	/*
+	 * FsMoveFile() rewrites the moved fid's directory position and may
+	 * free a replaced directory's chain. Both inodes' mappings are kept
+	 * out. Only one map_lock is taken anywhere else, and two only under
+	 * lock_super, so the nesting cannot deadlock.
+	 */
+	mutex_lock(&EXFAT_I(old_inode)->map_lock);
+	if (new_inode)
+		mutex_lock_nested(&EXFAT_I(new_inode)->map_lock,
+				  SINGLE_DEPTH_NESTING);
 	EXFAT_I(old_inode)->fid.size = i_size_read(old_inode);
 
 	err = FsMoveFile(old_dir, &(EXFAT_I(old_inode)->fid), new_dir, new_dentry);
+	if (new_inode)
+		mutex_unlock(&EXFAT_I(new_inode)->map_lock);
+	mutex_unlock(&EXFAT_I(old_inode)->map_lock);
 	if (err) {
 		if (err == FFS_PERMISSIONERR)
 			err = -EPERM;
@@ -1339,6 +1361,7 @@ static void _exfat_truncate(struct inode *inode, loff_t old_size)
 	int err;
 
 	__lock_super(sb);
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 
 	if (EXFAT_I(inode)->mmu_private > i_size_read(inode))
 		EXFAT_I(inode)->mmu_private = i_size_read(inode);
@@ -1357,6 +1380,7 @@ static void _exfat_truncate(struct inode *inode, loff_t old_size)
 	inode->i_blocks = ((i_size_read(inode) + (p_fs->cluster_size - 1))
 					   & ~((loff_t)p_fs->cluster_size - 1)) >> 9;
 out:
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 	__unlock_super(sb);
 }
 
@@ -1443,11 +1467,12 @@ static int exfat_get_block(struct inode *inode, sector_t iblock,
 	unsigned long mapped_blocks;
 	sector_t phys;
 
-	__lock_super(sb);
+	/* per inode, so I/O to different files on a volume doesn't serialise */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 
 	err = exfat_bmap(inode, iblock, &phys, &mapped_blocks, &create);
 	if (err) {
-		__unlock_super(sb);
+		mutex_unlock(&EXFAT_I(inode)->map_lock);
 		return err;
 	}
 
@@ -1461,7 +1486,7 @@ static int exfat_get_block(struct inode *inode, sector_t iblock,
 	}
 
 	bh_result->b_size = max_blocks << sb->s_blocksize_bits;
-	__unlock_super(sb);
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 
 	return 0;
 }
@@ -1761,6 +1786,7 @@ static struct inode *exfat_alloc_inode(struct super_block *sb) {
 	if (!ei)
 		return NULL;
 
+	mutex_init(&ei->map_lock);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,00)
 	init_rwsem(&ei->truncate_lock);
 #endif
@@ -1818,7 +1844,9 @@ static void exfat_evict_inode(struct inode *inode)
 		loff_t old_size = i_size_read(inode);
 		i_size_write(inode, 0);
 		EXFAT_I(inode)->fid.size = old_size;
+		mutex_lock(&EXFAT_I(inode)->map_lock);
 		FsTruncateFile(inode, old_size, 0);
+		mutex_unlock(&EXFAT_I(inode)->map_lock);
 	}
 
 	invalidate_inode_buffers(inode);
@@ -93,6 +93,8 @@ struct exfat_inode_info {
 	loff_t mmu_private;    
 	loff_t i_pos;         
 	struct hlist_node i_hash_fat; 
+	/* fid's cluster chain and hints, and mmu_private */
+	struct mutex map_lock;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,00)
 	struct rw_semaphore truncate_lock;
 #endif
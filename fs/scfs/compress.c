@@ -27,7 +27,9 @@
  * decompression.
  */
 
+#include <linux/cpu.h>
 #include <linux/crypto.h>
+#include <linux/percpu.h>
 #include "scfs.h"
 
 /* Fake description object for the "none" compressor */
@@ -37,26 +39,27 @@ static struct scfs_compressor none_compr = {
 //	.capi_name = "",
 };
 
-static DEFINE_MUTEX(lzo_mutex);
-
 static struct scfs_compressor lzo_compr = {
 	.compr_type = SCFS_COMP_LZO,
-	.comp_mutex = &lzo_mutex,
 	.name = "lzo",
 	.capi_name = "lzo",
 };
 
-static DEFINE_MUTEX(deflate_mutex);
-static DEFINE_MUTEX(inflate_mutex);
-
 static struct scfs_compressor zlib_compr = {
 	.compr_type = SCFS_COMP_ZLIB,
-	.comp_mutex = &deflate_mutex,
-	.decomp_mutex = &inflate_mutex,
 	.name = "zlib",
 	.capi_name = "deflate",
 };
 
+#ifdef CONFIG_CRYPTO_LZ4
+/* decompression-optimized, for files that are read and mapped often */
+static struct scfs_compressor lz4_compr = {
+	.compr_type = SCFS_COMP_LZ4,
+	.name = "lz4",
+	.capi_name = "lz4",
+};
+#endif
+
 /* All SCFS compressors */
 struct scfs_compressor *scfs_compressors[SCFS_COMP_TOTAL_TYPES];
 
@@ -70,14 +73,11 @@ int scfs_compress_crypto(const void *in_buf, size_t in_len, void *out_buf, size_
 	if (compr_type == SCFS_COMP_NONE)
 		goto no_compr;
 
-	if (compr->comp_mutex)
-		mutex_lock(compr->comp_mutex);
 	tmp_len = (unsigned int)*out_len;
-	err = crypto_comp_compress(compr->cc, in_buf, in_len, out_buf,
-				   &tmp_len);
+	err = crypto_comp_compress(*per_cpu_ptr(compr->tfms, get_cpu()),
+				   in_buf, in_len, out_buf, &tmp_len);
+	put_cpu();
 	*out_len = (size_t)tmp_len;
-	if (compr->comp_mutex)
-		mutex_unlock(compr->comp_mutex);
 	if (unlikely(err)) {
 		SCFS_PRINT_ERROR("cannot compress %d bytes, compressor %s, "
 			   "error %d, leave data uncompressed",
@@ -109,8 +109,9 @@ int scfs_decompress_crypto(const void *in_buf, size_t in_len, void *out_buf,
 
 	compr = scfs_compressors[compr_type];
 
-	if (unlikely(!compr->capi_name)) {
-		SCFS_PRINT_ERROR("%s compression is not compiled in", compr->name);
+	if (unlikely(!compr || !compr->capi_name)) {
+		SCFS_PRINT_ERROR("%s compression is not compiled in",
+			compr ? compr->name : tfm_names[compr_type]);
 		return -EINVAL;
 	}
 
@@ -120,14 +121,11 @@ int scfs_decompress_crypto(const void *in_buf, size_t in_len, void *out_buf,
 		return 0;
 	}
 
-	if (compr->decomp_mutex)
-		mutex_lock(compr->decomp_mutex);
 	tmp_len = (unsigned int)*out_len;
-	err = crypto_comp_decompress(compr->cc, in_buf, in_len, out_buf,
-				     &tmp_len);
+	err = crypto_comp_decompress(*per_cpu_ptr(compr->tfms, get_cpu()),
+				     in_buf, in_len, out_buf, &tmp_len);
+	put_cpu();
 	*out_len = (size_t)tmp_len;
-	if (compr->decomp_mutex)
-		mutex_unlock(compr->decomp_mutex);
 	if (err)
 		SCFS_PRINT_ERROR("cannot decompress %d bytes, compressor %s, "
 			  "error %d", in_len, compr->name, err);
@@ -135,6 +133,69 @@ int scfs_decompress_crypto(const void *in_buf, size_t in_len, void *out_buf,
 	return err;
 }
 
+/*
+ * Each compressor keeps one transform per CPU, so that clusters of
+ * different files, or of the same file, are (de)compressed in parallel.
+ * A transform is only used with preemption disabled, see
+ * scfs_compress_crypto() and scfs_decompress_crypto().
+ */
+static struct scfs_compressor *scfs_pcpu_comprs[] = {
+	&lzo_compr,
+	&zlib_compr,
+#ifdef CONFIG_CRYPTO_LZ4
+	&lz4_compr,
+#endif
+};
+
+static int __scfs_compr_cpu_notifier(unsigned long action, unsigned long cpu)
+{
+	struct scfs_compressor *compr;
+	struct crypto_comp *tfm;
+	int i;
+
+	switch (action) {
+	case CPU_UP_PREPARE:
+		for (i = 0; i < ARRAY_SIZE(scfs_pcpu_comprs); i++) {
+			compr = scfs_pcpu_comprs[i];
+			tfm = crypto_alloc_comp(compr->capi_name, 0, 0);
+			if (IS_ERR(tfm)) {
+				SCFS_PRINT_ERROR("cannot allocate compressor %s "
+					"for cpu %lu, error %ld\n",
+					compr->name, cpu, PTR_ERR(tfm));
+				__scfs_compr_cpu_notifier(CPU_UP_CANCELED, cpu);
+				return NOTIFY_BAD;
+			}
+			*per_cpu_ptr(compr->tfms, cpu) = tfm;
+		}
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		for (i = 0; i < ARRAY_SIZE(scfs_pcpu_comprs); i++) {
+			compr = scfs_pcpu_comprs[i];
+			tfm = *per_cpu_ptr(compr->tfms, cpu);
+			if (tfm) {
+				crypto_free_comp(tfm);
+				*per_cpu_ptr(compr->tfms, cpu) = NULL;
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static int scfs_compr_cpu_notifier(struct notifier_block *nb,
+				unsigned long action, void *pcpu)
+{
+	unsigned long cpu = (unsigned long)pcpu;
+	return __scfs_compr_cpu_notifier(action, cpu);
+}
+
+static struct notifier_block scfs_compr_cpu_notifier_block = {
+	.notifier_call = scfs_compr_cpu_notifier
+};
+
 /**
  * compr_init - initialize a compressor.
  * @compr: compressor description object
@@ -145,17 +206,19 @@ int scfs_decompress_crypto(const void *in_buf, size_t in_len, void *out_buf,
 static int compr_init(struct scfs_compressor *compr)
 {
 	if (compr->capi_name) {
-		compr->cc = crypto_alloc_comp(compr->capi_name, 0, 0);
-		if (IS_ERR(compr->cc)) {
-			SCFS_PRINT_ERROR("cannot initialize compressor %s, error %ld",
-				  compr->name, PTR_ERR(compr->cc));
-			return PTR_ERR(compr->cc);
+		if (!crypto_has_comp(compr->capi_name, 0, 0)) {
+			SCFS_PRINT_ERROR("compressor %s is not available\n",
+				  compr->name);
+			return -ENODEV;
 		}
+		compr->tfms = alloc_percpu(struct crypto_comp *);
+		if (!compr->tfms)
+			return -ENOMEM;
 	}
 
 	scfs_compressors[compr->compr_type] = compr;
-	SCFS_PRINT("compr name %s(%d) got cc(%x)\n",
-		compr->capi_name, compr->compr_type, compr->cc); 
+	SCFS_PRINT("compr name %s(%d) initialized\n",
+		compr->capi_name, compr->compr_type);
 	return 0;
 }
 
@@ -165,33 +228,58 @@ static int compr_init(struct scfs_compressor *compr)
  */
 static void compr_exit(struct scfs_compressor *compr)
 {
-	if (compr->capi_name)
-		crypto_free_comp(compr->cc);
+	if (compr->tfms) {
+		free_percpu(compr->tfms);
+		compr->tfms = NULL;
+	}
 	return;
 }
 
 int scfs_compressors_init(void)
 {
-	int err;
+	unsigned long cpu;
+	int i, err;
 
-	err = compr_init(&lzo_compr);
-	if (err)
-		return err;
+	for (i = 0; i < ARRAY_SIZE(scfs_pcpu_comprs); i++) {
+		err = compr_init(scfs_pcpu_comprs[i]);
+		if (err)
+			goto out_compr;
+	}
 
-	err = compr_init(&zlib_compr);
-	if (err)
-		goto out_lzo;
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		if (__scfs_compr_cpu_notifier(CPU_UP_PREPARE, cpu) != NOTIFY_OK) {
+			err = -ENOMEM;
+			goto out_cpus;
+		}
+	}
+	register_cpu_notifier(&scfs_compr_cpu_notifier_block);
+	put_online_cpus();
 
 	scfs_compressors[SCFS_COMP_NONE] = &none_compr;
 	return 0;
 
-out_lzo:
-	compr_exit(&lzo_compr);
+out_cpus:
+	for_each_online_cpu(cpu)
+		__scfs_compr_cpu_notifier(CPU_UP_CANCELED, cpu);
+	put_online_cpus();
+out_compr:
+	while (i--)
+		compr_exit(scfs_pcpu_comprs[i]);
 	return err;
 }
 
 void scfs_compressors_exit(void)
 {
-	compr_exit(&lzo_compr);
-	compr_exit(&zlib_compr);
+	unsigned long cpu;
+	int i;
+
+	get_online_cpus();
+	unregister_cpu_notifier(&scfs_compr_cpu_notifier_block);
+	for_each_online_cpu(cpu)
+		__scfs_compr_cpu_notifier(CPU_DEAD, cpu);
+	put_online_cpus();
+
+	for (i = 0; i < ARRAY_SIZE(scfs_pcpu_comprs); i++)
+		compr_exit(scfs_pcpu_comprs[i]);
 }
@@ -152,7 +152,7 @@ int scfs_make_header(struct file *lower_file, struct inode *scfs_inode)
 	cf.footer_size = CF_SIZE;
 	cf.cluster_size = sbi->options.cluster_size;
 	cf.original_file_size = 0;
-	cf.comp_type = sbi->options.comp_type;
+	cf.comp_type = SCFS_I(scfs_inode)->comp_type;
 	cf.magic = SCFS_MAGIC;
 
 	ret = scfs_lower_write(lower_file, (char *)&cf, CF_SIZE, &pos);
@@ -212,6 +212,8 @@ int scfs_initialize_file(struct dentry *scfs_dentry, struct inode *scfs_inode)
 		sii->flags &= ~(SCFS_DATA_COMPRESSABLE);
 		goto out;
 	}
+	sii->comp_type = scfs_select_comp_type(SCFS_S(scfs_inode->i_sb),
+		scfs_dentry);
 
 	ret = scfs_initialize_lower_file(scfs_dentry, &lower_file, O_RDWR);
 	if (ret) {
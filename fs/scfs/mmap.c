@@ -32,6 +32,7 @@
 
 #include "scfs.h"
 #include <linux/lzo.h>
+#include <linux/hash.h>
 
 #ifdef SCFS_ASYNC_READ_PAGES
 #include <linux/freezer.h>
@@ -45,6 +46,202 @@
 extern struct kmem_cache *scfs_cbm_cache;
 #endif
 
+/*
+ * Cluster cache
+ *
+ * Reading a page of a compressed file reads and decompresses its whole
+ * cluster, so the cluster is kept in a per-mount cache, hashed by
+ * (ino, cluster) and bounded to scfs_ccache_max clusters. Hits move an
+ * entry to the tail of the LRU list, and inserts and the shrinker evict
+ * from its head. Entries are only freed once the last reader is done
+ * copying out of them.
+ */
+unsigned int scfs_ccache_max = SCFS_CCACHE_MAX_DEF;
+atomic_long_t scfs_ccache_hits;
+atomic_long_t scfs_ccache_misses;
+atomic_long_t scfs_ccache_evictions;
+atomic_long_t scfs_ccache_shrunk;
+atomic_long_t scfs_ccache_cached;
+
+static inline struct hlist_head *scfs_ccache_head(struct scfs_sb_info *sbi,
+	unsigned long ino, int clust_num)
+{
+	return &sbi->ccache_hash[hash_long(ino ^ ((unsigned long)clust_num << 16),
+		SCFS_CCACHE_HASH_BITS)];
+}
+
+static void scfs_ccache_put(struct scfs_sb_info *sbi,
+	struct scfs_ccache_entry *ce)
+{
+	if (atomic_dec_and_test(&ce->refcount)) {
+		scfs_free_mempool_buffer(ce->page, sbi);
+		kfree(ce);
+	}
+}
+
+/* called with ccache_lock held */
+static void scfs_ccache_evict(struct scfs_sb_info *sbi,
+	struct scfs_ccache_entry *ce)
+{
+	hlist_del(&ce->hash);
+	list_del(&ce->lru);
+	sbi->ccache_count--;
+	atomic_long_dec(&scfs_ccache_cached);
+	scfs_ccache_put(sbi, ce);
+}
+
+/* called with ccache_lock held */
+static void __scfs_ccache_trim(struct scfs_sb_info *sbi)
+{
+	struct scfs_ccache_entry *ce;
+
+	while (sbi->ccache_count > scfs_ccache_max) {
+		ce = list_first_entry(&sbi->ccache_lru,
+			struct scfs_ccache_entry, lru);
+		scfs_ccache_evict(sbi, ce);
+		atomic_long_inc(&scfs_ccache_evictions);
+	}
+}
+
+static struct scfs_ccache_entry *scfs_ccache_lookup(struct scfs_sb_info *sbi,
+	unsigned long ino, int clust_num)
+{
+	struct hlist_head *head = scfs_ccache_head(sbi, ino, clust_num);
+	struct hlist_node *node;
+	struct scfs_ccache_entry *ce;
+
+	spin_lock(&sbi->ccache_lock);
+	hlist_for_each_entry(ce, node, head, hash) {
+		if (ce->ino == ino && ce->clust_num == clust_num) {
+			atomic_inc(&ce->refcount);
+			list_move_tail(&ce->lru, &sbi->ccache_lru);
+			spin_unlock(&sbi->ccache_lock);
+			atomic_long_inc(&scfs_ccache_hits);
+			return ce;
+		}
+	}
+	spin_unlock(&sbi->ccache_lock);
+	atomic_long_inc(&scfs_ccache_misses);
+
+	return NULL;
+}
+
+/*
+ * Hand @page, holding the data of the cluster, over to the cache.
+ * Returns 1 if the cache took it, or 0 if the caller still owns it.
+ */
+static int scfs_ccache_insert(struct scfs_sb_info *sbi,
+	unsigned long ino, int clust_num, struct page *page)
+{
+	struct hlist_head *head = scfs_ccache_head(sbi, ino, clust_num);
+	struct hlist_node *node;
+	struct scfs_ccache_entry *ce, *new;
+
+	if (!scfs_ccache_max)
+		return 0;
+
+	new = kmalloc(sizeof(struct scfs_ccache_entry), GFP_NOFS);
+	if (!new)
+		return 0;
+
+	new->ino = ino;
+	new->clust_num = clust_num;
+	new->page = page;
+	atomic_set(&new->refcount, 1);
+
+	spin_lock(&sbi->ccache_lock);
+	/* another reader may have cached this cluster meanwhile */
+	hlist_for_each_entry(ce, node, head, hash) {
+		if (ce->ino == ino && ce->clust_num == clust_num) {
+			spin_unlock(&sbi->ccache_lock);
+			kfree(new);
+			return 0;
+		}
+	}
+	hlist_add_head(&new->hash, head);
+	list_add_tail(&new->lru, &sbi->ccache_lru);
+	sbi->ccache_count++;
+	atomic_long_inc(&scfs_ccache_cached);
+	__scfs_ccache_trim(sbi);
+	spin_unlock(&sbi->ccache_lock);
+
+	return 1;
+}
+
+/* evict from the head of the LRU down to the limit */
+void scfs_ccache_trim(struct scfs_sb_info *sbi)
+{
+	spin_lock(&sbi->ccache_lock);
+	__scfs_ccache_trim(sbi);
+	spin_unlock(&sbi->ccache_lock);
+}
+
+/* drop the cached clusters of @ino, e.g. before it is rewritten or reused */
+void scfs_ccache_invalidate(struct scfs_sb_info *sbi, unsigned long ino)
+{
+	struct scfs_ccache_entry *ce, *tmp;
+
+	spin_lock(&sbi->ccache_lock);
+	list_for_each_entry_safe(ce, tmp, &sbi->ccache_lru, lru) {
+		if (ce->ino == ino)
+			scfs_ccache_evict(sbi, ce);
+	}
+	spin_unlock(&sbi->ccache_lock);
+}
+
+static int scfs_ccache_shrink(struct shrinker *shrinker,
+	struct shrink_control *sc)
+{
+	struct scfs_sb_info *sbi = container_of(shrinker, struct scfs_sb_info,
+		ccache_shrinker);
+	struct scfs_ccache_entry *ce;
+	unsigned long nr = sc->nr_to_scan;
+	int count;
+
+	spin_lock(&sbi->ccache_lock);
+	while (nr-- && !list_empty(&sbi->ccache_lru)) {
+		ce = list_first_entry(&sbi->ccache_lru,
+			struct scfs_ccache_entry, lru);
+		scfs_ccache_evict(sbi, ce);
+		atomic_long_inc(&scfs_ccache_shrunk);
+	}
+	count = sbi->ccache_count;
+	spin_unlock(&sbi->ccache_lock);
+
+	return count;
+}
+
+void scfs_ccache_init(struct scfs_sb_info *sbi)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sbi->ccache_hash); i++)
+		INIT_HLIST_HEAD(&sbi->ccache_hash[i]);
+	INIT_LIST_HEAD(&sbi->ccache_lru);
+	spin_lock_init(&sbi->ccache_lock);
+	sbi->ccache_count = 0;
+
+	sbi->ccache_shrinker.shrink = scfs_ccache_shrink;
+	sbi->ccache_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->ccache_shrinker);
+}
+
+void scfs_ccache_destroy(struct scfs_sb_info *sbi)
+{
+	struct scfs_ccache_entry *ce, *tmp;
+
+	/* the mount may have failed before the cache was set up */
+	if (!sbi->ccache_shrinker.shrink)
+		return;
+
+	unregister_shrinker(&sbi->ccache_shrinker);
+
+	spin_lock(&sbi->ccache_lock);
+	list_for_each_entry_safe(ce, tmp, &sbi->ccache_lru, lru)
+		scfs_ccache_evict(sbi, ce);
+	spin_unlock(&sbi->ccache_lock);
+}
+
 /**
  * scfs_readpage
  *
@@ -61,17 +258,16 @@ extern struct kmem_cache *scfs_cbm_cache;
  *    "amplified read" and decompressing overhead should be amortized when
  *    other pages in that same cluster is accessed later, and only incurs
  *    memcpy from the cached cluster buffer.)
- * - Recently accessed clusters ("buffer_cache") are cached for later reads.
+ * - Recently accessed clusters are kept in the cluster cache for later reads.
  */
-static inline int _scfs_readpage(struct file *file, struct page *page, int pref_index)
+static inline int _scfs_readpage(struct file *file, struct page *page)
 {
 	struct scfs_inode_info *sii = SCFS_I(page->mapping->host);
 	struct scfs_sb_info *sbi = SCFS_S(page->mapping->host->i_sb);
 	struct scfs_cluster_buffer buffer = {NULL, NULL, NULL, NULL, 0};
-	int ret = 0, compressed = 0;
-	int alloc_membuffer = 1;
-	int allocated_index = -1;
-	int i;
+	struct scfs_ccache_entry *ce;
+	struct page *data_page;
+	int ret = 0, compressed = -1;
 	char *virt;
 
 	SCFS_PRINT("f:%s i:%d c:0x%x u:0x%x\n",
@@ -83,180 +279,42 @@ static inline int _scfs_readpage(struct file *file, struct page *page, int pref_
 	sbi->scfs_readpage_total_count++;
 #endif
 
-#if MAX_BUFFER_CACHE
-	/* search buffer_cache first in case the cluster is left cached */
-	if (pref_index >= 0 &&
-		sbi->buffer_cache[pref_index].ino == sii->vfs_inode.i_ino &&
-		sbi->buffer_cache[pref_index].clust_num ==
-			PAGE_TO_CLUSTER_INDEX(page, sii) &&
-		atomic_read(&sbi->buffer_cache[pref_index].is_used) != 1) {
-		spin_lock(&sbi->buffer_cache_lock);
-		/* this pref_index is used for another page */
-		if (sbi->buffer_cache[pref_index].ino != sii->vfs_inode.i_ino ||
-				sbi->buffer_cache[pref_index].clust_num !=
-				PAGE_TO_CLUSTER_INDEX(page, sii) ||
-				atomic_read(&sbi->buffer_cache[pref_index].is_used) == 1) {
-			spin_unlock(&sbi->buffer_cache_lock);
-			sbi->buffer_cache_reclaimed_before_used_count++;
-			goto pick_slot;
-		}
-		atomic_set(&sbi->buffer_cache[pref_index].is_used, 1);
-		spin_unlock(&sbi->buffer_cache_lock);
+	/* search the cluster cache first in case the cluster is left cached */
+	ce = scfs_ccache_lookup(sbi, sii->vfs_inode.i_ino,
+		PAGE_TO_CLUSTER_INDEX(page, sii));
+	if (ce) {
 		virt = kmap_atomic(page);
-
-		if (sbi->buffer_cache[pref_index].is_compressed)
-			memcpy(virt, page_address(sbi->buffer_cache[pref_index].u_page) +
-				PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
-		else
-			memcpy(virt, page_address(sbi->buffer_cache[pref_index].c_page) +
-				PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
-
-		atomic_set(&sbi->buffer_cache[pref_index].is_used, 0);
+		memcpy(virt, page_address(ce->page) +
+			PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
 		kunmap_atomic(virt);
+		scfs_ccache_put(sbi, ce);
 		SetPageUptodate(page);
 		unlock_page(page);
 		SCFS_PRINT("%s<h> %d\n",file->f_path.dentry->d_name.name, page->index);
 
-		return pref_index + 1;
-	} else if (pref_index >= 0) {
-		sbi->buffer_cache_reclaimed_before_used_count++;
-		goto pick_slot;
-	}
-
-	/* search buffer_cache first in case the cluster is left cached */
-	for (i = 0; i < MAX_BUFFER_CACHE; i++) {
-		if (sbi->buffer_cache[i].ino == sii->vfs_inode.i_ino &&
-			sbi->buffer_cache[i].clust_num ==
-				PAGE_TO_CLUSTER_INDEX(page, sii) &&
-			atomic_read(&sbi->buffer_cache[i].is_used) != 1) {
-			spin_lock(&sbi->buffer_cache_lock);
-			if (sbi->buffer_cache[i].ino == sii->vfs_inode.i_ino &&
-					sbi->buffer_cache[i].clust_num ==
-					PAGE_TO_CLUSTER_INDEX(page, sii) &&
-					atomic_read(&sbi->buffer_cache[i].is_used) == 1) {
-				spin_unlock(&sbi->buffer_cache_lock);
-				goto pick_slot;
-			}
-			atomic_set(&sbi->buffer_cache[i].is_used, 1);
-			spin_unlock(&sbi->buffer_cache_lock);
-			virt = kmap_atomic(page);
-
-			if (sbi->buffer_cache[i].is_compressed)
-				memcpy(virt, page_address(sbi->buffer_cache[i].u_page) +
-					PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
-			else
-				memcpy(virt, page_address(sbi->buffer_cache[i].c_page) +
-					PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
-
-			atomic_set(&sbi->buffer_cache[i].is_used, 0);
-			kunmap_atomic(virt);
-			SetPageUptodate(page);
-			unlock_page(page);
-			SCFS_PRINT("%s<h> %d\n",
-				file->f_path.dentry->d_name.name, page->index);
-
-			return i + 1;
-		}
-	}
-
-pick_slot:
-	/* pick a slot in buffer_cache to use */
-	if (atomic_read(&sbi->buffer_cache[sbi->read_buffer_index].is_used) != 1) {
-		spin_lock(&sbi->buffer_cache_lock);
-		/* this index is used for another page */
-		if (atomic_read(&sbi->buffer_cache[sbi->read_buffer_index].is_used) == 1) {
-			spin_unlock(&sbi->buffer_cache_lock);
-			goto pick_slot_full;
-		}
-		atomic_set(&sbi->buffer_cache[sbi->read_buffer_index].is_used, 1);
-		allocated_index = sbi->read_buffer_index++;
-		
-		if (sbi->read_buffer_index >= MAX_BUFFER_CACHE)
-			sbi->read_buffer_index = 0;
-
-		spin_unlock(&sbi->buffer_cache_lock);
-		buffer.c_page = sbi->buffer_cache[allocated_index].c_page;
-		buffer.u_page = sbi->buffer_cache[allocated_index].u_page;
-		sbi->buffer_cache[allocated_index].ino = sii->vfs_inode.i_ino;
-		sbi->buffer_cache[allocated_index].clust_num =
-			PAGE_TO_CLUSTER_INDEX(page, sii);
-		alloc_membuffer = 0;
-
-		goto real_io;
-	} 
-
-pick_slot_full:
-	for (i = 0; i < MAX_BUFFER_CACHE; i++) {
-		if (atomic_read(&sbi->buffer_cache[i].is_used) != 1) {
-			spin_lock(&sbi->buffer_cache_lock);
-			/* this index is used for another page */
-			if (atomic_read(&sbi->buffer_cache[i].is_used) == 1) {
-				spin_unlock(&sbi->buffer_cache_lock);
-				continue;
-			}
-
-			atomic_set(&sbi->buffer_cache[i].is_used, 1);
-			sbi->read_buffer_index = i + 1;
-
-			if (sbi->read_buffer_index >= MAX_BUFFER_CACHE)
-				sbi->read_buffer_index = 0;
-
-			spin_unlock(&sbi->buffer_cache_lock);
-			buffer.c_page = sbi->buffer_cache[i].c_page;
-			buffer.u_page = sbi->buffer_cache[i].u_page;
-			sbi->buffer_cache[i].ino = sii->vfs_inode.i_ino;
-			sbi->buffer_cache[i].clust_num =
-				PAGE_TO_CLUSTER_INDEX(page, sii);
-			allocated_index = i;
-			alloc_membuffer = 0;
-			break;
-		}
+		return 0;
 	}
-#endif
 
-real_io:
 #ifdef SCFS_ASYNC_READ_PROFILE
 	sbi->scfs_readpage_io_count++;
 #endif
-	/* sanity check & prepare buffers for scfs_read_cluster */
-	if (alloc_membuffer == 1 && (buffer.c_page || buffer.c_buffer))
-		ASSERT(0);
-
-	if (!buffer.c_page)
-		buffer.c_page = scfs_alloc_mempool_buffer(sbi);
-
+	/* prepare buffers for scfs_read_cluster */
+	buffer.c_page = scfs_alloc_mempool_buffer(sbi);
 	if (!buffer.c_page) {
 		SCFS_PRINT_ERROR("c_page malloc failed\n");
 		ret = -ENOMEM;
 		goto out;
 	}
+	buffer.c_buffer = page_address(buffer.c_page);
 
-	if (!buffer.c_buffer)
-		buffer.c_buffer = page_address(buffer.c_page);
-
-	if (!buffer.c_buffer) {
-		SCFS_PRINT_ERROR("c_buffer malloc failed\n");
-		ret = -ENOMEM;
-		goto out;
-	}
-
-	if (!buffer.u_page)
-		buffer.u_page = scfs_alloc_mempool_buffer(sbi);
-
+	buffer.u_page = scfs_alloc_mempool_buffer(sbi);
 	if (!buffer.u_page) {
 		SCFS_PRINT_ERROR("u_page malloc failed\n");
 		ret = -ENOMEM;
 		goto out;
 	}
+	buffer.u_buffer = page_address(buffer.u_page);
 
-	if (!buffer.u_buffer)
-		buffer.u_buffer = page_address(buffer.u_page);
-
-	if (!buffer.u_buffer) {
-		SCFS_PRINT_ERROR("u_buffer malloc failed\n");
-		ret = -ENOMEM;
-		goto out;
-	}
 	/* read cluster from lower */
 	ret = scfs_read_cluster(file, page, buffer.c_buffer, &buffer.u_buffer, &compressed);
 
@@ -271,60 +329,47 @@ real_io:
 		goto out;
 	}
 
-#if MAX_BUFFER_CACHE
-	/* don't need to spinlock, we have is_used=1 for this buffer */
-	if (alloc_membuffer != 1)
-		sbi->buffer_cache[allocated_index].is_compressed = compressed;
-#endif
+	data_page = compressed > 0 ? buffer.u_page : buffer.c_page;
 
 #ifdef SCFS_REMOVE_NO_COMPRESSED_UPPER_MEMCPY
 	/* fill page cache with the decompressed or original page */
-	if (compressed) {
+	if (compressed > 0) {
 		virt = kmap_atomic(page);
-		memcpy(virt, page_address(buffer.u_page) +
+		memcpy(virt, page_address(data_page) +
 			PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
 		kunmap_atomic(virt);
 	}
 #else
 	/* fill page cache with the decompressed/original data */
 	virt = kmap_atomic(page);
-	if (compressed)
-		memcpy(virt, page_address(buffer.u_page) +
-			PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
-	else
-		memcpy(virt, page_address(buffer.c_page) +
-			PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
+	memcpy(virt, page_address(data_page) +
+		PGOFF_IN_CLUSTER(page, sii) * PAGE_SIZE, PAGE_SIZE);
 	kunmap_atomic(virt);
 #endif
 	SetPageUptodate(page);
 
-#if MAX_BUFFER_CACHE
-#ifndef SCFS_REMOVE_NO_COMPRESSED_UPPER_MEMCPY
-	if (alloc_membuffer != 1) {
-		atomic_set(&sbi->buffer_cache[allocated_index].is_used, 0);
-	}
+	/*
+	 * Keep the cluster for its other pages. compressed stays negative
+	 * when scfs_read_cluster() had nothing to read for this page.
+	 */
+#ifdef SCFS_REMOVE_NO_COMPRESSED_UPPER_MEMCPY
+	if (compressed > 0 &&
 #else
-	if (alloc_membuffer != 1 && compressed) {
-		atomic_set(&sbi->buffer_cache[allocated_index].is_used, 0);
-	} else if (alloc_membuffer != 1) {
-		spin_lock(&sbi->buffer_cache_lock);
-		sbi->buffer_cache[allocated_index].ino = -1;
-		sbi->buffer_cache[allocated_index].clust_num = -1;
-		sbi->buffer_cache[allocated_index].is_compressed = -1;
-		atomic_set(&sbi->buffer_cache[allocated_index].is_used, -1);
-		spin_unlock(&sbi->buffer_cache_lock);
-	}
-#endif
+	if (compressed >= 0 &&
 #endif
+		scfs_ccache_insert(sbi, sii->vfs_inode.i_ino,
+			PAGE_TO_CLUSTER_INDEX(page, sii), data_page)) {
+		if (data_page == buffer.u_page)
+			buffer.u_page = NULL;
+		else
+			buffer.c_page = NULL;
+	}
 
 out:
 	unlock_page(page);
 
-	if (alloc_membuffer == 1) {
-		sbi->buffer_cache_overflow_count_smb++;
-		scfs_free_mempool_buffer(buffer.c_page, sbi);
-		scfs_free_mempool_buffer(buffer.u_page, sbi);
-	}
+	scfs_free_mempool_buffer(buffer.c_page, sbi);
+	scfs_free_mempool_buffer(buffer.u_page, sbi);
 
 	SCFS_PRINT("-f:%s i:%d c:0x%x u:0x%x\n",
 		file->f_path.dentry->d_name.name,
@@ -332,12 +377,7 @@ out:
 
 	SCFS_PRINT("%s<r> %d\n",file->f_path.dentry->d_name.name, page->index);
 
-	if (ret < 0)
-		return ret;
-	else if (alloc_membuffer != 1)
-		return allocated_index + 1;
-	else
-		return 0;
+	return ret;
 }
 
 static int scfs_readpage(struct file *file, struct page *page)
@@ -348,7 +388,7 @@ static int scfs_readpage(struct file *file, struct page *page)
 
 	atomic_inc(&sbi->scfs_standby_readpage_count);
 #endif
-	ret = _scfs_readpage(file, page, -1);
+	ret = _scfs_readpage(file, page);
 #ifdef SCFS_ASYNC_READ_PROFILE
 	atomic_dec(&sbi->scfs_standby_readpage_count);
 #endif
@@ -447,7 +487,6 @@ int smb_thread(void *data)
 	int cluster_number = -1;
 	int page_buffer_count = 0;
 	int i;
-	int prev_cbi = 0;
 
 	set_freezable();
 
@@ -507,14 +546,14 @@ int smb_thread(void *data)
 			spin_unlock(&sbi->spinlock_smb);
 
 			/* read first page */
-			prev_cbi = _scfs_readpage(file, page, -1);
+			_scfs_readpage(file, page);
 			fput(SCFS_F(file)->lower_file);
 			fput(file);
 			page_cache_release(page);
 
 			/* read related pages with cluster of first page*/
 			for (i = 0; i < page_buffer_count; i++) {
-				prev_cbi = _scfs_readpage(file, page_buffer[i], prev_cbi - 1);
+				_scfs_readpage(file, page_buffer[i]);
 				fput(SCFS_F(file)->lower_file);
 				fput(file);
 				page_cache_release(page_buffer[i]);
@@ -559,8 +598,6 @@ scfs_readpages(struct file *file, struct address_space *mapping,
 	pgoff_t start, end;
 	int page_idx, page_idx_readahead = 1024, ret = 0;
 	int readahead_page = 0;
-	int prev_cbi = 0;
-	int prev_cluster = -1, cur_cluster = -1;
 	int cluster_idx = 0;
 
 	i_size = i_size_read(&sii->vfs_inode);
@@ -673,14 +710,7 @@ scfs_readpages(struct file *file, struct address_space *mapping,
 		   call scfs_readpage to read now */
 		if (sbi->page_buffer_next_filling_index_smb ==
 				MAX_PAGE_BUFFER_SIZE_SMB || page_idx < page_idx_readahead) {
-			cur_cluster = PAGE_TO_CLUSTER_INDEX(page, sii);
-
-			if (prev_cluster == cur_cluster && prev_cbi > 0)
-				prev_cbi = _scfs_readpage(file, page, prev_cbi - 1);
-			else
-				prev_cbi = _scfs_readpage(file, page, -1);
-
-			prev_cluster = cur_cluster;
+			_scfs_readpage(file, page);
 			page_cache_release(page); /* refer line 701 */
 		} else {
 			spin_lock(&sbi->spinlock_smb);
@@ -1243,8 +1273,8 @@ int smtc_thread(void *info)
 #ifndef CONFIG_SCFS_USE_CRYPTO
 	int idx;
 
-	switch (sbi->options.comp_type) {
-	case SCFS_COMP_LZO:
+	if (sbi->options.comp_type == SCFS_COMP_LZO ||
+			sbi->options.fast_comp_type == SCFS_COMP_LZO) {
 		workdata = vmalloc(LZO1X_MEM_COMPRESS);
 		idx = atomic_inc_return(&sbi->smtc_idx) - 1;
 		sbi->smtc_workdata[idx] = workdata;
@@ -1256,9 +1286,6 @@ int smtc_thread(void *info)
 		} else {
 			SCFS_PRINT("smtc workmem for lzo address : %p, idx : %d\n", workdata, idx);
 		}
-		break;
-	default:
-		break;
 	}
 #endif
 	set_freezable();
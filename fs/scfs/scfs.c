@@ -36,6 +36,7 @@
 #include <linux/statfs.h>
 #include "scfs.h"
 #include <linux/lzo.h>
+#include <linux/lz4.h>
 #include <linux/ctype.h>
 
 struct kmem_cache *scfs_file_info_cache;
@@ -59,7 +60,8 @@ const char *tfm_names[SCFS_COMP_TOTAL_TYPES] =
 	"lzo",		/* lzo */
 	"zlib",		/* zlib */ 
 	"deflate",
-	"fastlzo"	/* lzo */
+	"fastlzo",	/* lzo */
+	"lz4"
 };
 
 extern struct scfs_compressor *scfs_compressors[SCFS_COMP_TOTAL_TYPES];
@@ -244,6 +246,8 @@ enum {
 	scfs_opt_cluster_size,
 	scfs_opt_comp_threshold,
 	scfs_opt_comp_type,
+	scfs_opt_fast_comp_type,
+	scfs_opt_fast_ext,
  	scfs_opt_err,
 };
 
@@ -252,8 +256,36 @@ static const match_table_t tokens = {
 	{scfs_opt_cluster_size, "cluster_size=%u"},
 	{scfs_opt_comp_threshold, "comp_threshold=%u"},
 	{scfs_opt_comp_type, "comp_type=%s"},
+	{scfs_opt_fast_comp_type, "fast_comp_type=%s"},
+	{scfs_opt_fast_ext, "fast_ext=%s"},
  	{scfs_opt_err, NULL}
 };
+
+static int scfs_parse_comp_type(const char *type)
+{
+	if (!strcmp(type, "lzo"))
+		return SCFS_COMP_LZO;
+/* disable bzip for now, crypto_alloc_comp doesn't work for some reason */
+#if 0 //#ifdef CONFIG_CRYPTO_DEFLATE
+	else if (!strcmp(type, "bzip2"))
+		return SCFS_COMP_BZIP2;
+#endif
+#ifdef CONFIG_CRYPTO_ZLIB
+	else if (!strcmp(type, "zlib"))
+		return SCFS_COMP_ZLIB;
+#endif
+#ifdef CONFIG_CRYPTO_FASTLZO
+	else if (!strcmp(type, "fastlzo"))
+		return SCFS_COMP_FASTLZO;
+#endif
+#ifdef CONFIG_CRYPTO_LZ4
+	else if (!strcmp(type, "lz4"))
+		return SCFS_COMP_LZ4;
+#endif
+
+	SCFS_PRINT_ERROR("invalid compression type\n");
+	return -EINVAL;
+}
  
 int scfs_parse_options(struct scfs_sb_info *sbi, char *options)
 {
@@ -300,24 +332,23 @@ int scfs_parse_options(struct scfs_sb_info *sbi, char *options)
 			sbi->options.comp_threshold = option;
 			break;
 		case scfs_opt_comp_type:
-			type = args[0].from;
-			if (!strcmp(type, "lzo"))
-				sbi->options.comp_type = SCFS_COMP_LZO;
-/* disable bzip for now, crypto_alloc_comp doesn't work for some reason */
-#if 0 //#ifdef CONFIG_CRYPTO_DEFLATE
-			else if (!strcmp(type, "bzip2"))
-				sbi->options.comp_type = BZIP2;
-#endif
-#ifdef CONFIG_CRYPTO_ZLIB
-			else if (!strcmp(type, "zlib"))
-				sbi->options.comp_type = SCFS_COMP_ZLIB;
-#endif
-#ifdef CONFIG_CRYPTO_FASTLZO
-			else if (!strcmp(type, "fastlzo"))
-				sbi->options.comp_type = SCFS_COMP_FASTLZO;
-#endif
-			else {
-				SCFS_PRINT_ERROR("invalid compression type\n");
+		case scfs_opt_fast_comp_type:
+			type = match_strdup(&args[0]);
+			if (!type)
+				return -ENOMEM;
+			option = scfs_parse_comp_type(type);
+			kfree(type);
+			if (option < 0)
+				return option;
+			if (token == scfs_opt_comp_type)
+				sbi->options.comp_type = option;
+			else
+				sbi->options.fast_comp_type = option;
+			break;
+		case scfs_opt_fast_ext:
+			if (match_strlcpy(sbi->options.fast_ext, &args[0],
+					SCFS_FAST_EXT_LEN) >= SCFS_FAST_EXT_LEN) {
+				SCFS_PRINT_ERROR("fast_ext, too long\n");
 				return -EINVAL;
 			}
 			break;
@@ -341,6 +372,52 @@ void copy_mount_flags_to_inode_flags(struct inode *inode, struct super_block *sb
 		sii->flags |= SCFS_DATA_COMPRESSABLE;
 }
 
+/*
+ * scfs_select_comp_type
+ *
+ * Parameters:
+ * @sbi: scfs superblock
+ * @dentry: upper dentry of the file being created
+ *
+ * Return:
+ * the algorithm to compress the file with
+ *
+ * Description:
+ * Files whose name ends with one of the fast_ext extensions (by default
+ * shared libraries and compiled dex, which are mapped and paged in over
+ * and over) get fast_comp_type, the rest get comp_type. The choice is
+ * stored in the footer of each file, so a mount reads files compressed
+ * with any mix of algorithms.
+ */
+enum comp_type scfs_select_comp_type(struct scfs_sb_info *sbi,
+	struct dentry *dentry)
+{
+	const char *name = (const char *)dentry->d_name.name;
+	const char *ext, *p, *end;
+	size_t len;
+
+	if (!sbi->options.fast_comp_type)
+		return sbi->options.comp_type;
+
+	ext = strrchr(name, '.');
+	if (!ext || ext == name)
+		return sbi->options.comp_type;
+	ext++;
+	len = strlen(ext);
+
+	for (p = sbi->options.fast_ext; *p; p = end + 1) {
+		end = strchr(p, ':');
+		if (!end)
+			end = p + strlen(p);
+		if (end - p == len && !strncmp(p, ext, len))
+			return sbi->options.fast_comp_type;
+		if (!*end)
+			break;
+	}
+
+	return sbi->options.comp_type;
+}
+
 int scfs_initialize_lower_file(struct dentry *dentry, struct file **lower_file, int flags)
 {
 	const struct cred *cred;
@@ -584,6 +661,17 @@ int scfs_decompress(enum comp_type algo, char *buf_c, char *buf_u, size_t len,
 			ret = -EIO;
 		}
 		break;
+#ifdef CONFIG_LZ4_DECOMPRESS
+	case SCFS_COMP_LZ4:
+		ret = lz4_decompress_unknownoutputsize(buf_c, len, buf_u, actual);
+		if (ret) {
+			SCFS_PRINT_ERROR("lz4 decompress error! "
+					"ret %d len %d tmp_len %d\n",
+					ret, len, *actual);
+			ret = -EIO;
+		}
+		break;
+#endif
 	default:
 		ret = scfs_decompress_crypto((void *)buf_c, len, (void *)buf_u, actual, (int)algo);
 		if (ret) {
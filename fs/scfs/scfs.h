@@ -114,7 +114,9 @@ extern struct kmem_cache *scfs_sb_info_cache;
 #define EMPTY_FLAG			-1
 
 /* read performance tuning stuff */
-#define MAX_BUFFER_CACHE		(SCFS_MEMPOOL_COUNT / 2)
+/* decompressed cluster cache, default limit is in clusters per mount */
+#define SCFS_CCACHE_HASH_BITS		6
+#define SCFS_CCACHE_MAX_DEF		SCFS_MEMPOOL_COUNT
 #define SCFS_ASYNC_READ_PAGES
 #define SCFS_READ_PAGES_PROFILE
 #if (defined(SCFS_READ_PAGES_PROFILE) && defined(SCFS_ASYNC_READ_PAGES))
@@ -155,9 +157,7 @@ extern struct kmem_cache *scfs_sb_info_cache;
 struct scfs_compressor {
 	int compr_type;
 	const char *name;
-	struct crypto_comp *cc;
-	struct mutex *comp_mutex;
-	struct mutex *decomp_mutex;
+	struct crypto_comp * __percpu *tfms;
 	const char *capi_name;
 };
 
@@ -167,6 +167,7 @@ enum comp_type {
 	SCFS_COMP_ZLIB,
 	SCFS_COMP_BZIP2,
 	SCFS_COMP_FASTLZO,
+	SCFS_COMP_LZ4,
 	SCFS_COMP_TOTAL_TYPES,
 };
 
@@ -197,21 +198,32 @@ enum scfs_mode {
 	__NR_SCFSMODE,
 };
 
-struct read_buffer_cache {
-	struct page *u_page;
-	struct page *c_page;
-	int ino;
+/*
+ * A decompressed (or stored uncompressed) cluster, kept for the other
+ * pages of the same cluster. The cache holds one reference while the
+ * entry is hashed, and each reader one while copying out of it.
+ */
+struct scfs_ccache_entry {
+	struct hlist_node hash;
+	struct list_head lru;
+	unsigned long ino;
 	int clust_num;
-	int is_compressed;
-	atomic_t is_used;
+	atomic_t refcount;
+	struct page *page;
 };
 
+/* file name extensions, ':' separated, that get fast_comp_type */
+#define SCFS_FAST_EXT_LEN		64
+#define SCFS_FAST_EXT_DEF		"so:odex:oat"
+
 struct scfs_mount_options
 {
 	int flags;
 	int cluster_size;
 	int comp_threshold;
 	enum comp_type comp_type;
+	enum comp_type fast_comp_type;
+	char fast_ext[SCFS_FAST_EXT_LEN];
 };
 
 struct scfs_sb_info
@@ -225,11 +237,12 @@ struct scfs_sb_info
 	atomic_t total_cluster_count;	/* total clusters to be written to lower */
 	atomic64_t current_data_size;	/* total data size in memory */
 
-#if MAX_BUFFER_CACHE
-	struct read_buffer_cache buffer_cache[MAX_BUFFER_CACHE];
-	spinlock_t buffer_cache_lock;
-	int read_buffer_index;
-#endif
+	/* cluster cache, hashed by (ino, cluster) with the LRU entry first */
+	struct hlist_head ccache_hash[1 << SCFS_CCACHE_HASH_BITS];
+	struct list_head ccache_lru;
+	spinlock_t ccache_lock;
+	unsigned int ccache_count;
+	struct shrinker ccache_shrinker;
 
 #ifndef CONFIG_SCFS_USE_CRYPTO
 	void *scfs_workdata;
@@ -249,8 +262,6 @@ struct scfs_sb_info
 	u64 scfs_lowerpage_alloc_count;
 	u64 scfs_op_mode;
 	u64 scfs_sequential_page_number;
-	u64 buffer_cache_overflow_count_smb;
-	u64 buffer_cache_reclaimed_before_used_count;
 
 	/* when page_buffer_smb and file_buffer_smb is full, then this filling_index is
 	set to MAX_PAGE_BUFFER_SIZE */
@@ -582,6 +593,9 @@ struct inode *scfs_get_inode(struct inode *lower_inode, struct super_block *sb);
 
 void copy_mount_flags_to_inode_flags(struct inode *inode, struct super_block *sb);
 
+enum comp_type scfs_select_comp_type(struct scfs_sb_info *sbi,
+	struct dentry *dentry);
+
 int scfs_get_lower_file(struct dentry *dentry, struct inode *inode, int flags);
 
 void scfs_put_lower_file(struct inode *inode);
@@ -667,6 +681,18 @@ int scfs_load_cinfo(struct scfs_inode_info *sii, struct file *lower_file);
 
 int scfs_check_cinfo(struct scfs_inode_info *sii, void *buf);
 
+/* mmap.c */
+extern unsigned int scfs_ccache_max;
+extern atomic_long_t scfs_ccache_hits;
+extern atomic_long_t scfs_ccache_misses;
+extern atomic_long_t scfs_ccache_evictions;
+extern atomic_long_t scfs_ccache_shrunk;
+extern atomic_long_t scfs_ccache_cached;
+void scfs_ccache_init(struct scfs_sb_info *sbi);
+void scfs_ccache_destroy(struct scfs_sb_info *sbi);
+void scfs_ccache_invalidate(struct scfs_sb_info *sbi, unsigned long ino);
+void scfs_ccache_trim(struct scfs_sb_info *sbi);
+
 #ifdef SCFS_ASYNC_READ_PAGES
 void wakeup_smb_thread(struct scfs_sb_info *sbi);
 int smb_init(struct scfs_sb_info *sbi);
@@ -691,6 +717,7 @@ extern void wakeup_smtc_writer_thread(struct scfs_sb_info *sb_info);
 #endif
 
 /* compressor.c */
+extern const char *tfm_names[SCFS_COMP_TOTAL_TYPES];
 int scfs_compressors_init(void);
 void scfs_compressors_exit(void);
 int scfs_compress_crypto(const void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
@@ -41,18 +41,12 @@
 
 #define SCFS_VERSION "1.2.19"
 
-#if MAX_BUFFER_CACHE
-//extern struct read_buffer_cache buffer_cache[];
-//extern spinlock_t buffer_cache_lock;
-#endif
-
 #ifdef CONFIG_DEBUG_FS
 int scfs_mounted = 1;
 #endif
 
 static struct kobject *scfs_kobj;
 static const char * scfs_version = SCFS_VERSION;
-extern const char *tfm_names[SCFS_COMP_TOTAL_TYPES];
 
 static ssize_t version_show(struct kobject *kobj,
 			    struct kobj_attribute *attr, char *buf)
@@ -85,6 +79,9 @@ static const char * supported_comp_types = "lzo"
 #endif
 #ifdef CONFIG_CRYPTO_FASTLZO
 	",fastlzo"
+#endif
+#ifdef CONFIG_CRYPTO_LZ4
+	",lz4"
 #endif
 	"\n";
 
@@ -96,10 +93,56 @@ static ssize_t supported_comp_types_show(struct kobject *kobj,
 
 static struct kobj_attribute supported_comp_types_attr = __ATTR_RO(supported_comp_types);
 
+static ssize_t cluster_cache_max_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", scfs_ccache_max);
+}
+
+static struct file_system_type scfs_fs_type;
+
+static void scfs_ccache_trim_sb(struct super_block *sb, void *unused)
+{
+	scfs_ccache_trim(SCFS_S(sb));
+}
+
+static ssize_t cluster_cache_max_store(struct kobject *kobj,
+			    struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	/* bring every mount's cache down to the new limit right away */
+	scfs_ccache_max = val;
+	iterate_supers_type(&scfs_fs_type, scfs_ccache_trim_sb, NULL);
+	return count;
+}
+
+static struct kobj_attribute cluster_cache_max_attr =
+	__ATTR(cluster_cache_max, 0644, cluster_cache_max_show,
+		cluster_cache_max_store);
+
+static ssize_t cluster_cache_stat_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%ld %ld %ld %ld %ld\n",
+		atomic_long_read(&scfs_ccache_hits),
+		atomic_long_read(&scfs_ccache_misses),
+		atomic_long_read(&scfs_ccache_evictions),
+		atomic_long_read(&scfs_ccache_shrunk),
+		atomic_long_read(&scfs_ccache_cached));
+}
+
+static struct kobj_attribute cluster_cache_stat_attr = __ATTR_RO(cluster_cache_stat);
+
 static struct attribute *attributes[] = {
 	&system_type_attr.attr,
 	&version_attr.attr,
 	&supported_comp_types_attr.attr,
+	&cluster_cache_max_attr.attr,
+	&cluster_cache_stat_attr.attr,
 	NULL,
 };
 
@@ -185,6 +228,9 @@ static void scfs_evict_inode(struct inode *inode)
 	if (!list_empty(&sii->cinfo_list))
 		SCFS_PRINT_ERROR("cinfo list is not empty!\n");
 
+	/* cached clusters must not outlive the inode number */
+	scfs_ccache_invalidate(SCFS_S(inode->i_sb), inode->i_ino);
+
 	lower_inode = scfs_lower_inode(inode);
 	scfs_set_lower_inode(inode, NULL);
 	iput(lower_inode);
@@ -229,10 +275,18 @@ static int scfs_show_options(struct seq_file *m, struct dentry *root)
 	case SCFS_COMP_FASTLZO:
 		seq_printf(m, ",comp_type=fastlzo");
 		break;
+	case SCFS_COMP_LZ4:
+		seq_printf(m, ",comp_type=lz4");
+		break;
 	default:
 		break;
 	}
 
+	if (opts->fast_comp_type) {
+		seq_printf(m, ",fast_comp_type=%s", tfm_names[opts->fast_comp_type]);
+		seq_printf(m, ",fast_ext=%s", opts->fast_ext);
+	}
+
 	return 0;
 }
 
@@ -314,11 +368,8 @@ static int scfs_debugfs_init(struct super_block *sb)
 	debugfs_create_u64("scfs_sequential_page_number", S_IRUGO | S_IWUGO,
 		debugfs_root, &sbi->scfs_sequential_page_number);
 
-	debugfs_create_u64("buffer_cache_overflow_count_smb", S_IRUGO,
-		debugfs_root, &sbi->buffer_cache_overflow_count_smb);
-
-	debugfs_create_u64("buffer_cache_reclaimed_before_used_count", S_IRUGO,
-		debugfs_root, &sbi->buffer_cache_reclaimed_before_used_count);
+	debugfs_create_u32("ccache_count", S_IRUGO,
+		debugfs_root, &sbi->ccache_count);
 
 	debugfs_create_atomic_t("scfs_standby_readpage_count", S_IRUGO,
 		debugfs_root, &sbi->scfs_standby_readpage_count);
@@ -367,7 +418,7 @@ static struct dentry *scfs_mount(struct file_system_type *fs_type, int flags,
 	struct scfs_dentry_info *root_info;
 	struct inode *inode;
 	struct path path;
-	int ret, i;
+	int ret;
 
 	sbi = kzalloc(sizeof(struct scfs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -388,6 +439,9 @@ static struct dentry *scfs_mount(struct file_system_type *fs_type, int flags,
 		sbi->options.cluster_size = SCFS_CLUSTER_SIZE_DEF;
 	if (!sbi->options.comp_type)
 		sbi->options.comp_type = SCFS_COMP_LZO;
+	if (sbi->options.fast_comp_type && !sbi->options.fast_ext[0])
+		strlcpy(sbi->options.fast_ext, SCFS_FAST_EXT_DEF,
+			SCFS_FAST_EXT_LEN);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
 	sb = sget(fs_type, NULL, set_anon_super, flags, NULL);
@@ -452,28 +506,13 @@ static struct dentry *scfs_mount(struct file_system_type *fs_type, int flags,
 		goto out_deactivate;
 	}
 
-#if MAX_BUFFER_CACHE
-	/* initialize read buffers */	
-	for (i = 0; i < MAX_BUFFER_CACHE; i++) {
-		sbi->buffer_cache[i].u_page = scfs_alloc_mempool_buffer(sbi);
-		sbi->buffer_cache[i].c_page = scfs_alloc_mempool_buffer(sbi);
-		if (sbi->buffer_cache[i].u_page == NULL ||
-				sbi->buffer_cache[i].c_page == NULL) {
-			SCFS_PRINT_ERROR("mempool alloc failed!\n");
-			ret = -ENOMEM;
-			goto out_deactivate;
-		}
-		sbi->buffer_cache[i].ino = -1;
-		sbi->buffer_cache[i].clust_num = -1;
-		sbi->buffer_cache[i].is_compressed = -1;
-		atomic_set(&sbi->buffer_cache[i].is_used, -1);
-	}
-	spin_lock_init(&sbi->buffer_cache_lock);
-#endif
+	/* cache for decompressed clusters, trimmed under memory pressure */
+	scfs_ccache_init(sbi);
 
 #ifndef CONFIG_SCFS_USE_CRYPTO
-	switch (sbi->options.comp_type) {
-	case SCFS_COMP_LZO:
+	/* either algorithm may be picked for a file, see scfs_select_comp_type */
+	if (sbi->options.comp_type == SCFS_COMP_LZO ||
+			sbi->options.fast_comp_type == SCFS_COMP_LZO) {
 		sbi->scfs_workdata = vmalloc(LZO1X_MEM_COMPRESS);
 		if (!sbi->scfs_workdata) {
 			SCFS_PRINT_ERROR("vmalloc for lzo workmem failed, "
@@ -481,9 +520,6 @@ static struct dentry *scfs_mount(struct file_system_type *fs_type, int flags,
 			ret = -ENOMEM;
 			goto out_deactivate;
 		}
-		break;
-	default:
-		break;
 	}
 	spin_lock_init(&sbi->workdata_lock);
 #endif
@@ -558,6 +594,8 @@ static void scfs_kill_block_super(struct super_block *sb)
 		vfree(sbi->scfs_workdata);
 #endif
 
+	scfs_ccache_destroy(sbi);
+
 	if (sbi->mempool)
 		mempool_destroy(sbi->mempool);
 
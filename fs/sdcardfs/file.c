@@ -19,9 +19,36 @@
  */
 
 #include "sdcardfs.h"
-#ifdef CONFIG_SDCARD_FS_FADV_NOACTIVE
 #include <linux/backing-dev.h>
+#include <linux/uio.h>
+
+/*
+ * Readahead happens on the lower file, so advice given to ours with
+ * fadvise() has to be carried over to it before each read.
+ */
+static void sdcardfs_copy_ra_state(struct file *file, struct file *lower_file)
+{
+	struct backing_dev_info *bdi = lower_file->f_mapping->backing_dev_info;
+	unsigned long ra_pages = bdi->ra_pages;
+	fmode_t mask = FMODE_RANDOM;
+
+	/* POSIX_FADV_SEQUENTIAL doubled the window of our own bdi */
+	if (file->f_ra.ra_pages > file->f_mapping->backing_dev_info->ra_pages)
+		ra_pages *= 2;
+#ifdef CONFIG_SDCARD_FS_FADV_NOACTIVE
+	mask |= FMODE_NOACTIVE;
+	if (file->f_mode & FMODE_NOACTIVE)
+		ra_pages = bdi->ra_pages * 2;
 #endif
+	lower_file->f_ra.ra_pages = ra_pages;
+
+	if ((lower_file->f_mode ^ file->f_mode) & mask) {
+		spin_lock(&lower_file->f_lock);
+		lower_file->f_mode &= ~mask;
+		lower_file->f_mode |= file->f_mode & mask;
+		spin_unlock(&lower_file->f_lock);
+	}
+}
 
 static ssize_t sdcardfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
@@ -29,23 +56,9 @@ static ssize_t sdcardfs_read(struct file *file, char __user *buf,
 	int err;
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
-#ifdef CONFIG_SDCARD_FS_FADV_NOACTIVE
-	struct backing_dev_info *bdi;
-#endif
 
 	lower_file = sdcardfs_lower_file(file);
-
-#ifdef CONFIG_SDCARD_FS_FADV_NOACTIVE
-	if (file->f_mode & FMODE_NOACTIVE) {
-		if (!(lower_file->f_mode & FMODE_NOACTIVE)) {
-			bdi = lower_file->f_mapping->backing_dev_info;
-			lower_file->f_ra.ra_pages = bdi->ra_pages * 2;
-			spin_lock(&lower_file->f_lock);
-			lower_file->f_mode |= FMODE_NOACTIVE;
-			spin_unlock(&lower_file->f_lock);
-		}
-	}
-#endif
+	sdcardfs_copy_ra_state(file, lower_file);
 
 	err = vfs_read(lower_file, buf, count, ppos);
 	/* update our inode atime upon a successful lower read */
@@ -82,6 +95,155 @@ static ssize_t sdcardfs_write(struct file *file, const char __user *buf,
 	return err;
 }
 
+/*
+ * The aio and splice methods hand the request to the lower file as is, so
+ * that readv/writev, io_submit and sendfile run on the lower page cache
+ * instead of bouncing through sdcardfs_read/sdcardfs_write.
+ *
+ * The lower ->aio_read/->aio_write find their file in iocb->ki_filp. A sync
+ * kiocb is finished when the call returns, so ki_filp is switched to the
+ * lower file for the duration of the call. An async one may complete later
+ * from the lower fs's end_io, which also looks at ki_filp, while the aio
+ * core drops its file reference through it; neither may see the other
+ * file. Such requests are run to completion on a sync kiocb of their own.
+ */
+static ssize_t sdcardfs_lower_aio_rw(struct kiocb *iocb, struct file *lower_file,
+		ssize_t (*rw)(struct kiocb *, const struct iovec *,
+			      unsigned long, loff_t),
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct kiocb kiocb;
+	ssize_t err;
+
+	if (is_sync_kiocb(iocb)) {
+		iocb->ki_filp = lower_file;
+		err = rw(iocb, iov, nr_segs, pos);
+		iocb->ki_filp = file;
+		return err;
+	}
+
+	init_sync_kiocb(&kiocb, lower_file);
+	kiocb.ki_pos = pos;
+	kiocb.ki_left = iov_length(iov, nr_segs);
+	kiocb.ki_nbytes = kiocb.ki_left;
+
+	err = rw(&kiocb, iov, nr_segs, pos);
+	if (err == -EIOCBQUEUED)
+		err = wait_on_sync_kiocb(&kiocb);
+	return err;
+}
+
+static ssize_t sdcardfs_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				 unsigned long nr_segs, loff_t pos)
+{
+	ssize_t err;
+	struct file *file = iocb->ki_filp;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+
+	lower_file = sdcardfs_lower_file(file);
+	if (!lower_file->f_op || !lower_file->f_op->aio_read)
+		return -EINVAL;
+	sdcardfs_copy_ra_state(file, lower_file);
+
+	err = sdcardfs_lower_aio_rw(iocb, lower_file, lower_file->f_op->aio_read,
+				    iov, nr_segs, pos);
+
+	if (err >= 0 || err == -EIOCBQUEUED)
+		fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+
+	return err;
+}
+
+static ssize_t sdcardfs_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+	ssize_t err;
+	struct file *file = iocb->ki_filp;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+
+	/* check disk space */
+	if (!check_min_free_space(dentry, iov_length(iov, nr_segs), 0)) {
+		printk(KERN_INFO "No minimum free space.\n");
+		return -ENOSPC;
+	}
+
+	lower_file = sdcardfs_lower_file(file);
+	if (!lower_file->f_op || !lower_file->f_op->aio_write)
+		return -EINVAL;
+
+	err = sdcardfs_lower_aio_rw(iocb, lower_file, lower_file->f_op->aio_write,
+				    iov, nr_segs, pos);
+
+	if (err >= 0 || err == -EIOCBQUEUED) {
+		fsstack_copy_inode_size(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+		fsstack_copy_attr_times(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+	}
+
+	return err;
+}
+
+static ssize_t sdcardfs_splice_read(struct file *file, loff_t *ppos,
+				    struct pipe_inode_info *pipe, size_t len,
+				    unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+
+	lower_file = sdcardfs_lower_file(file);
+	sdcardfs_copy_ra_state(file, lower_file);
+
+	if (lower_file->f_op && lower_file->f_op->splice_read)
+		err = lower_file->f_op->splice_read(lower_file, ppos, pipe,
+						    len, flags);
+	else
+		err = default_file_splice_read(lower_file, ppos, pipe,
+					       len, flags);
+
+	if (err >= 0)
+		fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+
+	return err;
+}
+
+static ssize_t sdcardfs_splice_write(struct pipe_inode_info *pipe,
+				     struct file *file, loff_t *ppos,
+				     size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+
+	/* check disk space */
+	if (!check_min_free_space(dentry, len, 0)) {
+		printk(KERN_INFO "No minimum free space.\n");
+		return -ENOSPC;
+	}
+
+	lower_file = sdcardfs_lower_file(file);
+	if (lower_file->f_op && lower_file->f_op->splice_write)
+		err = lower_file->f_op->splice_write(pipe, lower_file, ppos,
+						     len, flags);
+	else
+		err = default_file_splice_write(pipe, lower_file, ppos,
+						len, flags);
+	if (err >= 0) {
+		fsstack_copy_inode_size(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+		fsstack_copy_attr_times(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+	}
+
+	return err;
+}
+
 static int sdcardfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
 	int err = 0;
@@ -330,6 +492,10 @@ const struct file_operations sdcardfs_main_fops = {
 	.llseek		= generic_file_llseek,
 	.read		= sdcardfs_read,
 	.write		= sdcardfs_write,
+	.aio_read	= sdcardfs_aio_read,
+	.aio_write	= sdcardfs_aio_write,
+	.splice_read	= sdcardfs_splice_read,
+	.splice_write	= sdcardfs_splice_write,
 	.unlocked_ioctl	= sdcardfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= sdcardfs_compat_ioctl,
@@ -130,10 +130,10 @@ static inline void hash_del_rcu(struct hlist_node *node)
  * @obj: the type * to use as a loop cursor for each entry
  * @member: the name of the hlist_node within the struct
  */
-#define hash_for_each_rcu(name, bkt, obj, member)                       \
+#define hash_for_each_rcu(name, bkt, obj, member, pos)                  \
         for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < HASH_SIZE(name);\
                         (bkt)++)\
-                hlist_for_each_entry_rcu(obj, &name[bkt], member)
+                hlist_for_each_entry_rcu(obj, pos, &name[bkt], member)
 
 /**
  * hash_for_each_safe - iterate over a hashtable safe against removal of
@@ -169,9 +169,9 @@ static inline void hash_del_rcu(struct hlist_node *node)
  * @member: the name of the hlist_node within the struct
  * @key: the key of the objects to iterate over
  */
-#define hash_for_each_possible_rcu(name, obj, member, key)              \
-        hlist_for_each_entry_rcu(obj, &name[hash_min(key, HASH_BITS(name))],\
-                member)
+#define hash_for_each_possible_rcu(name, obj, member, key, pos)         \
+        hlist_for_each_entry_rcu(obj, pos,\
+                &name[hash_min(key, HASH_BITS(name))], member)
 
 /**
  * hash_for_each_possible_safe - iterate over all possible objects hashing to the
@@ -19,6 +19,8 @@
  */
 
 #include "sdcardfs.h"
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
 
 static int sdcardfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
@@ -68,12 +70,67 @@ static ssize_t sdcardfs_direct_IO(int rw, struct kiocb *iocb,
 }
 
 /*
- * XXX: the default address_space_ops for sdcardfs is empty.  We cannot set
- * our inode->i_mapping->a_ops to NULL because too many code paths expect
- * the a_ops vector to be non-NULL.
+ * Data is only ever cached in the lower mapping; reads, faults and splice
+ * all go to the lower file.  ->readpage is here for the few callers that
+ * insist on one, and fills our page from the lower page cache.
+ */
+static int sdcardfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *lower_inode = sdcardfs_lower_inode(page->mapping->host);
+	struct page *lower_page;
+
+	lower_page = read_mapping_page(lower_inode->i_mapping, page->index,
+				       file ? sdcardfs_lower_file(file) : NULL);
+	if (IS_ERR(lower_page)) {
+		SetPageError(page);
+		unlock_page(page);
+		return PTR_ERR(lower_page);
+	}
+
+	copy_highpage(page, lower_page);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	page_cache_release(lower_page);
+	unlock_page(page);
+
+	return 0;
+}
+
+/*
+ * fadvise(POSIX_FADV_WILLNEED) and readahead(2) on our file end up here.
+ * Start the same readahead on the lower mapping and leave @pages alone:
+ * read_pages() frees whatever we don't add to our own mapping.
+ */
+static int sdcardfs_readpages(struct file *file, struct address_space *mapping,
+			      struct list_head *pages, unsigned nr_pages)
+{
+	struct file *lower_file;
+	struct file_ra_state ra;
+	pgoff_t start;
+
+	if (!file || list_empty(pages))
+		return 0;
+
+	/* the list is in reverse order of index */
+	start = list_entry(pages->prev, struct page, lru)->index;
+	lower_file = sdcardfs_lower_file(file);
+
+	/* a private window, so this doesn't disturb the lower file's stream */
+	file_ra_state_init(&ra, lower_file->f_mapping);
+	ra.ra_pages = max_t(unsigned int, ra.ra_pages, nr_pages);
+	page_cache_sync_readahead(lower_file->f_mapping, &ra, lower_file,
+				  start, nr_pages);
+
+	return 0;
+}
+
+/*
+ * XXX: We cannot set our inode->i_mapping->a_ops to NULL because too many
+ * code paths expect the a_ops vector to be non-NULL.
  */
 const struct address_space_operations sdcardfs_aops = {
-	/* empty on purpose */
+	.readpage	= sdcardfs_readpage,
+	.readpages	= sdcardfs_readpages,
 	.direct_IO	= sdcardfs_direct_IO,
 };
 
@@ -21,6 +21,7 @@
 #include "sdcardfs.h"
 #include "strtok.h"
 #include "hashtable.h"
+#include <linux/ctype.h>
 #include <linux/syscalls.h>
 #include <linux/kthread.h>
 #include <linux/inotify.h>
@@ -31,13 +32,22 @@
 struct hashtable_entry {
         struct hlist_node hlist;
         void *key;
+	unsigned int hash;
 	int value;
 };
 
-struct packagelist_data {
+/*
+ * One generation of packages.list. Readers find it under rcu_read_lock()
+ * and never lock; pkgld builds a new one on every change, publishes it
+ * with rcu_assign_pointer() and frees the old one after a grace period.
+ */
+struct packagelist_tables {
 	DECLARE_HASHTABLE(package_to_appid,8);
 	DECLARE_HASHTABLE(appid_with_rw,7);
-	struct mutex hashtable_lock;
+};
+
+struct packagelist_data {
+	struct packagelist_tables __rcu *tables;
 	struct task_struct *thread_id;
 	gid_t write_gid;
 	char *strtok_last;
@@ -54,24 +64,21 @@ static const char* const kpackageslist_file = "/data/system/packages.list";
 /* Supplementary groups to execute with */
 static const gid_t kgroups[1] = { AID_PACKAGE_INFO };
 
-static unsigned int str_hash(void *key) {
-	int i;
+/* case-folded, since package names are compared with strcasecmp() */
+static unsigned int str_hash(const char *key) {
 	unsigned int h = strlen(key);
-	char *data = (char *)key;
 
-	for (i = 0; i < strlen(key); i++) {
-		h = h * 31 + *data;
-		data++;
-	}
+	for (; *key; key++)
+		h = h * 31 + tolower(*key);
 	return h;
 }
 
-static int contain_appid_key(struct packagelist_data *pkgl_dat, void *appid) {
+static int contain_appid_key(struct packagelist_tables *tables, appid_t appid) {
         struct hashtable_entry *hash_cur;
 	struct hlist_node *h_n;
 
-        hash_for_each_possible(pkgl_dat->appid_with_rw,	hash_cur, hlist, (unsigned int)appid, h_n)
-                if (appid == hash_cur->key)
+        hash_for_each_possible_rcu(tables->appid_with_rw, hash_cur, hlist, appid, h_n)
+                if (appid == hash_cur->hash)
                         return 1;
 	return 0;
 }
@@ -88,34 +95,31 @@ int get_caller_has_rw_locked(void *pkgl_id, derive_t derive) {
 	}
 
 	appid = multiuser_get_app_id(current_fsuid());
-	mutex_lock(&pkgl_dat->hashtable_lock);
-	ret = contain_appid_key(pkgl_dat, (void *)appid);
-	mutex_unlock(&pkgl_dat->hashtable_lock);
+	rcu_read_lock();
+	ret = contain_appid_key(rcu_dereference(pkgl_dat->tables), appid);
+	rcu_read_unlock();
 	return ret;
 }
 
 appid_t get_appid(void *pkgl_id, const char *app_name)
 {
 	struct packagelist_data *pkgl_dat = (struct packagelist_data *)pkgl_id;
+	struct packagelist_tables *tables;
 	struct hashtable_entry *hash_cur;
 	struct hlist_node *h_n;
-	unsigned int hash = str_hash((void *)app_name);
-	appid_t ret_id;
-
-	//printk(KERN_INFO "sdcardfs: %s: %s, %u\n", __func__, (char *)app_name, hash);
-	mutex_lock(&pkgl_dat->hashtable_lock);
-	hash_for_each_possible(pkgl_dat->package_to_appid, hash_cur, hlist, hash, h_n) {
-		//printk(KERN_INFO "sdcardfs: %s: %s\n", __func__, (char *)hash_cur->key);
-		if (!strcasecmp(app_name, hash_cur->key)) {
+	unsigned int hash = str_hash(app_name);
+	appid_t ret_id = 0;
+
+	rcu_read_lock();
+	tables = rcu_dereference(pkgl_dat->tables);
+	hash_for_each_possible_rcu(tables->package_to_appid, hash_cur, hlist, hash, h_n) {
+		if (hash == hash_cur->hash && !strcasecmp(app_name, hash_cur->key)) {
 			ret_id = (appid_t)hash_cur->value;
-			mutex_unlock(&pkgl_dat->hashtable_lock);
-			//printk(KERN_INFO "=> app_id: %d\n", (int)ret_id);
-			return ret_id;
+			break;
 		}
 	}
-	mutex_unlock(&pkgl_dat->hashtable_lock);
-	//printk(KERN_INFO "=> app_id: %d\n", 0);
-	return 0;
+	rcu_read_unlock();
+	return ret_id;
 }
 
 /* Kernel has already enforced everything we returned through
@@ -171,15 +175,14 @@ int open_flags_to_access_mode(int open_flags) {
 	}
 }
 
-static int insert_str_to_int(struct packagelist_data *pkgl_dat, void *key, int value) {
+static int insert_str_to_int(struct packagelist_tables *tables, const char *key, int value) {
 	struct hashtable_entry *hash_cur;
 	struct hashtable_entry *new_entry;
 	struct hlist_node *h_n;
 	unsigned int hash = str_hash(key);
 
-	//printk(KERN_INFO "sdcardfs: %s: %s: %d, %u\n", __func__, (char *)key, value, hash);
-	hash_for_each_possible(pkgl_dat->package_to_appid, hash_cur, hlist, hash, h_n) {
-		if (!strcasecmp(key, hash_cur->key)) {
+	hash_for_each_possible(tables->package_to_appid, hash_cur, hlist, hash, h_n) {
+		if (hash == hash_cur->hash && !strcasecmp(key, hash_cur->key)) {
 			hash_cur->value = value;
 			return 0;
 		}
@@ -188,26 +191,28 @@ static int insert_str_to_int(struct packagelist_data *pkgl_dat, void *key, int v
 	if (!new_entry)
 		return -ENOMEM;
 	new_entry->key = kstrdup(key, GFP_KERNEL);
+	if (!new_entry->key) {
+		kmem_cache_free(hashtable_entry_cachep, new_entry);
+		return -ENOMEM;
+	}
+	new_entry->hash = hash;
 	new_entry->value = value;
-	hash_add(pkgl_dat->package_to_appid, &new_entry->hlist, hash);
+	hash_add(tables->package_to_appid, &new_entry->hlist, hash);
 	return 0;
 }
 
 static void remove_str_to_int(struct hashtable_entry *h_entry) {
-	//printk(KERN_INFO "sdcardfs: %s: %s: %d\n", __func__, (char *)h_entry->key, h_entry->value);
 	kfree(h_entry->key);
 	kmem_cache_free(hashtable_entry_cachep, h_entry);
 }
 
-static int insert_int_to_null(struct packagelist_data *pkgl_dat, void *key, int value) {
+static int insert_int_to_null(struct packagelist_tables *tables, appid_t key, int value) {
 	struct hashtable_entry *hash_cur;
 	struct hashtable_entry *new_entry;
 	struct hlist_node *h_n;
 
-	//printk(KERN_INFO "sdcardfs: %s: %d: %d\n", __func__, (int)key, value);
-	hash_for_each_possible(pkgl_dat->appid_with_rw,	hash_cur, hlist,
-					(unsigned int)key, h_n) {
-		if (key == hash_cur->key) {
+	hash_for_each_possible(tables->appid_with_rw, hash_cur, hlist, key, h_n) {
+		if (key == hash_cur->hash) {
 			hash_cur->value = value;
 			return 0;
 		}
@@ -215,49 +220,79 @@ static int insert_int_to_null(struct packagelist_data *pkgl_dat, void *key, int
 	new_entry = kmem_cache_alloc(hashtable_entry_cachep, GFP_KERNEL);
 	if (!new_entry)
 		return -ENOMEM;
-	new_entry->key = key;
+	new_entry->key = NULL;
+	new_entry->hash = key;
 	new_entry->value = value;
-	hash_add(pkgl_dat->appid_with_rw, &new_entry->hlist,
-			(unsigned int)new_entry->key);
+	hash_add(tables->appid_with_rw, &new_entry->hlist, key);
 	return 0;
 }
 
 static void remove_int_to_null(struct hashtable_entry *h_entry) {
-	//printk(KERN_INFO "sdcardfs: %s: %d: %d\n", __func__, (int)h_entry->key, h_entry->value);
 	kmem_cache_free(hashtable_entry_cachep, h_entry);
 }
 
-static void remove_all_hashentrys(struct packagelist_data *pkgl_dat)
+static struct packagelist_tables *alloc_tables(void)
+{
+	struct packagelist_tables *tables;
+
+	tables = kmalloc(sizeof(*tables), GFP_KERNEL);
+	if (!tables)
+		return NULL;
+	hash_init(tables->package_to_appid);
+	hash_init(tables->appid_with_rw);
+	return tables;
+}
+
+static void free_tables(struct packagelist_tables *tables)
 {
 	struct hashtable_entry *hash_cur;
 	struct hlist_node *h_n;
 	struct hlist_node *h_t;
 	int i;
 
-	hash_for_each_safe(pkgl_dat->package_to_appid, i, h_t, hash_cur, hlist, h_n)
+	hash_for_each_safe(tables->package_to_appid, i, h_t, hash_cur, hlist, h_n)
 		remove_str_to_int(hash_cur);
-	hash_for_each_safe(pkgl_dat->appid_with_rw, i, h_t, hash_cur, hlist, h_n)
+	hash_for_each_safe(tables->appid_with_rw, i, h_t, hash_cur, hlist, h_n)
                 remove_int_to_null(hash_cur);
+	kfree(tables);
+}
 
-	hash_init(pkgl_dat->package_to_appid);
-	hash_init(pkgl_dat->appid_with_rw);
+/*
+ * Only pkgld updates the tables, and packagelist_destroy() stops it
+ * before freeing them, so the writer side needs no lock.
+ */
+static void replace_tables(struct packagelist_data *pkgl_dat,
+			   struct packagelist_tables *tables)
+{
+	struct packagelist_tables *old;
+
+	old = rcu_dereference_protected(pkgl_dat->tables, 1);
+	rcu_assign_pointer(pkgl_dat->tables, tables);
+	synchronize_rcu();
+	free_tables(old);
 }
 
+/*
+ * Parse packages.list into a fresh set of tables and swap them in as a
+ * whole, so a lookup sees either the old list or the new one. If the
+ * file can't be read the old list stays in place.
+ */
 static int read_package_list(struct packagelist_data *pkgl_dat) {
+	struct packagelist_tables *tables;
 	int ret;
 	int fd;
 	int read_amount;
 
 	printk(KERN_INFO "sdcardfs: read_package_list\n");
 
-	mutex_lock(&pkgl_dat->hashtable_lock);
-
-	remove_all_hashentrys(pkgl_dat);
+	tables = alloc_tables();
+	if (!tables)
+		return -ENOMEM;
 
 	fd = sys_open(kpackageslist_file, O_RDONLY, 0);
 	if (fd < 0) {
 		printk(KERN_ERR "sdcardfs: failed to open package list\n");
-		mutex_unlock(&pkgl_dat->hashtable_lock);
+		free_tables(tables);
 		return fd;
 	}
 
@@ -283,23 +318,17 @@ static int read_package_list(struct packagelist_data *pkgl_dat) {
 		if (sscanf(pkgl_dat->read_buf, "%s %d %*d %*s %*s %s",
 				pkgl_dat->app_name_buf, &appid,
 				pkgl_dat->gids_buf) == 3) {
-			ret = insert_str_to_int(pkgl_dat, pkgl_dat->app_name_buf, appid);
-			if (ret) {
-				sys_close(fd);
-				mutex_unlock(&pkgl_dat->hashtable_lock);
-				return ret;
-			}
+			ret = insert_str_to_int(tables, pkgl_dat->app_name_buf, appid);
+			if (ret)
+				goto err;
 
 			token = strtok_r(pkgl_dat->gids_buf, ",", &pkgl_dat->strtok_last);
 			while (token != NULL) {
 				if (!kstrtoul(token, 10, &ret_gid) &&
 						(ret_gid == pkgl_dat->write_gid)) {
-					ret = insert_int_to_null(pkgl_dat, (void *)appid, 1);
-					if (ret) {
-						sys_close(fd);
-						mutex_unlock(&pkgl_dat->hashtable_lock);
-						return ret;
-					}
+					ret = insert_int_to_null(tables, appid, 1);
+					if (ret)
+						goto err;
 					break;
 				}
 				token = strtok_r(NULL, ",", &pkgl_dat->strtok_last);
@@ -308,8 +337,13 @@ static int read_package_list(struct packagelist_data *pkgl_dat) {
 	}
 
 	sys_close(fd);
-	mutex_unlock(&pkgl_dat->hashtable_lock);
+	replace_tables(pkgl_dat, tables);
 	return 0;
+
+err:
+	sys_close(fd);
+	free_tables(tables);
+	return ret;
 }
 
 static int packagelist_reader(void *thread_data)
@@ -397,6 +431,7 @@ interruptable_sleep:
 void * packagelist_create(gid_t write_gid)
 {
 	struct packagelist_data *pkgl_dat;
+	struct packagelist_tables *tables;
         struct task_struct *packagelist_thread;
 
 	pkgl_dat = kmalloc(sizeof(*pkgl_dat), GFP_KERNEL | __GFP_ZERO);
@@ -405,14 +440,19 @@ void * packagelist_create(gid_t write_gid)
 		return ERR_PTR(-ENOMEM);
 	}
 
-	mutex_init(&pkgl_dat->hashtable_lock);
-	hash_init(pkgl_dat->package_to_appid);
-	hash_init(pkgl_dat->appid_with_rw);
+	/* lookups before the first read see an empty list */
+	tables = alloc_tables();
+	if (!tables) {
+		kfree(pkgl_dat);
+		return ERR_PTR(-ENOMEM);
+	}
+	RCU_INIT_POINTER(pkgl_dat->tables, tables);
 	pkgl_dat->write_gid = write_gid;
 
         packagelist_thread = kthread_run(packagelist_reader, (void *)pkgl_dat, "pkgld");
         if (IS_ERR(packagelist_thread)) {
                 printk(KERN_ERR "sdcardfs: creating kthread failed\n");
+		free_tables(tables);
 		kfree(pkgl_dat);
 		return packagelist_thread;
         }
@@ -431,7 +471,7 @@ void packagelist_destroy(void *pkgl_id)
 
 	force_sig_info(SIGINT, SEND_SIG_PRIV, pkgl_dat->thread_id);
 	kthread_stop(pkgl_dat->thread_id);
-	remove_all_hashentrys(pkgl_dat);
+	free_tables(rcu_dereference_protected(pkgl_dat->tables, 1));
 	printk(KERN_INFO "sdcardfs: destroyed packagelist pkgld/%d\n", (int)pkgl_pid);
 	kfree(pkgl_dat);
 }
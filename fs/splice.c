@@ -1051,9 +1051,9 @@ static int write_pipe_buf(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
 	return ret;
 }
 
-static ssize_t default_file_splice_write(struct pipe_inode_info *pipe,
-					 struct file *out, loff_t *ppos,
-					 size_t len, unsigned int flags)
+ssize_t default_file_splice_write(struct pipe_inode_info *pipe,
+				  struct file *out, loff_t *ppos,
+				  size_t len, unsigned int flags)
 {
 	ssize_t ret;
 
@@ -1063,6 +1063,7 @@ static ssize_t default_file_splice_write(struct pipe_inode_info *pipe,
 
 	return ret;
 }
+EXPORT_SYMBOL(default_file_splice_write);
 
 /**
  * generic_splice_sendpage - splice data from a pipe to a socket
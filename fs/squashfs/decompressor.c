@@ -107,7 +107,7 @@ void *squashfs_decompressor_init(struct super_block *sb, unsigned short flags)
 		}
 	}
 
-	strm = msblk->decompressor->init(msblk, buffer, length);
+	strm = msblk->thread_ops->create(msblk, buffer, length);
 
 finished:
 	kfree(buffer);
@@ -26,25 +26,42 @@
 struct squashfs_decompressor {
 	void	*(*init)(struct squashfs_sb_info *, void *, int);
 	void	(*free)(void *);
-	int	(*decompress)(struct squashfs_sb_info *, void **,
+	int	(*decompress)(struct squashfs_sb_info *, void *, void **,
 		struct buffer_head **, int, int, int, int, int);
 	int	id;
 	char	*name;
 	int	supported;
 };
 
-static inline void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
-	void *s)
+/*
+ * How decompressor streams are shared between readers, selected with the
+ * threads= mount option.  create() is given the compressor options read
+ * from the filesystem and returns the per-mount stream state, decompress()
+ * picks a stream and runs msblk->decompressor on it.
+ */
+struct squashfs_decompressor_thread_ops {
+	void	*(*create)(struct squashfs_sb_info *, void *, int);
+	void	(*destroy)(struct squashfs_sb_info *);
+	int	(*decompress)(struct squashfs_sb_info *, void **,
+		struct buffer_head **, int, int, int, int, int);
+	char	*name;
+};
+
+extern const struct squashfs_decompressor_thread_ops squashfs_decompressor_single;
+extern const struct squashfs_decompressor_thread_ops squashfs_decompressor_multi;
+extern const struct squashfs_decompressor_thread_ops squashfs_decompressor_percpu;
+
+static inline void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
 {
-	if (msblk->decompressor)
-		msblk->decompressor->free(s);
+	if (msblk->thread_ops && msblk->stream)
+		msblk->thread_ops->destroy(msblk);
 }
 
 static inline int squashfs_decompress(struct squashfs_sb_info *msblk,
 	void **buffer, struct buffer_head **bh, int b, int offset, int length,
 	int srclength, int pages)
 {
-	return msblk->decompressor->decompress(msblk, buffer, bh, b, offset,
+	return msblk->thread_ops->decompress(msblk, buffer, bh, b, offset,
 		length, srclength, pages);
 }
 
@@ -47,6 +47,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -371,6 +373,155 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Decompress a datablock straight into the page cache, without going
+ * through the read_page cache and a copy.  page[] holds the locked pages
+ * the caller has for the block (one reference each), or NULL.  The other
+ * pages of the block are grabbed from the page cache if that can be done
+ * without blocking, and whatever cannot be filled or is already uptodate
+ * is decompressed into a scratch page and thrown away.
+ *
+ * Returns -ENOMEM, with the caller's pages untouched, if the buffers to
+ * do this cannot be had, so that the caller can go the cached way.
+ * Otherwise all pages are unlocked and released, and uptodate on success;
+ * a failed read returns -EIO.
+ */
+static int squashfs_read_block_direct(struct inode *inode, struct page **page,
+	int start_index, int pages, u64 block, int bsize)
+{
+	DECLARE_BITMAP(grabbed, SQUASHFS_FILE_MAX_SIZE >> PAGE_CACHE_SHIFT);
+	struct page *scratch, **map = NULL;
+	void **buffer = NULL, *vaddr = NULL;
+	int i, bytes, highmem = 0, res = -ENOMEM;
+
+	scratch = alloc_page(GFP_KERNEL);
+	map = kmalloc(pages * sizeof(*map), GFP_KERNEL);
+	buffer = kmalloc(pages * sizeof(*buffer), GFP_KERNEL);
+	if (scratch == NULL || map == NULL || buffer == NULL)
+		goto out;
+
+	bitmap_zero(grabbed, pages);
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL) {
+			page[i] = grab_cache_page_nowait(inode->i_mapping,
+							start_index + i);
+			if (page[i] == NULL)
+				goto use_scratch;
+			__set_bit(i, grabbed);
+		}
+
+		if (!PageUptodate(page[i])) {
+			map[i] = page[i];
+			highmem |= PageHighMem(page[i]);
+			continue;
+		}
+
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+		page[i] = NULL;
+use_scratch:
+		map[i] = scratch;
+	}
+
+	if (highmem) {
+		vaddr = vmap(map, pages, VM_MAP, PAGE_KERNEL);
+		if (vaddr == NULL)
+			goto release_grabbed;
+		for (i = 0; i < pages; i++)
+			buffer[i] = vaddr + (i << PAGE_CACHE_SHIFT);
+	} else {
+		for (i = 0; i < pages; i++)
+			buffer[i] = page_address(map[i]);
+	}
+
+	/*
+	 * Bound the read by the pages given, so that a corrupt block
+	 * cannot run past them.
+	 */
+	res = squashfs_read_data(inode->i_sb, buffer, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+
+	if (vaddr)
+		vunmap(vaddr);
+
+	bytes = res;
+	for (i = 0; i < pages; i++, bytes -= PAGE_CACHE_SIZE) {
+		if (page[i] == NULL)
+			continue;
+
+		if (res < 0) {
+			SetPageError(page[i]);
+		} else {
+			if (bytes < (int) PAGE_CACHE_SIZE)
+				zero_user_segment(page[i], max(bytes, 0),
+							PAGE_CACHE_SIZE);
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		}
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+
+	/*
+	 * The pages are gone by now, so a failure must not look like the
+	 * -ENOMEM that tells the caller to fall back.
+	 */
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		res = -EIO;
+	} else
+		res = 0;
+	goto out;
+
+release_grabbed:
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || !test_bit(i, grabbed))
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+		page[i] = NULL;
+	}
+
+out:
+	if (scratch)
+		__free_page(scratch);
+	kfree(buffer);
+	kfree(map);
+	return res;
+}
+
+
+static int squashfs_readpage_direct(struct inode *inode, struct page *target,
+	u64 block, int bsize)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int start_index = target->index & ~((1 << shift) - 1);
+	int file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+							PAGE_CACHE_SHIFT;
+	int pages = min(1 << shift, file_pages - start_index);
+	struct page **page;
+	int res;
+
+	page = kcalloc(pages, sizeof(*page), GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	/* readpage's page stays referenced by the caller */
+	page_cache_get(target);
+	page[target->index - start_index] = target;
+
+	res = squashfs_read_block_direct(inode, page, start_index, pages,
+		block, bsize);
+	if (res == -ENOMEM)
+		page_cache_release(target);
+
+	kfree(page);
+	return res;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
@@ -410,8 +561,13 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Decompress the datablock into the page cache, or if
+			 * that cannot be set up, via the read_page cache.
 			 */
+			if (squashfs_readpage_direct(inode, page, block,
+							bsize) != -ENOMEM)
+				return 0;
+
 			buffer = squashfs_get_datablock(inode->i_sb,
 								block, bsize);
 			if (buffer->error) {
@@ -496,6 +652,78 @@ out:
 }
 
 
+#define list_to_page(head) (list_entry((head)->prev, struct page, lru))
+
+/*
+ * Readahead.  The pages of the window come in index order; the ones that
+ * fall in the same datablock are added to the page cache together and the
+ * block is decompressed into them in one go.  Holes, fragments and blocks
+ * the direct path cannot take go through readpage one page at a time.
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+							PAGE_CACHE_SHIFT;
+	struct page **page, *p;
+	int i, index, start_index, n, bsize, res;
+	u64 block;
+
+	page = kmalloc(sizeof(*page) << shift, GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	while (!list_empty(pages)) {
+		p = list_to_page(pages);
+		index = p->index >> shift;
+		start_index = index << shift;
+		n = min(1 << shift, file_pages - start_index);
+
+		memset(page, 0, sizeof(*page) << shift);
+		while (!list_empty(pages)) {
+			p = list_to_page(pages);
+			if ((p->index >> shift) != index)
+				break;
+
+			list_del(&p->lru);
+			if (p->index - start_index < n && !add_to_page_cache_lru(p,
+					mapping, p->index, GFP_KERNEL))
+				page[p->index - start_index] = p;
+			else
+				page_cache_release(p);
+		}
+
+		res = -ENOMEM;
+		if (index < file_end || squashfs_i(inode)->fragment_block ==
+						SQUASHFS_INVALID_BLK) {
+			block = 0;
+			bsize = read_blocklist(inode, index, &block);
+			if (bsize > 0)
+				res = squashfs_read_block_direct(inode, page,
+					start_index, n, block, bsize);
+		}
+
+		if (res != -ENOMEM)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (page[i] == NULL)
+				continue;
+			squashfs_readpage(file, page[i]);
+			page_cache_release(page[i]);
+		}
+	}
+
+	kfree(page);
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
@@ -36,6 +36,8 @@
 #include <linux/module.h>
 #include <linux/magic.h>
 #include <linux/xattr.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -74,6 +76,53 @@ static const struct squashfs_decompressor *supported_squashfs_filesystem(short
 }
 
 
+enum {
+	Opt_threads_single, Opt_threads_multi, Opt_threads_percpu, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_threads_single, "threads=single"},
+	{Opt_threads_multi, "threads=multi"},
+	{Opt_threads_percpu, "threads=percpu"},
+	{Opt_err, NULL}
+};
+
+static int squashfs_parse_options(struct squashfs_sb_info *msblk,
+	char *options)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+
+	msblk->thread_ops = &squashfs_decompressor_single;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_threads_single:
+			msblk->thread_ops = &squashfs_decompressor_single;
+			break;
+		case Opt_threads_multi:
+			msblk->thread_ops = &squashfs_decompressor_multi;
+			break;
+		case Opt_threads_percpu:
+			msblk->thread_ops = &squashfs_decompressor_percpu;
+			break;
+		default:
+			ERROR("Unrecognized mount option \"%s\" or missing "
+				"value\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+
 static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct squashfs_sb_info *msblk;
@@ -95,10 +144,16 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	msblk = sb->s_fs_info;
 
+	err = squashfs_parse_options(msblk, data);
+	if (err) {
+		kfree(sb->s_fs_info);
+		sb->s_fs_info = NULL;
+		return err;
+	}
+
 	msblk->devblksize = sb_min_blocksize(sb, SQUASHFS_DEVBLK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
 
 	/*
@@ -336,7 +391,7 @@ failed_mount:
 	squashfs_cache_delete(msblk->block_cache);
 	squashfs_cache_delete(msblk->fragment_cache);
 	squashfs_cache_delete(msblk->read_page);
-	squashfs_decompressor_free(msblk, msblk->stream);
+	squashfs_decompressor_destroy(msblk);
 	kfree(msblk->inode_lookup_table);
 	kfree(msblk->fragment_index);
 	kfree(msblk->id_table);
@@ -376,6 +431,15 @@ static int squashfs_remount(struct super_block *sb, int *flags, char *data)
 }
 
 
+static int squashfs_show_options(struct seq_file *s, struct dentry *root)
+{
+	struct squashfs_sb_info *msblk = root->d_sb->s_fs_info;
+
+	seq_printf(s, ",threads=%s", msblk->thread_ops->name);
+	return 0;
+}
+
+
 static void squashfs_put_super(struct super_block *sb)
 {
 	if (sb->s_fs_info) {
@@ -383,7 +447,7 @@ static void squashfs_put_super(struct super_block *sb)
 		squashfs_cache_delete(sbi->block_cache);
 		squashfs_cache_delete(sbi->fragment_cache);
 		squashfs_cache_delete(sbi->read_page);
-		squashfs_decompressor_free(sbi, sbi->stream);
+		squashfs_decompressor_destroy(sbi);
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
 		kfree(sbi->meta_index);
@@ -490,7 +554,8 @@ static const struct super_operations squashfs_super_ops = {
 	.destroy_inode = squashfs_destroy_inode,
 	.statfs = squashfs_statfs,
 	.put_super = squashfs_put_super,
-	.remount_fs = squashfs_remount
+	.remount_fs = squashfs_remount,
+	.show_options = squashfs_show_options
 };
 
 module_init(init_squashfs_fs);
@@ -134,6 +134,7 @@ struct request {
 	unsigned long long start_time_ns;
 	unsigned long long io_start_time_ns;    /* when passed to hardware */
 #endif
+	u64 issue_time_ns;	/* when passed to the driver, for polling */
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
 	 */
@@ -362,6 +363,14 @@ struct request_queue {
 	struct timer_list	timeout;
 	struct list_head	timeout_list;
 
+	/*
+	 * hybrid polling, see blk-poll.c
+	 */
+	unsigned int		poll_delay;	/* usecs, 0 = adaptive */
+	u64			poll_mean_ns;
+	unsigned long		poll_hits;
+	unsigned long		poll_misses;
+
 	struct list_head	icq_list;
 
 	struct queue_limits	limits;
@@ -421,6 +430,7 @@ struct request_queue {
 #define QUEUE_FLAG_ADD_RANDOM  16	/* Contributes to random pool */
 #define QUEUE_FLAG_SECDISCARD  17	/* supports SECDISCARD */
 #define QUEUE_FLAG_SAME_FORCE  18	/* force complete on same CPU */
+#define QUEUE_FLAG_POLL        19	/* sync waiters may spin for completion */
 
 #define QUEUE_FLAG_DEFAULT	((0 << QUEUE_FLAG_IO_STAT) 	|	\
 				 (1 << QUEUE_FLAG_STACKABLE)	|	\
@@ -495,6 +505,7 @@ static inline void queue_flag_clear(unsigned int flag, struct request_queue *q)
 #define blk_queue_noxmerges(q)	\
 	test_bit(QUEUE_FLAG_NOXMERGES, &(q)->queue_flags)
 #define blk_queue_nonrot(q)	test_bit(QUEUE_FLAG_NONROT, &(q)->queue_flags)
+#define blk_queue_poll(q)	test_bit(QUEUE_FLAG_POLL, &(q)->queue_flags)
 #define blk_queue_io_stat(q)	test_bit(QUEUE_FLAG_IO_STAT, &(q)->queue_flags)
 #define blk_queue_add_random(q)	test_bit(QUEUE_FLAG_ADD_RANDOM, &(q)->queue_flags)
 #define blk_queue_stackable(q)	\
@@ -732,6 +743,7 @@ extern int blk_execute_rq(struct request_queue *, struct gendisk *,
 			  struct request *, int);
 extern void blk_execute_rq_nowait(struct request_queue *, struct gendisk *,
 				  struct request *, int, rq_end_io_fn *);
+extern bool blk_poll_wait(struct request_queue *, bool (*)(void *), void *);
 
 static inline struct request_queue *bdev_get_queue(struct block_device *bdev)
 {
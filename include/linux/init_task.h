@@ -36,6 +36,13 @@ extern struct fs_struct init_fs;
 #define INIT_CPUSET_SEQ
 #endif
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+#define INIT_LMK_ADJ_NODE(tsk)						\
+	.lmk_adj_node	= LIST_HEAD_INIT(tsk.lmk_adj_node),
+#else
+#define INIT_LMK_ADJ_NODE(tsk)
+#endif
+
 #define INIT_SIGNALS(sig) {						\
 	.nr_threads	= 1,						\
 	.wait_chldexit	= __WAIT_QUEUE_HEAD_INITIALIZER(sig.wait_chldexit),\
@@ -200,6 +207,7 @@ extern struct cred init_cred;
 	INIT_TRACE_RECURSION						\
 	INIT_TASK_RCU_PREEMPT(tsk)					\
 	INIT_CPUSET_SEQ							\
+	INIT_LMK_ADJ_NODE(tsk)						\
 }
 
 
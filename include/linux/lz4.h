@@ -0,0 +1,30 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  LZ4 trades some compression ratio against LZO for considerably
+ *  faster decompression, which suits read-mostly compressed stores.
+ */
+
+#include <linux/types.h>
+
+#define LZ4_MEM_COMPRESS	(4096 * sizeof(u32))
+
+#define lz4_compressbound(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS. On entry *dst_len is
+ * the size of 'dst'; lz4_compressbound(src_len) is always enough.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Safe decompression with overrun testing. On entry *dst_len is the
+ * size of 'dst', on return the number of bytes decompressed.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len);
+
+#endif
@@ -43,6 +43,19 @@ enum oom_constraint {
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_index_update(struct task_struct *task);
+extern void lowmem_adj_index_remove(struct task_struct *task);
+#else
+static inline void lowmem_adj_index_update(struct task_struct *task)
+{
+}
+
+static inline void lowmem_adj_index_remove(struct task_struct *task)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *memcg,
 			const nodemask_t *nodemask, unsigned long totalpages);
 extern int try_set_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
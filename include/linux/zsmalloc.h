@@ -41,7 +41,8 @@ struct zs_ops {
 
 struct zs_pool;
 
-struct zs_pool *zs_create_pool(gfp_t flags, struct zs_ops *ops);
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags,
+				struct zs_ops *ops);
 void zs_destroy_pool(struct zs_pool *pool);
 
 unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
@@ -52,5 +53,6 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool);
 
 #endif
@@ -0,0 +1,66 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uksm
+
+#if !defined(_TRACE_UKSM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_UKSM_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(uksm_scan_budget,
+
+	TP_PROTO(unsigned int idle_pct, unsigned long nr_running,
+		 unsigned int freq_pct, unsigned int budget),
+
+	TP_ARGS(idle_pct, nr_running, freq_pct, budget),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, idle_pct)
+		__field(unsigned long, nr_running)
+		__field(unsigned int, freq_pct)
+		__field(unsigned int, budget)
+	),
+
+	TP_fast_assign(
+		__entry->idle_pct = idle_pct;
+		__entry->nr_running = nr_running;
+		__entry->freq_pct = freq_pct;
+		__entry->budget = budget;
+	),
+
+	TP_printk("idle=%u%% nr_running=%lu freq=%u%% budget=%u%%",
+		__entry->idle_pct,
+		__entry->nr_running,
+		__entry->freq_pct,
+		__entry->budget)
+);
+
+TRACE_EVENT(uksm_scan_sleep,
+
+	TP_PROTO(unsigned long nr_scanned, unsigned long long scan_time,
+		 unsigned int sleep_ms),
+
+	TP_ARGS(nr_scanned, scan_time, sleep_ms),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, nr_scanned)
+		__field(unsigned long long, scan_time)
+		__field(unsigned int, sleep_ms)
+	),
+
+	TP_fast_assign(
+		__entry->nr_scanned = nr_scanned;
+		__entry->scan_time = scan_time;
+		__entry->sleep_ms = sleep_ms;
+	),
+
+	TP_printk("nr_scanned=%lu scan_time=%lluns sleep=%ums",
+		__entry->nr_scanned,
+		__entry->scan_time,
+		__entry->sleep_ms)
+);
+
+#endif /* _TRACE_UKSM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
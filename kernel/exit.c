@@ -201,6 +201,7 @@ repeat:
 	}
 
 	write_unlock_irq(&tasklist_lock);
+	lowmem_adj_index_remove(p);
 	release_thread(p);
 	call_rcu(&p->rcu, delayed_put_task_struct);
 
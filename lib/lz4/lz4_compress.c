@@ -0,0 +1,138 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Single-pass greedy LZ4 block compressor: a 4-byte hash of the input
+ *  indexes the last position each hash was seen at, and a candidate is
+ *  taken as soon as its first MINMATCH bytes agree.
+ *
+ *  The output is a standard LZ4 block and can be decoded by any LZ4
+ *  implementation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned((const u32 *)p) * 2654435761U) >>
+		(32 - LZ4_HASHLOG);
+}
+
+/* Emit a length extension for a nibble that saturated at its mask */
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char *ip = src, *anchor = src, *ref, *mstart;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	unsigned char *op = dst, *token;
+	unsigned char * const oend = dst + *dst_len;
+	u32 *table = wrkmem;
+	size_t lit, len;
+	u32 h;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+	ip++;
+
+	for (;;) {
+		/* Find a match */
+		for (;;) {
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+			h = lz4_hash(ip);
+			ref = src + table[h];
+			table[h] = ip - src;
+			if (ref < ip && ip - ref <= MAX_DISTANCE &&
+			    get_unaligned((const u32 *)ref) ==
+			    get_unaligned((const u32 *)ip))
+				break;
+			ip++;
+		}
+
+		/* Extend it backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Literals, plus token, offset and a worst case length byte */
+		lit = ip - anchor;
+		if (unlikely(op + 1 + lit / 255 + 1 + lit + 2 + 1 > oend))
+			return -1;
+		token = op++;
+		if (lit >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, lit - RUN_MASK);
+		} else {
+			*token = lit << ML_BITS;
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* Extend the match forwards */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		mstart = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+		len = ip - mstart;
+
+		if (len >= ML_MASK) {
+			if (unlikely(op + 1 + (len - ML_MASK) / 255 > oend))
+				return -1;
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= len;
+		}
+		anchor = ip;
+
+		if (ip > mflimit)
+			break;
+
+		/* Index the tail of the match for the next search */
+		table[lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	lit = iend - anchor;
+	if (unlikely(op + 1 + lit / 255 + 1 + lit > oend))
+		return -1;
+	token = op++;
+	if (lit >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit - RUN_MASK);
+	} else {
+		*token = lit << ML_BITS;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,97 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Every length and offset read from the input is checked against the
+ *  input, output and look-behind bounds, so corrupted data can not make
+ *  it read or write outside the buffers it was given.
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char *ip = src, *ref;
+	const unsigned char * const iend = src + src_len;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	unsigned int token, s;
+	size_t len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto malformed;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		if (unlikely(len > (size_t)(iend - ip) ||
+			     len > (size_t)(oend - op)))
+			goto malformed;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			goto malformed;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > (size_t)(op - dst)))
+			goto malformed;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto malformed;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += MINMATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto malformed;
+
+		/* Overlapping copies replicate the last 'offset' bytes */
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return 0;
+
+malformed:
+	*dst_len = op - dst;
+	return -1;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  LZ4 is a byte-oriented LZ77 coder: each sequence is a token byte
+ *  (literal length in the high nibble, match length - MINMATCH in the
+ *  low one), optional length extension bytes, the literals, a 16-bit
+ *  little-endian match offset and optional match length extension
+ *  bytes. The last sequence carries literals only.
+ *
+ *  Format: http://code.google.com/p/lz4/
+ */
+
+#define MINMATCH	4
+
+/* The last LASTLITERALS bytes of a block are always literals */
+#define LASTLITERALS	5
+
+/* A match must not start within MFLIMIT bytes of the end of the input */
+#define MFLIMIT		(8 + MINMATCH)
+
+#define MAX_DISTANCE	0xffff
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define LZ4_HASHLOG	12
+#define LZ4_HASHSIZE	(1U << LZ4_HASHLOG)
@@ -0,0 +1,181 @@
+/*
+ * Stress test for zsmalloc
+ *
+ * One kthread per online CPU allocates, fills, maps, verifies and frees
+ * objects of random sizes in a single shared pool, while the thread on
+ * the first CPU also compacts the pool, so that map/free pinning races
+ * against object migration.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define pr_fmt(fmt) "test_zsmalloc: " fmt
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/err.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/zsmalloc.h>
+
+static unsigned int nr_objs = 1024;
+module_param(nr_objs, uint, 0444);
+MODULE_PARM_DESC(nr_objs, "Objects each thread keeps live");
+
+static unsigned int nr_ops = 100000;
+module_param(nr_ops, uint, 0444);
+MODULE_PARM_DESC(nr_ops, "Replace operations per thread");
+
+static unsigned int max_size = PAGE_SIZE * 3 / 4;
+module_param(max_size, uint, 0444);
+MODULE_PARM_DESC(max_size, "Largest object size");
+
+static unsigned int compact_interval = 4096;
+module_param(compact_interval, uint, 0444);
+MODULE_PARM_DESC(compact_interval, "Operations between zs_compact() calls");
+
+struct test_obj {
+	unsigned long handle;
+	unsigned int size;
+	u8 fill;
+};
+
+static struct zs_pool *test_pool;
+static atomic_t test_running;
+static atomic_t test_errors;
+static DECLARE_COMPLETION(test_done);
+
+static int test_obj_store(struct test_obj *obj)
+{
+	void *addr;
+
+	obj->size = random32() % max_size + 1;
+	obj->fill = random32();
+	obj->handle = zs_malloc(test_pool, obj->size, GFP_KERNEL);
+	if (!obj->handle)
+		return -ENOMEM;
+
+	addr = zs_map_object(test_pool, obj->handle, ZS_MM_WO);
+	memset(addr, obj->fill, obj->size);
+	zs_unmap_object(test_pool, obj->handle);
+
+	return 0;
+}
+
+static void test_obj_release(struct test_obj *obj)
+{
+	void *addr, *bad;
+
+	if (!obj->handle)
+		return;
+
+	addr = zs_map_object(test_pool, obj->handle, ZS_MM_RO);
+	bad = memchr_inv(addr, obj->fill, obj->size);
+	zs_unmap_object(test_pool, obj->handle);
+
+	if (bad) {
+		pr_err("cpu %d: object %lx (size %u) corrupted at offset %ld\n",
+			raw_smp_processor_id(), obj->handle, obj->size,
+			(long)(bad - addr));
+		atomic_inc(&test_errors);
+	}
+
+	zs_free(test_pool, obj->handle);
+	obj->handle = 0;
+}
+
+static int test_thread(void *data)
+{
+	bool compact = (long)data;
+	struct test_obj *objs;
+	unsigned int i;
+
+	objs = vzalloc(nr_objs * sizeof(*objs));
+	if (!objs) {
+		atomic_inc(&test_errors);
+		goto out;
+	}
+
+	for (i = 0; i < nr_ops; i++) {
+		struct test_obj *obj = &objs[random32() % nr_objs];
+
+		test_obj_release(obj);
+		if (test_obj_store(obj))
+			atomic_inc(&test_errors);
+
+		if (compact && compact_interval && !(i % compact_interval))
+			zs_compact(test_pool);
+		cond_resched();
+	}
+
+	for (i = 0; i < nr_objs; i++)
+		test_obj_release(&objs[i]);
+	vfree(objs);
+out:
+	if (atomic_dec_and_test(&test_running))
+		complete(&test_done);
+	return 0;
+}
+
+static int __init test_zsmalloc_init(void)
+{
+	struct task_struct *task;
+	bool first = true;
+	int cpu, nr_threads = 0;
+
+	/* zsmalloc keeps a word of its own in front of every object */
+	if (!nr_objs || !max_size ||
+	    max_size > PAGE_SIZE - sizeof(unsigned long)) {
+		pr_err("invalid parameters\n");
+		return -EINVAL;
+	}
+
+	test_pool = zs_create_pool("test_zsmalloc", GFP_KERNEL, NULL);
+	if (!test_pool)
+		return -ENOMEM;
+
+	/* Hold a reference so that no thread can complete before all start */
+	atomic_set(&test_running, 1);
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		task = kthread_create(test_thread, (void *)(long)first,
+				"test_zsmalloc/%d", cpu);
+		if (IS_ERR(task)) {
+			atomic_inc(&test_errors);
+			continue;
+		}
+		kthread_bind(task, cpu);
+		atomic_inc(&test_running);
+		wake_up_process(task);
+		first = false;
+		nr_threads++;
+	}
+	put_online_cpus();
+
+	if (!atomic_dec_and_test(&test_running))
+		wait_for_completion(&test_done);
+
+	pr_info("%d threads, %u ops each: %d errors, %llu bytes left in pool\n",
+		nr_threads, nr_ops, atomic_read(&test_errors),
+		zs_get_total_size_bytes(test_pool));
+
+	zs_destroy_pool(test_pool);
+
+	return atomic_read(&test_errors) ? -EINVAL : 0;
+}
+
+static void __exit test_zsmalloc_exit(void)
+{
+}
+
+module_init(test_zsmalloc_init);
+module_exit(test_zsmalloc_exit);
+MODULE_LICENSE("GPL");
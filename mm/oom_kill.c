@@ -62,6 +62,7 @@ void compare_swap_oom_score_adj(int old_val, int new_val)
 		current->signal->oom_score_adj = new_val;
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
+	lowmem_adj_index_update(current);
 }
 
 /**
@@ -82,6 +83,7 @@ int test_set_oom_score_adj(int new_val)
 	current->signal->oom_score_adj = new_val;
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
+	lowmem_adj_index_update(current);
 
 	return old_val;
 }
@@ -30,6 +30,8 @@
  * 5. Misc changes upon KSM:
  *      * It has a fully x86-opitmized memcmp dedicated for 4-byte-aligned page
  *        comparison. It's much faster than default C version on x86.
+ *      * On ARM, the page comparison and zero page check read the page in
+ *        multi-word ldm bursts instead of the byte/word C loops.
  *      * rmap_item now has an struct *page member to loosely cache a
  *        address-->page mapping, which reduces too much time-costly
  *        follow_page().
@@ -69,10 +71,16 @@
 #include <linux/gcd.h>
 #include <linux/freezer.h>
 #include <linux/sradix-tree.h>
+#include <linux/cpufreq.h>
+#include <linux/kernel_stat.h>
+#include <linux/tick.h>
 
 #include <asm/tlbflush.h>
 #include "internal.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/uksm.h>
+
 #ifdef CONFIG_X86
 #undef memcmp
 
@@ -163,6 +171,68 @@ static int is_full_zero(const void *s1, size_t len)
 }
 
 #endif
+#elif defined(CONFIG_ARM)
+#undef memcmp
+#define memcmp memcmparm
+
+/*
+ * Compare word-aligned address s1 and s2, with length n a multiple of 16.
+ * Four words of each side are fetched with one ldm per iteration.  The
+ * first differing block is then compared bytewise, so the result is the
+ * same as the generic memcmp().
+ */
+int memcmparm(void *s1, void *s2, size_t n)
+{
+	__asm__ __volatile__
+	(
+	 "1:	ldmia	%0!, {r2, r3, r4, r5}\n\t"
+	 "ldmia	%1!, {r6, r7, r8, ip}\n\t"
+	 "eor	r2, r2, r6\n\t"
+	 "eor	r3, r3, r7\n\t"
+	 "eor	r4, r4, r8\n\t"
+	 "eor	r5, r5, ip\n\t"
+	 "orr	r2, r2, r3\n\t"
+	 "orr	r4, r4, r5\n\t"
+	 "orrs	r2, r2, r4\n\t"
+	 "bne	2f\n\t"
+	 "subs	%2, %2, #16\n\t"
+	 "bne	1b\n"
+	 "2:"
+	 : "+&r" (s1), "+&r" (s2), "+&r" (n)
+	 :
+	 : "r2", "r3", "r4", "r5", "r6", "r7", "r8", "ip", "cc", "memory");
+
+	if (!n)
+		return 0;
+
+	return __builtin_memcmp(s1 - 16, s2 - 16, 16);
+}
+
+/*
+ * Check the page is all zero ?  len must be a multiple of 32.
+ */
+static int is_full_zero(const void *s1, size_t len)
+{
+	__asm__ __volatile__
+	(
+	 "1:	ldmia	%0!, {r2, r3, r4, r5, r6, r7, r8, ip}\n\t"
+	 "orr	r2, r2, r3\n\t"
+	 "orr	r4, r4, r5\n\t"
+	 "orr	r6, r6, r7\n\t"
+	 "orr	r8, r8, ip\n\t"
+	 "orr	r2, r2, r4\n\t"
+	 "orr	r6, r6, r8\n\t"
+	 "orrs	r2, r2, r6\n\t"
+	 "bne	2f\n\t"
+	 "subs	%1, %1, #32\n\t"
+	 "bne	1b\n"
+	 "2:"
+	 : "+&r" (s1), "+&r" (len)
+	 :
+	 : "r2", "r3", "r4", "r5", "r6", "r7", "r8", "ip", "cc", "memory");
+
+	return !len;
+}
 #else
 static int is_full_zero(const void *s1, size_t len)
 {
@@ -567,6 +637,58 @@ static unsigned int uksm_run = 1;
 static DECLARE_WAIT_QUEUE_HEAD(uksm_thread_wait);
 static DEFINE_MUTEX(uksm_thread_mutex);
 
+/*
+ * With scan_threads > 1, each scan pass hands rung i to scanner i % N.
+ * uksmd is scanner 0 and runs everything outside the rung loops alone.
+ *
+ * uksm_ladder_mutex protects the rungs' slot trees and scan cursors,
+ * which judge_slot() changes across rungs.  uksm_tree_mutex protects the
+ * stable and unstable trees, the rmap_items in them and the global scan
+ * statistics.  Walking a slot, follow_page() and hashing the page run
+ * without either.  Lock order: mmap_sem (trylock only), ladder, tree.
+ */
+#define UKSM_MAX_SCAN_THREADS	SCAN_LADDER_SIZE
+
+struct uksm_scanner {
+	struct task_struct *task;
+	unsigned int id;
+	unsigned long pass;
+	unsigned long vpages;
+};
+
+static struct uksm_scanner uksm_scanners[UKSM_MAX_SCAN_THREADS];
+static unsigned int uksm_scan_threads = 1;
+static unsigned long uksm_scan_pass;
+static atomic_t uksm_scan_pending = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(uksm_scan_start_wait);
+static DECLARE_WAIT_QUEUE_HEAD(uksm_scan_done_wait);
+static DEFINE_MUTEX(uksm_ladder_mutex);
+static DEFINE_MUTEX(uksm_tree_mutex);
+
+/*
+ * With uksm_idle_budget set, each pass scans uksm_scan_budget percent of
+ * the pages its cpu_ratio allows, and sleeps as if the ratio was scaled
+ * the same way.  The budget follows the idle time of the online CPUs since
+ * the last pass, drops to UKSM_BUDGET_MIN while other tasks are runnable
+ * on every CPU, and shrinks with the cpufreq limit when the CPU is capped
+ * below its top frequency, e.g. by thermal throttling.
+ */
+#define UKSM_BUDGET_MIN		1
+
+struct uksm_idle_sample {
+	u64 idle;
+	u64 wall;
+};
+
+static DEFINE_PER_CPU(struct uksm_idle_sample, uksm_idle_sample);
+static unsigned int uksm_idle_budget = 1;
+static unsigned int uksm_scan_budget = 100;
+
+/* Pages merged since start up, and the scan and merge rates over ~1s */
+static unsigned long uksm_pages_merged;
+static unsigned long uksm_scan_rate;
+static unsigned long uksm_merge_rate;
+
 /*
  * List vma_slot_new is for newly created vma_slot waiting to be added by
  * ksmd. If one cannot be added(e.g. due to it's too small), it's moved to
@@ -1325,25 +1447,31 @@ static inline void inc_rshash_neg(unsigned long delta)
 }
 
 
+/* The time saved by hashing at @hash_strength instead of comparing */
+static inline void page_hash_cost(unsigned long hash_strength)
+{
+	unsigned long delta;
+
+	if (HASH_STRENGTH_FULL > hash_strength)
+		delta = HASH_STRENGTH_FULL - hash_strength;
+	else
+		delta = 0;
+
+	inc_rshash_pos(delta);
+}
+
 static inline u32 page_hash(struct page *page, unsigned long hash_strength,
 			    int cost_accounting)
 {
 	u32 val;
-	unsigned long delta;
 
 	void *addr = kmap_atomic(page, KM_USER0);
 
 	val = random_sample_hash(addr, hash_strength);
 	kunmap_atomic(addr, KM_USER0);
 
-	if (cost_accounting) {
-		if (HASH_STRENGTH_FULL > hash_strength)
-			delta = HASH_STRENGTH_FULL - hash_strength;
-		else
-			delta = 0;
-
-		inc_rshash_pos(delta);
-	}
+	if (cost_accounting)
+		page_hash_cost(hash_strength);
 
 	return val;
 }
@@ -2557,6 +2685,7 @@ node_vma_ok: /* ok, ready to add to the list */
 	hold_anon_vma(rmap_item, rmap_item->slot->vma->anon_vma);
 	if (logdedup) {
 		rmap_item->slot->pages_merged++;
+		uksm_pages_merged++;
 		if (cont_p) {
 			hlist_for_each_entry_continue(node_vma,
 						      cont_p, hlist) {
@@ -3163,6 +3292,9 @@ static inline int vma_fully_scanned(struct vma_slot *slot)
  * get_next_rmap_item() - Get the next rmap_item in a vma_slot according to
  * its random permutation. This function is embedded with the random
  * permutation index management code.
+ *
+ * The page is hashed without locks; uksm_tree_mutex is taken after that
+ * and is always held on return, also when no rmap_item is returned.
  */
 static struct rmap_item *get_next_rmap_item(struct vma_slot *slot, u32 *hash)
 {
@@ -3170,6 +3302,7 @@ static struct rmap_item *get_next_rmap_item(struct vma_slot *slot, u32 *hash)
 	struct rmap_item *item = NULL;
 	struct rmap_list_entry *scan_entry, *swap_entry = NULL;
 	struct page *page;
+	int locked = 0;
 
 	scan_index = swap_index = slot->pages_scanned % slot->pages;
 
@@ -3186,8 +3319,10 @@ static struct rmap_item *get_next_rmap_item(struct vma_slot *slot, u32 *hash)
 	}
 
 	scan_entry = get_rmap_list_entry(slot, scan_index, 1);
-	if (!scan_entry)
+	if (!scan_entry) {
+		mutex_lock(&uksm_tree_mutex);
 		return NULL;
+	}
 
 	if (entry_is_new(scan_entry)) {
 		scan_entry->addr = get_index_orig_addr(slot, scan_index);
@@ -3230,12 +3365,17 @@ static struct rmap_item *get_next_rmap_item(struct vma_slot *slot, u32 *hash)
 	flush_dcache_page(page);
 
 
-	*hash = page_hash(page, hash_strength, 1);
+	*hash = page_hash(page, hash_strength, 0);
+
+	mutex_lock(&uksm_tree_mutex);
+	locked = 1;
+	page_hash_cost(hash_strength);
 	inc_uksm_pages_scanned();
 	/*if the page content all zero, re-map to zero-page*/
 	if (find_zero_page_hash(hash_strength, *hash)) {
 		if (!cmp_and_merge_zero_page(slot->vma, page)) {
 			slot->pages_merged++;
+			uksm_pages_merged++;
 			inc_zone_page_state(page, NR_UKSM_ZERO_PAGES);
 			dec_mm_counter(slot->mm, MM_ANONPAGES);
 
@@ -3271,6 +3411,8 @@ putpage:
 	put_page(page);
 	page = NULL;
 nopage:
+	if (!locked)
+		mutex_lock(&uksm_tree_mutex);
 	/* no page, store addr back and free rmap_item if possible */
 	free_entry_item(scan_entry);
 	put_rmap_list_entry(slot, scan_index);
@@ -3286,7 +3428,7 @@ static inline int in_stable_tree(struct rmap_item *rmap_item)
 
 /**
  * scan_vma_one_page() - scan the next page in a vma_slot. Called with
- * mmap_sem locked.
+ * mmap_sem locked, takes uksm_tree_mutex via get_next_rmap_item().
  */
 static noinline void scan_vma_one_page(struct vma_slot *slot)
 {
@@ -3316,6 +3458,7 @@ out1:
 
 	if (vma_fully_scanned(slot))
 		slot->fully_scanned_round = fully_scanned_round;
+	mutex_unlock(&uksm_tree_mutex);
 }
 
 static inline unsigned long rung_get_pages(struct scan_rung *rung)
@@ -4393,137 +4536,376 @@ static inline int hash_round_finished(void)
 #define BUSY_RETRY		100
 
 /**
- * uksm_do_scan()  - the main worker function.
+ * uksm_scan_rung() - use up the pages_to_scan quota of one rung.
+ *
+ * return the number of pages scanned.
  */
-static noinline void uksm_do_scan(void)
+static unsigned long uksm_scan_rung(struct scan_rung *rung)
 {
-	struct vma_slot *slot, *iter;
+	struct vma_slot *slot = NULL, *iter;
 	struct mm_struct *busy_mm;
-	unsigned char round_finished, all_rungs_emtpy;
-	int i, err, mmsem_batch;
-	unsigned long pcost;
-	long long delta_exec;
-	unsigned long vpages, max_cpu_ratio;
-	unsigned long long start_time, end_time, scan_time;
-	unsigned int expected_jiffies;
+	int err, mmsem_batch = 0;
+	int busy_retry = BUSY_RETRY;
+	unsigned long vpages = 0;
 
-	might_sleep();
+	mutex_lock(&uksm_ladder_mutex);
+	if (!rung->vma_root.num) {
+		rung->pages_to_scan = 0;
+		goto out;
+	}
 
-	vpages = 0;
+	/*
+	 * Do not consider rung_round_finished() here, just used up the
+	 * rung->pages_to_scan quota.
+	 */
+	while (rung->pages_to_scan && rung->vma_root.num &&
+	       likely(!freezing(current))) {
+		int reset = 0;
 
-	start_time = task_sched_runtime(current);
-	max_cpu_ratio = 0;
-	mmsem_batch = 0;
+		slot = rung->current_scan;
 
-	for (i = 0; i < SCAN_LADDER_SIZE;) {
-		struct scan_rung *rung = &uksm_scan_ladder[i];
-		unsigned long ratio;
-		int busy_retry;
+		BUG_ON(vma_fully_scanned(slot));
 
-		if (!rung->pages_to_scan) {
-			i++;
-			continue;
+		if (mmsem_batch) {
+			err = 0;
+		} else {
+			err = try_down_read_slot_mmap_sem(slot);
 		}
 
-		if (!rung->vma_root.num) {
-			rung->pages_to_scan = 0;
-			i++;
+		if (err == -ENOENT) {
+rm_slot:
+			rung_rm_slot(slot);
 			continue;
 		}
 
-		ratio = rung_real_ratio(rung->cpu_ratio);
-		if (ratio > max_cpu_ratio)
-			max_cpu_ratio = ratio;
+		busy_mm = slot->mm;
+
+		if (err == -EBUSY) {
+			/* skip other vmas on the same mm */
+			do {
+				reset = advance_current_scan(rung);
+				iter = rung->current_scan;
+				busy_retry--;
+				if (iter->vma->vm_mm != busy_mm ||
+				    !busy_retry || reset)
+					break;
+			} while (1);
+
+			if (iter->vma->vm_mm != busy_mm) {
+				continue;
+			} else {
+				/* scan round finsished */
+				break;
+			}
+		}
+
+		BUG_ON(!vma_can_enter(slot->vma));
+		if (uksm_test_exit(slot->vma->vm_mm)) {
+			mmsem_batch = 0;
+			up_read(&slot->vma->vm_mm->mmap_sem);
+			goto rm_slot;
+		}
+
+		if (mmsem_batch)
+			mmsem_batch--;
+		else
+			mmsem_batch = UKSM_MMSEM_BATCH;
 
-		busy_retry = BUSY_RETRY;
 		/*
-		 * Do not consider rung_round_finished() here, just used up the
-		 * rung->pages_to_scan quota.
+		 * Ok, we have take the mmap_sem, ready to scan.  Only this
+		 * scanner moves the cursor of its rung, so it can be dropped.
 		 */
-		while (rung->pages_to_scan && rung->vma_root.num &&
-		       likely(!freezing(current))) {
-			int reset = 0;
+		mutex_unlock(&uksm_ladder_mutex);
+		scan_vma_one_page(slot);
+		cond_resched();
+		mutex_lock(&uksm_ladder_mutex);
+		rung->pages_to_scan--;
+		vpages++;
 
-			slot = rung->current_scan;
+		if (rung->current_offset + rung->step > slot->pages - 1
+		    || vma_fully_scanned(slot)) {
+			up_read(&slot->vma->vm_mm->mmap_sem);
+			mutex_lock(&uksm_tree_mutex);
+			judge_slot(slot);
+			mutex_unlock(&uksm_tree_mutex);
+			mmsem_batch = 0;
+		} else {
+			rung->current_offset += rung->step;
+			if (!mmsem_batch)
+				up_read(&slot->vma->vm_mm->mmap_sem);
+		}
 
-			BUG_ON(vma_fully_scanned(slot));
+		busy_retry = BUSY_RETRY;
+	}
 
-			if (mmsem_batch) {
-				err = 0;
-			} else {
-				err = try_down_read_slot_mmap_sem(slot);
-			}
+	if (mmsem_batch)
+		up_read(&slot->vma->vm_mm->mmap_sem);
+out:
+	mutex_unlock(&uksm_ladder_mutex);
+	return vpages;
+}
 
-			if (err == -ENOENT) {
-rm_slot:
-				rung_rm_slot(slot);
-				continue;
-			}
+/*
+ * Scan the rungs scanner @id owns in this pass.
+ */
+static unsigned long uksm_scan_rungs(unsigned int id, unsigned int nr)
+{
+	unsigned long vpages = 0;
+	int i;
 
-			busy_mm = slot->mm;
+	for (i = id; i < SCAN_LADDER_SIZE; i += nr) {
+		if (freezing(current))
+			break;
 
-			if (err == -EBUSY) {
-				/* skip other vmas on the same mm */
-				do {
-					reset = advance_current_scan(rung);
-					iter = rung->current_scan;
-					busy_retry--;
-					if (iter->vma->vm_mm != busy_mm ||
-					    !busy_retry || reset)
-						break;
-				} while (1);
+		if (uksm_scan_ladder[i].pages_to_scan)
+			vpages += uksm_scan_rung(&uksm_scan_ladder[i]);
 
-				if (iter->vma->vm_mm != busy_mm) {
-					continue;
-				} else {
-					/* scan round finsished */
-					break;
-				}
-			}
+		cond_resched();
+	}
 
-			BUG_ON(!vma_can_enter(slot->vma));
-			if (uksm_test_exit(slot->vma->vm_mm)) {
-				mmsem_batch = 0;
-				up_read(&slot->vma->vm_mm->mmap_sem);
-				goto rm_slot;
-			}
+	return vpages;
+}
 
-			if (mmsem_batch)
-				mmsem_batch--;
-			else
-				mmsem_batch = UKSM_MMSEM_BATCH;
+static int uksm_scanner_thread(void *data)
+{
+	struct uksm_scanner *scanner = data;
 
-			/* Ok, we have take the mmap_sem, ready to scan */
-			scan_vma_one_page(slot);
-			rung->pages_to_scan--;
-			vpages++;
+	set_freezable();
+	set_user_nice(current, 5);
 
-			if (rung->current_offset + rung->step > slot->pages - 1
-			    || vma_fully_scanned(slot)) {
-				up_read(&slot->vma->vm_mm->mmap_sem);
-				judge_slot(slot);
-				mmsem_batch = 0;
-			} else {
-				rung->current_offset += rung->step;
-				if (!mmsem_batch)
-					up_read(&slot->vma->vm_mm->mmap_sem);
-			}
+	while (!kthread_should_stop()) {
+		wait_event_freezable(uksm_scan_start_wait,
+			scanner->pass != ACCESS_ONCE(uksm_scan_pass) ||
+			kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+		if (scanner->pass == ACCESS_ONCE(uksm_scan_pass))
+			continue;
 
-			busy_retry = BUSY_RETRY;
-			cond_resched();
+		scanner->pass = uksm_scan_pass;
+		smp_rmb();
+		scanner->vpages = uksm_scan_rungs(scanner->id,
+						  uksm_scan_threads);
+		if (atomic_dec_and_test(&uksm_scan_pending))
+			wake_up(&uksm_scan_done_wait);
+	}
+	return 0;
+}
+
+/*
+ * Start or stop scanner threads so that @nr scan.  Called with
+ * uksm_thread_mutex held, so no scan pass is running.  If a thread
+ * cannot be started, the ones before it are kept and scan on their own.
+ */
+static int uksm_set_scan_threads(unsigned int nr)
+{
+	struct task_struct *task;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 1; i < nr; i++) {
+		struct uksm_scanner *scanner = &uksm_scanners[i];
+
+		if (scanner->task)
+			continue;
+
+		scanner->id = i;
+		scanner->pass = uksm_scan_pass;
+		task = kthread_run(uksm_scanner_thread, scanner, "uksmd/%u", i);
+		if (IS_ERR(task)) {
+			err = PTR_ERR(task);
+			nr = i;
+			break;
 		}
+		scanner->task = task;
+	}
 
-		if (mmsem_batch) {
-			up_read(&slot->vma->vm_mm->mmap_sem);
-			mmsem_batch = 0;
+	for (i = nr; i < UKSM_MAX_SCAN_THREADS; i++) {
+		struct uksm_scanner *scanner = &uksm_scanners[i];
+
+		if (!scanner->task)
+			continue;
+
+		kthread_stop(scanner->task);
+		scanner->task = NULL;
+	}
+
+	uksm_scan_threads = nr;
+	return err;
+}
+
+static inline u64 uksm_scanners_runtime(void)
+{
+	u64 runtime = task_sched_runtime(current);
+	unsigned int i;
+
+	for (i = 1; i < uksm_scan_threads; i++)
+		runtime += task_sched_runtime(uksm_scanners[i].task);
+
+	return runtime;
+}
+
+/*
+ * Fold the pages scanned and merged into the per second rates about once
+ * a second.
+ */
+static void uksm_update_rates(unsigned long vpages)
+{
+	static unsigned long window_start, window_scanned, window_merged;
+	unsigned long elapsed;
+
+	window_scanned += vpages;
+	elapsed = jiffies - window_start;
+	if (elapsed < HZ)
+		return;
+
+	uksm_scan_rate = window_scanned * HZ / elapsed;
+	uksm_merge_rate = (uksm_pages_merged - window_merged) * HZ / elapsed;
+	window_start = jiffies;
+	window_scanned = 0;
+	window_merged = uksm_pages_merged;
+}
+
+static u64 uksm_cpu_idle_time(int cpu, u64 *wall)
+{
+	u64 idle = get_cpu_idle_time_us(cpu, wall);
+
+	if (idle == -1ULL) {
+		/* No NO_HZ idle accounting, use the tick based one */
+		*wall = cputime_to_usecs(jiffies64_to_cputime64(get_jiffies_64()));
+		idle = cputime_to_usecs(kcpustat_cpu(cpu).cpustat[CPUTIME_IDLE]);
+	}
+
+	return idle;
+}
+
+/*
+ * The percentage of time the online CPUs spent idle since the last call.
+ */
+static unsigned int uksm_idle_percent(void)
+{
+	u64 idle, wall, idle_sum = 0, wall_sum = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		struct uksm_idle_sample *sample = &per_cpu(uksm_idle_sample, cpu);
+
+		idle = uksm_cpu_idle_time(cpu, &wall);
+		if (sample->wall && wall > sample->wall &&
+		    idle >= sample->idle) {
+			idle_sum += idle - sample->idle;
+			wall_sum += wall - sample->wall;
 		}
+		sample->idle = idle;
+		sample->wall = wall;
+	}
 
-		if (freezing(current))
-			break;
+	if (!wall_sum)
+		return 100;
 
-		cond_resched();
+	return min_t(u64, 100, div64_u64(idle_sum * 100, wall_sum));
+}
+
+/*
+ * The cpufreq limit of this CPU as a percentage of its top frequency.
+ */
+static unsigned int uksm_freq_percent(void)
+{
+	unsigned int pct = 100;
+#ifdef CONFIG_CPU_FREQ
+	struct cpufreq_policy *policy;
+
+	policy = cpufreq_cpu_get(raw_smp_processor_id());
+	if (policy) {
+		if (policy->max < policy->cpuinfo.max_freq)
+			pct = policy->max * 100 / policy->cpuinfo.max_freq;
+		cpufreq_cpu_put(policy);
 	}
-	end_time = task_sched_runtime(current);
+#endif
+	return pct;
+}
+
+static void uksm_calc_scan_budget(void)
+{
+	unsigned int idle, freq, budget;
+	unsigned long running;
+
+	idle = uksm_idle_percent();
+	freq = uksm_freq_percent();
+	/* Do not count uksmd itself */
+	running = nr_running();
+	if (running)
+		running--;
+
+	if (!uksm_idle_budget)
+		budget = 100;
+	else if (running >= num_online_cpus())
+		budget = UKSM_BUDGET_MIN;
+	else
+		budget = max_t(unsigned int, idle * freq / 100,
+			       UKSM_BUDGET_MIN);
+
+	uksm_scan_budget = budget;
+	trace_uksm_scan_budget(idle, running, freq, budget);
+}
+
+/**
+ * uksm_do_scan()  - the main worker function.
+ */
+static noinline void uksm_do_scan(void)
+{
+	unsigned char round_finished, all_rungs_emtpy;
+	int i;
+	unsigned int nr;
+	unsigned long pcost;
+	long long delta_exec;
+	unsigned long vpages, max_cpu_ratio;
+	unsigned long long start_time, end_time, scan_time;
+	unsigned int expected_jiffies;
+
+	might_sleep();
+
+	nr = uksm_scan_threads;
+	start_time = uksm_scanners_runtime();
+	max_cpu_ratio = 0;
+	uksm_calc_scan_budget();
+
+	for (i = 0; i < SCAN_LADDER_SIZE; i++) {
+		struct scan_rung *rung = &uksm_scan_ladder[i];
+		unsigned long ratio;
+
+		if (!rung->pages_to_scan || !rung->vma_root.num)
+			continue;
+
+		if (uksm_scan_budget < 100)
+			rung->pages_to_scan = DIV_ROUND_UP(rung->pages_to_scan *
+						uksm_scan_budget, 100);
+
+		ratio = rung_real_ratio(rung->cpu_ratio);
+		if (ratio > max_cpu_ratio)
+			max_cpu_ratio = ratio;
+	}
+
+	if (nr > 1) {
+		atomic_set(&uksm_scan_pending, nr - 1);
+		smp_wmb();
+		uksm_scan_pass++;
+		wake_up_all(&uksm_scan_start_wait);
+	}
+
+	vpages = uksm_scan_rungs(0, nr);
+
+	if (nr > 1) {
+		/* A scanner may already be frozen, so we have to be freezable */
+		wait_event_freezable(uksm_scan_done_wait,
+				     !atomic_read(&uksm_scan_pending));
+		for (i = 1; i < nr; i++)
+			vpages += uksm_scanners[i].vpages;
+	}
+
+	uksm_update_rates(vpages);
+
+	end_time = uksm_scanners_runtime();
 	delta_exec = end_time - start_time;
 
 	if (freezing(current))
@@ -4583,9 +4965,11 @@ rm_slot:
 	uksm_calc_scan_pages();
 	uksm_sleep_real = uksm_sleep_jiffies;
 	/* in case of radical cpu bursts, apply the upper bound */
-	end_time = task_sched_runtime(current);
+	end_time = uksm_scanners_runtime();
+	scan_time = 0;
 	if (max_cpu_ratio && end_time > start_time) {
 		scan_time = end_time - start_time;
+		max_cpu_ratio = max(max_cpu_ratio * uksm_scan_budget / 100, 1UL);
 		expected_jiffies = msecs_to_jiffies(
 			scan_time_to_sleep(scan_time, max_cpu_ratio));
 
@@ -4596,6 +4980,8 @@ rm_slot:
 		if (jiffies_to_msecs(uksm_sleep_real) > MSEC_PER_SEC)
 			uksm_sleep_real = msecs_to_jiffies(1000);
 	}
+	trace_uksm_scan_sleep(vpages, scan_time,
+			      jiffies_to_msecs(uksm_sleep_real));
 
 	return;
 }
@@ -5045,6 +5431,61 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 UKSM_ATTR(run);
 
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", uksm_scan_threads);
+}
+
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr;
+
+	err = strict_strtoul(buf, 10, &nr);
+	if (err || !nr || nr > UKSM_MAX_SCAN_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&uksm_thread_mutex);
+	err = uksm_set_scan_threads(nr);
+	mutex_unlock(&uksm_thread_mutex);
+
+	return err ? err : count;
+}
+UKSM_ATTR(scan_threads);
+
+static ssize_t idle_budget_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", uksm_idle_budget);
+}
+
+static ssize_t idle_budget_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
+
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
+
+	uksm_idle_budget = flags;
+
+	return count;
+}
+UKSM_ATTR(idle_budget);
+
+static ssize_t scan_budget_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", uksm_scan_budget);
+}
+UKSM_ATTR_RO(scan_budget);
+
 static ssize_t abundant_threshold_show(struct kobject *kobj,
 				     struct kobj_attribute *attr, char *buf)
 {
@@ -5309,6 +5750,20 @@ static ssize_t sleep_times_show(struct kobject *kobj,
 }
 UKSM_ATTR_RO(sleep_times);
 
+static ssize_t scan_pages_per_sec_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", uksm_scan_rate);
+}
+UKSM_ATTR_RO(scan_pages_per_sec);
+
+static ssize_t merge_pages_per_sec_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", uksm_merge_rate);
+}
+UKSM_ATTR_RO(merge_pages_per_sec);
+
 
 static struct attribute *uksm_attrs[] = {
 	&max_cpu_percentage_attr.attr,
@@ -5323,6 +5778,11 @@ static struct attribute *uksm_attrs[] = {
 	&pages_scanned_attr.attr,
 	&hash_strength_attr.attr,
 	&sleep_times_attr.attr,
+	&scan_threads_attr.attr,
+	&idle_budget_attr.attr,
+	&scan_budget_attr.attr,
+	&scan_pages_per_sec_attr.attr,
+	&merge_pages_per_sec_attr.attr,
 	&thrash_threshold_attr.attr,
 	&abundant_threshold_attr.attr,
 	&cpu_ratios_attr.attr,
@@ -5401,6 +5861,113 @@ static inline int cal_positive_negative_costs(void)
 	return 0;
 }
 
+#ifdef CONFIG_UKSM_SELFTEST
+static int __init is_full_zero_ref(const void *s1, size_t len)
+{
+	const unsigned char *src = s1;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline int cmp_sign(int ret)
+{
+	return (ret > 0) - (ret < 0);
+}
+
+static int __init selftest_check(unsigned char *p1, unsigned char *p2)
+{
+	if (is_full_zero(p1, PAGE_SIZE) != is_full_zero_ref(p1, PAGE_SIZE))
+		return 1;
+	if (cmp_sign(memcmp(p1, p2, PAGE_SIZE)) !=
+	    cmp_sign(__builtin_memcmp(p1, p2, PAGE_SIZE)))
+		return 1;
+	if (cmp_sign(memcmp(p2, p1, PAGE_SIZE)) !=
+	    cmp_sign(__builtin_memcmp(p2, p1, PAGE_SIZE)))
+		return 1;
+	return 0;
+}
+
+#define SELFTEST_RATE(expr)					\
+({								\
+	unsigned long __start = jiffies, __n = 0;		\
+								\
+	while (jiffies - __start < HZ / 10) {			\
+		int __i;					\
+								\
+		for (__i = 0; __i < 100; __i++)			\
+			ret = (expr);				\
+		__n += 100;					\
+	}							\
+	__n * HZ / (jiffies - __start);				\
+})
+
+/*
+ * Check is_full_zero() and memcmp() against byte-wise references on
+ * pages that differ in one byte at every offset and on random pages,
+ * then report how many pages per second each helper handles.
+ */
+static int __init uksm_selftest(void)
+{
+	unsigned char *p1, *p2;
+	unsigned long i, pos, errors = 0;
+	unsigned long zero, zero_ref, cmp, cmp_ref, hash;
+	/*IMPORTANT: volatile is needed to prevent over-optimization by gcc. */
+	volatile int ret;
+
+	p1 = (unsigned char *)__get_free_page(GFP_KERNEL);
+	p2 = (unsigned char *)__get_free_page(GFP_KERNEL);
+	if (!p1 || !p2) {
+		free_page((unsigned long)p1);
+		free_page((unsigned long)p2);
+		return -ENOMEM;
+	}
+
+	memset(p1, 0, PAGE_SIZE);
+	memset(p2, 0, PAGE_SIZE);
+	errors += selftest_check(p1, p2);
+
+	for (i = 0; i < PAGE_SIZE; i++) {
+		p1[i] = 1 + random32() % 255;
+		errors += selftest_check(p1, p2);
+		p1[i] = 0;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (pos = 0; pos < PAGE_SIZE / sizeof(u32); pos++)
+			((u32 *)p1)[pos] = random32();
+		memcpy(p2, p1, PAGE_SIZE);
+		errors += selftest_check(p1, p2);
+		pos = random32() % PAGE_SIZE;
+		p2[pos] = ~p2[pos];
+		errors += selftest_check(p1, p2);
+	}
+
+	memset(p1, 0, PAGE_SIZE);
+	memset(p2, 0, PAGE_SIZE);
+	zero = SELFTEST_RATE(is_full_zero(p1, PAGE_SIZE));
+	zero_ref = SELFTEST_RATE(is_full_zero_ref(p1, PAGE_SIZE));
+	cmp = SELFTEST_RATE(memcmp(p1, p2, PAGE_SIZE));
+	cmp_ref = SELFTEST_RATE(__builtin_memcmp(p1, p2, PAGE_SIZE));
+	hash = SELFTEST_RATE(random_sample_hash(p1, HASH_STRENGTH_FULL));
+
+	printk(KERN_INFO "UKSM: selftest %lu errors, pages/s: zero check %lu "
+			 "(byte-wise %lu), compare %lu (generic %lu), "
+			 "full hash %lu\n",
+	       errors, zero, zero_ref, cmp, cmp_ref, hash);
+
+	free_page((unsigned long)p1);
+	free_page((unsigned long)p2);
+
+	return errors ? -EINVAL : 0;
+}
+#endif /* CONFIG_UKSM_SELFTEST */
+
 static int init_zeropage_hash_table(void)
 {
 	struct page *page;
@@ -5576,6 +6143,13 @@ static int __init uksm_init(void)
 	if (err)
 		goto out_free0;
 
+#ifdef CONFIG_UKSM_SELFTEST
+	/* Never merge pages with a comparison that disagrees with memcmp() */
+	err = uksm_selftest();
+	if (err)
+		goto out_free;
+#endif
+
 	uksm_thread = kthread_run(uksm_scan_thread, NULL, "uksmd");
 	if (IS_ERR(uksm_thread)) {
 		printk(KERN_ERR "uksm: creating kthread failed\n");
@@ -12,7 +12,7 @@
 
 
 /*
- * This allocator is designed for use with zcache and zram. Thus, the
+ * This allocator is designed for use with zcache, zram and zswap. Thus, the
  * allocator is supposed to work well under low memory conditions. In
  * particular, it never attempts higher order page allocation which is
  * very likely to fail under memory pressure. On the other hand, if we
@@ -34,8 +34,8 @@
  * is returned (see zs_malloc).
  *
  * Additionally, zs_malloc() does not return a dereferenceable pointer.
- * Instead, it returns an opaque handle (unsigned long) which encodes actual
- * location of the allocated object. The reason for this indirection is that
+ * Instead, it returns an opaque handle (unsigned long) which refers to the
+ * actual location of the allocated object. The reason for this indirection is that
  * zsmalloc does not keep zspages permanently mapped since that would cause
  * issues on 32-bit systems where the VA region for kernel space mappings
  * is very small. So, before using the allocating memory, the object has to
@@ -69,11 +69,34 @@
  *	PG_private: identifies the first component page
  *	PG_private2: identifies the last component page
  *
+ * Locking:
+ *	class->lock: protects the fullness lists, the freelists and the
+ *		stats of one size class. Each class is allocated on its
+ *		own so that the locks of neighbouring classes do not share
+ *		a cache line.
+ *	HANDLE_PIN_BIT: a bit spinlock in the word a handle points to,
+ *		held while the object is mapped or being freed so that
+ *		zs_compact() leaves it in place.
+ *
+ * zs_map_object() and zs_unmap_object() only pin the handle, they
+ * never take a class lock, so concurrent readers of different objects
+ * do not serialize against each other or against zs_malloc()/zs_free()
+ * in the same class.
+ *
+ * Handles are indirect so that zs_compact() can move objects out of
+ * sparsely used zspages into denser ones of the same size class and
+ * free the emptied zspages.
  */
 
+#ifdef CONFIG_ZSMALLOC_DEBUG
+#define DEBUG
+#endif
+
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
@@ -85,6 +108,8 @@
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
 #include <linux/hardirq.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
@@ -107,13 +132,20 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (unsigned long) handle value.
+ * as single (unsigned long) value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * The handle returned by zs_malloc() points to a word holding this
+ * location, so that zs_compact() can move the object. Bit 0 of that
+ * word (HANDLE_PIN_BIT) pins the object while it is mapped or freed.
+ * The first word of each allocated object holds its handle, tagged
+ * with OBJ_ALLOCATED_TAG; free objects hold the freelist link there,
+ * which never has the tag set.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -128,9 +160,15 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Room taken by the handle at the start of each object */
+#define ZS_HANDLE_SIZE	(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -192,11 +230,14 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	/* Number of objects a zspage holds */
+	int objs_per_zspage;
 
 	spinlock_t lock;
 
 	/* stats */
-	u64 pages_allocated;
+	unsigned long pages_allocated;
+	unsigned long obj_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -208,14 +249,27 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of an allocated object, with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
-	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct size_class *size_class[ZS_SIZE_CLASSES];
 
 	struct zs_ops *ops;
+	const char *name;
+
+	/* Compacts the pool under memory pressure, if the pool is named */
+	struct shrinker shrinker;
+	atomic_long_t pages_compacted;	/* zspage pages freed by zs_compact */
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
 /*
@@ -238,17 +292,17 @@ struct mapping_area {
 };
 
 /* default page alloc/free ops */
-struct page *zs_alloc_page(gfp_t flags)
+static struct page *zs_alloc_page(gfp_t flags)
 {
 	return alloc_page(flags);
 }
 
-void zs_free_page(struct page *page)
+static void zs_free_page(struct page *page)
 {
 	__free_page(page);
 }
 
-struct zs_ops zs_default_ops = {
+static struct zs_ops zs_default_ops = {
 	.alloc = zs_alloc_page,
 	.free = zs_free_page
 };
@@ -256,6 +310,13 @@ struct zs_ops zs_default_ops = {
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* Handles of all pools */
+static struct kmem_cache *zs_handle_cache;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+static struct dentry *zs_stat_root;
+#endif
+
 static int is_first_page(struct page *page)
 {
 	return PagePrivate(page);
@@ -310,7 +371,7 @@ static int get_size_class_index(int size)
  * For each size class, zspages are divided into different groups
  * depending on how "full" they are. This was done so that we could
  * easily find empty or nearly empty zspages when we try to shrink
- * the pool (not yet implemented). This function returns fullness
+ * the pool (see zs_compact). This function returns fullness
  * status of the given page.
  */
 static enum fullness_group get_fullness_group(struct page *page,
@@ -321,7 +382,7 @@ static enum fullness_group get_fullness_group(struct page *page,
 	BUG_ON(!is_first_page(page));
 
 	inuse = page->inuse;
-	max_objects = class->pages_per_zspage * PAGE_SIZE / class->size;
+	max_objects = class->objs_per_zspage;
 
 	if (inuse == 0)
 		fg = ZS_EMPTY;
@@ -392,17 +453,15 @@ static void remove_zspage(struct page *page, struct size_class *class,
  * page from the freelist of the old fullness group to that of the new
  * fullness group.
  */
-static enum fullness_group fix_fullness_group(struct zs_pool *pool,
+static enum fullness_group fix_fullness_group(struct size_class *class,
 						struct page *page)
 {
-	int class_idx;
-	struct size_class *class;
+	unsigned int class_idx;
 	enum fullness_group currfg, newfg;
 
 	BUG_ON(!is_first_page(page));
 
 	get_zspage_mapping(page, &class_idx, &currfg);
-	class = &pool->size_class[class_idx];
 	newfg = get_fullness_group(page, class);
 	if (newfg == currfg)
 		goto out;
@@ -477,28 +536,67 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single object location value */
+static void *location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given object location */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = handle & OBJ_INDEX_MASK;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+/* The handle must not be pinned by anyone else */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long alloc_handle(gfp_t flags)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+			flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -575,7 +673,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -586,7 +684,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -641,7 +739,7 @@ static struct page *alloc_zspage(struct zs_ops *ops, struct size_class *class,
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = location_to_obj(first_page, 0);
 
 	error = 0; /* Success */
 
@@ -771,6 +869,11 @@ static void __zs_unmap_object(struct mapping_area *area,
 	if (area->vm_mm == ZS_MM_RO)
 		goto out;
 
+	/* Leave the handle in front of the object alone */
+	buf += ZS_HANDLE_SIZE;
+	off += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+
 	sizes[0] = PAGE_SIZE - off;
 	sizes[1] = size - sizes[0];
 
@@ -789,6 +892,133 @@ out:
 
 #endif /* CONFIG_PGTABLE_MAPPING */
 
+#ifdef CONFIG_ZSMALLOC_STAT
+static int zs_class_zspages(struct size_class *class,
+				enum fullness_group fullness)
+{
+	struct page *head = class->fullness_list[fullness];
+	struct list_head *pos;
+	int count;
+
+	if (!head)
+		return 0;
+
+	count = 1;
+	list_for_each(pos, &head->lru)
+		count++;
+
+	return count;
+}
+
+static int zs_stats_classes_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, obj_allocated, obj_used;
+	unsigned long pages_used;
+	unsigned long total_obj_allocated = 0, total_obj_used = 0;
+	unsigned long total_pages_used = 0;
+	int i;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = zs_class_zspages(class, ZS_ALMOST_FULL);
+		almost_empty = zs_class_zspages(class, ZS_ALMOST_EMPTY);
+		pages_used = class->pages_allocated;
+		obj_allocated = pages_used / class->pages_per_zspage *
+				class->objs_per_zspage;
+		obj_used = class->obj_inuse;
+		spin_unlock(&class->lock);
+
+		if (!pages_used)
+			continue;
+
+		seq_printf(s, " %5d %5d %11lu %12lu %13lu %10lu %10lu %16d\n",
+			i, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->pages_per_zspage);
+
+		total_obj_allocated += obj_allocated;
+		total_obj_used += obj_used;
+		total_pages_used += pages_used;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11s %12s %13lu %10lu %10lu\n",
+			"Total", "", "", "", total_obj_allocated,
+			total_obj_used, total_pages_used);
+
+	return 0;
+}
+
+static int zs_stats_classes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_classes_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_classes_fops = {
+	.open		= zs_stats_classes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int zs_pages_compacted_get(void *data, u64 *val)
+{
+	struct zs_pool *pool = data;
+
+	*val = atomic_long_read(&pool->pages_compacted);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zs_pages_compacted_fops, zs_pages_compacted_get,
+			NULL, "%llu\n");
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	/* Pools sharing a name only get stats for the first one */
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (!pool->stat_dentry) {
+		pr_warning("zsmalloc: no debugfs stats for pool %s\n",
+			pool->name);
+		return;
+	}
+
+	debugfs_create_file("classes", S_IRUGO, pool->stat_dentry, pool,
+			&zs_stats_classes_fops);
+	debugfs_create_file("pages_compacted", S_IRUGO, pool->stat_dentry,
+			pool, &zs_pages_compacted_fops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+}
+#else
+static inline void zs_pool_stat_create(struct zs_pool *pool) {}
+static inline void zs_pool_stat_destroy(struct zs_pool *pool) {}
+static inline void zs_stat_init(void) {}
+static inline void zs_stat_exit(void) {}
+#endif
+
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
 {
@@ -823,12 +1053,23 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	zs_stat_exit();
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	zs_stat_init();
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -841,24 +1082,371 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+static unsigned long obj_malloc(struct size_class *class,
+				struct page *first_page, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(m_page)
+							+ m_offset);
+	first_page->freelist = link->next;
+	/* Record the handle in the object header for zs_compact() */
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+	class->obj_inuse++;
+
+	return obj;
+}
+
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	/* Insert this object in containing zspage's freelist */
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->obj_inuse--;
+}
+
+/* Pages that compacting @class would free, going by its usage counts */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_allocated, obj_wasted;
+
+	obj_allocated = class->pages_allocated / class->pages_per_zspage *
+			class->objs_per_zspage;
+	if (obj_allocated <= class->obj_inuse)
+		return 0;
+
+	obj_wasted = obj_allocated - class->obj_inuse;
+
+	return obj_wasted / class->objs_per_zspage * class->pages_per_zspage;
+}
+
+/* Take a zspage off the fullness lists, trying them in @order */
+static struct page *isolate_zspage(struct size_class *class,
+				const enum fullness_group *order)
+{
+	struct page *first_page;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		first_page = class->fullness_list[order[i]];
+		if (first_page) {
+			remove_zspage(first_page, class, order[i]);
+			return first_page;
+		}
+	}
+
+	return NULL;
+}
+
+/* Sparse zspages are emptied first... */
+static const enum fullness_group source_order[] = {
+	ZS_ALMOST_EMPTY, ZS_ALMOST_FULL
+};
+
+/* ...into the densest ones */
+static const enum fullness_group target_order[] = {
+	ZS_ALMOST_FULL, ZS_ALMOST_EMPTY
+};
+
+/* Put an isolated zspage back on the list matching its fullness */
+static enum fullness_group putback_zspage(struct size_class *class,
+				struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page, class);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+/* Copy an object between two zspages, either of which may span pages */
+static void zs_object_copy(struct size_class *class, unsigned long dst,
+				unsigned long src)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	s_size = min_t(int, class->size, PAGE_SIZE - s_off);
+	d_size = min_t(int, class->size, PAGE_SIZE - d_off);
+
+	while (1) {
+		size = min(s_size, d_size);
+
+		s_addr = kmap_atomic(s_page);
+		d_addr = kmap_atomic(d_page);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		kunmap_atomic(d_addr);
+		kunmap_atomic(s_addr);
+
+		written += size;
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		if (!s_size) {
+			s_page = get_next_page(s_page);
+			s_off = 0;
+			s_size = class->size - written;
+		}
+
+		if (!d_size) {
+			d_page = get_next_page(d_page);
+			d_off = 0;
+			d_size = class->size - written;
+		}
+	}
+}
+
+/*
+ * Find the first allocated object at or after index *@obj_idx of @page
+ * and pin it. Objects pinned by someone else (mapped or being freed)
+ * are skipped. Returns its handle, or 0 when the page has no more.
+ */
+static unsigned long find_alloced_obj(struct size_class *class,
+				struct page *page, unsigned long *obj_idx)
+{
+	unsigned long head, handle = 0;
+	unsigned long idx = *obj_idx;
+	unsigned long offset;
+	void *addr;
+
+	offset = obj_idx_to_offset(page, idx, class->size);
+	addr = kmap_atomic(page);
+	while (offset < PAGE_SIZE) {
+		head = *(unsigned long *)(addr + offset);
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+		offset += class->size;
+		idx++;
+	}
+	kunmap_atomic(addr);
+
+	*obj_idx = idx;
+	return handle;
+}
+
+/* Where migrate_zspage() left off in the source zspage */
+struct zs_compact_control {
+	struct page *s_page;		/* sub-page being scanned */
+	unsigned long obj_idx;		/* next object in s_page */
+	struct page *d_page;		/* first page of the target */
+};
+
+/*
+ * Move the objects of the source zspage into the target until the
+ * source is scanned (returns 0) or the target is full (-ENOMEM).
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	unsigned long obj_idx = cc->obj_idx;
+	unsigned long handle, used_obj, free_obj;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(class, s_page, &obj_idx);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			obj_idx = 0;
+			continue;
+		}
+
+		if (d_page->inuse == class->objs_per_zspage) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(class, d_page, handle);
+		zs_object_copy(class, free_obj, used_obj);
+		obj_idx++;
+		/* Switch the handle over, still pinned, then release it */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->s_page = s_page;
+	cc->obj_idx = obj_idx;
+
+	return ret;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page;
+	unsigned long nr_zspages, pages_freed = 0;
+
+	spin_lock(&class->lock);
+	/* Visit each zspage at most once, pinned objects may stay behind */
+	nr_zspages = class->pages_allocated / class->pages_per_zspage;
+	while (nr_zspages-- && zs_can_compact(class)) {
+		src_page = isolate_zspage(class, source_order);
+		if (!src_page)
+			break;
+
+		cc.s_page = src_page;
+		cc.obj_idx = 0;
+		while ((dst_page = isolate_zspage(class, target_order))) {
+			cc.d_page = dst_page;
+			if (!migrate_zspage(class, &cc))
+				break;
+			putback_zspage(class, dst_page);
+		}
+
+		/* No room left in this class */
+		if (!dst_page) {
+			putback_zspage(class, src_page);
+			break;
+		}
+		putback_zspage(class, dst_page);
+
+		if (putback_zspage(class, src_page) == ZS_EMPTY) {
+			class->pages_allocated -= class->pages_per_zspage;
+			pages_freed += class->pages_per_zspage;
+			spin_unlock(&class->lock);
+			free_zspage(pool->ops, src_page);
+		} else {
+			spin_unlock(&class->lock);
+		}
+
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - move objects of sparse zspages into dense ones
+ * @pool: pool to compact
+ *
+ * Objects that are mapped or being freed meanwhile are left in place.
+ * May sleep, so no object may be mapped by the caller.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		pages_freed += __zs_compact(pool, pool->size_class[i]);
+
+	atomic_long_add(pages_freed, &pool->pages_compacted);
+
+	return pages_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static unsigned long zs_shrinker_count(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages_to_free = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages_to_free += zs_can_compact(pool->size_class[i]);
+
+	return pages_to_free;
+}
+
+/* Compaction needs no allocation, so any reclaim context can run it */
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	return min_t(unsigned long, zs_shrinker_count(pool), INT_MAX);
+}
+
+static void zs_free_classes(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		kfree(pool->size_class[i]);
+}
+
 /**
  * zs_create_pool - Creates an allocation pool to work from.
+ * @name: pool name, or NULL for a pool created from atomic context
  * @flags: allocation flags used to allocate pool metadata
- * @ops: allocation/free callbacks for expanding the pool
+ * @ops: allocation/free callbacks for expanding the pool, or NULL
  *
  * This function must be called before anything when using
  * the zsmalloc allocator.
  *
+ * Named pools register a shrinker that compacts them under memory
+ * pressure and, with CONFIG_ZSMALLOC_STAT, export their stats under
+ * zsmalloc/<name>/ in debugfs. Both may sleep, so an unnamed pool
+ * gets neither and is only compacted by explicit zs_compact() calls.
+ *
  * On success, a pointer to the newly created pool is returned,
  * otherwise NULL.
  */
-struct zs_pool *zs_create_pool(gfp_t flags, struct zs_ops *ops)
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags,
+				struct zs_ops *ops)
 {
-	int i, ovhd_size;
+	int i;
 	struct zs_pool *pool;
 
-	ovhd_size = roundup(sizeof(*pool), PAGE_SIZE);
-	pool = kzalloc(ovhd_size, flags);
+	pool = kzalloc(sizeof(*pool), flags);
 	if (!pool)
 		return NULL;
 
@@ -870,12 +1458,17 @@ struct zs_pool *zs_create_pool(gfp_t flags, struct zs_ops *ops)
 		if (size > ZS_MAX_ALLOC_SIZE)
 			size = ZS_MAX_ALLOC_SIZE;
 
-		class = &pool->size_class[i];
+		class = kzalloc(sizeof(*class), flags);
+		if (!class)
+			goto err;
+
 		class->size = size;
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
-
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		pool->size_class[i] = class;
 	}
 
 	if (ops)
@@ -883,7 +1476,25 @@ struct zs_pool *zs_create_pool(gfp_t flags, struct zs_ops *ops)
 	else
 		pool->ops = &zs_default_ops;
 
+	if (!name)
+		return pool;
+
+	pool->name = kstrdup(name, flags);
+	if (!pool->name)
+		goto err;
+
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_pool_stat_create(pool);
+
 	return pool;
+
+err:
+	zs_free_classes(pool);
+	kfree(pool);
+	return NULL;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
 
@@ -891,9 +1502,14 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	if (pool->name) {
+		unregister_shrinker(&pool->shrinker);
+		zs_pool_stat_destroy(pool);
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
-		struct size_class *class = &pool->size_class[i];
+		struct size_class *class = pool->size_class[i];
 
 		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
 			if (class->fullness_list[fg]) {
@@ -903,6 +1519,8 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	zs_free_classes(pool);
+	kfree(pool->name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -911,26 +1529,32 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
+ * @flags: allocation flags for the handle and, if the pool must grow,
+ *	its new pages
  *
  * On success, handle to the allocated object is returned,
  * otherwise 0.
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
 {
-	unsigned long obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = alloc_handle(flags);
+	if (!handle)
 		return 0;
 
+	/* The handle is stored in front of the object */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
 	spin_lock(&class->lock);
@@ -939,69 +1563,57 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(pool->ops, class, flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return 0;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->pages_per_zspage;
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(class, first_page, handle);
 	/* Now move the zspage to another fullness group, if required */
-	fix_fullness_group(pool, first_page);
+	fix_fullness_group(class, first_page);
+	/* Under the class lock, zs_compact() may find the object at once */
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+void zs_free(struct zs_pool *pool, unsigned long handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
-
-	int class_idx;
+	unsigned long obj, f_objidx;
+	unsigned int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* Keep zs_compact() from moving the object under us */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
-	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+	class = pool->size_class[class_idx];
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
-	fullness = fix_fullness_group(pool, first_page);
+	obj_free(class, obj);
+	fullness = fix_fullness_group(class, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->pages_per_zspage;
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
+	free_handle(handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(pool->ops, first_page);
@@ -1012,13 +1624,16 @@ EXPORT_SYMBOL_GPL(zs_free);
  * zs_map_object - get address of allocated object from handle.
  * @pool: pool from which the object was allocated
  * @handle: handle returned from zs_malloc
+ * @mm: mapping mode to use
  *
  * Before using an object allocated from zs_malloc, it must be mapped using
  * this function. When done with the object, it must be unmapped using
  * zs_unmap_object.
  *
  * Only one object can be mapped per cpu at a time. There is no protection
- * against nested mappings.
+ * against nested mappings. The object is not moved by zs_compact() while
+ * it is mapped. No class lock is taken, so mapping never waits for
+ * allocations or frees in the object's size class.
  *
  * This function returns with preemption and page faults disabled.
 */
@@ -1026,13 +1641,14 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 	struct page *pages[2];
+	void *ret;
 
 	BUG_ON(!handle);
 
@@ -1043,9 +1659,13 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	 */
 	BUG_ON(in_interrupt());
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* From here, the object stays where the handle says it is */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
@@ -1053,7 +1673,7 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
 	/* this object spans two pages */
@@ -1061,14 +1681,15 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	pages[1] = get_next_page(page);
 	BUG_ON(!pages[1]);
 
-	return __zs_map_object(area, pages, off, class->size);
+	ret = __zs_map_object(area, pages, off, class->size);
+	return ret + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -1077,9 +1698,10 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &__get_cpu_var(zs_map_area);
@@ -1095,6 +1717,7 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -1104,7 +1727,7 @@ u64 zs_get_total_size_bytes(struct zs_pool *pool)
 	u64 npages = 0;
 
 	for (i = 0; i < ZS_SIZE_CLASSES; i++)
-		npages += pool->size_class[i].pages_allocated;
+		npages += pool->size_class[i]->pages_allocated;
 
 	return npages << PAGE_SHIFT;
 }
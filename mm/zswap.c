@@ -41,6 +41,11 @@
 #include <linux/swapops.h>
 #include <linux/writeback.h>
 #include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/sort.h>
+#include <linux/wait.h>
 
 /*********************************
 * statistics
@@ -49,6 +54,8 @@
 atomic_t zswap_pool_pages = ATOMIC_INIT(0);
 /* The number of compressed pages currently stored in zswap */
 atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+/* The number of same-filled pages currently stored in zswap */
+static atomic_t zswap_same_filled_pages = ATOMIC_INIT(0);
 /* The number of outstanding pages awaiting writeback */
 static atomic_t zswap_outstanding_writebacks = ATOMIC_INIT(0);
 
@@ -61,12 +68,13 @@ static atomic_t zswap_outstanding_writebacks = ATOMIC_INIT(0);
 static u64 zswap_pool_limit_hit;
 static u64 zswap_written_back_pages;
 static u64 zswap_reject_compress_poor;
-static u64 zswap_writeback_attempted;
-static u64 zswap_reject_tmppage_fail;
 static u64 zswap_reject_zsmalloc_fail;
 static u64 zswap_reject_kmemcache_fail;
-static u64 zswap_saved_by_writeback;
 static u64 zswap_duplicate_entry;
+static u64 zswap_writeback_wakeups;
+
+/* Hit from every cpu on each store and load, so kept per cpu */
+static DEFINE_PER_CPU(u64, zswap_tree_lock_contended);
 
 /*********************************
 * tunables
@@ -94,6 +102,14 @@ static unsigned int zswap_max_compression_ratio = 80;
 module_param_named(max_compression_ratio,
 			zswap_max_compression_ratio, uint, 0644);
 
+/*
+ * Store pages filled with a single repeated word as that word, without
+ * compressing them or taking space in the pool
+*/
+static bool zswap_same_filled_pages_enabled = 1;
+module_param_named(same_filled_pages_enabled,
+			zswap_same_filled_pages_enabled, bool, 0644);
+
 /*
  * Maximum number of outstanding writebacks allowed at any given time.
  * This is to prevent decompressing an unbounded number of compressed
@@ -102,6 +118,23 @@ module_param_named(max_compression_ratio,
 */
 #define ZSWAP_MAX_OUTSTANDING_FLUSHES 64
 
+/*
+ * The writeback thread starts evicting once the pool reaches
+ * writeback_start_percent of its maximum size, and stops when it is
+ * back under writeback_stop_percent, so that stores rarely find the
+ * pool full.
+*/
+static unsigned int zswap_writeback_start_percent = 90;
+module_param_named(writeback_start_percent,
+			zswap_writeback_start_percent, uint, 0644);
+
+static unsigned int zswap_writeback_stop_percent = 80;
+module_param_named(writeback_stop_percent,
+			zswap_writeback_stop_percent, uint, 0644);
+
+/* Entries taken off the LRU and written back under one plug */
+#define ZSWAP_WRITEBACK_BATCH 32
+
 /*********************************
 * compression functions
 **********************************/
@@ -171,44 +204,82 @@ static void zswap_comp_exit(void)
  * This structure contains the metadata for tracking a single compressed
  * page within zswap.
  *
- * rbnode - links the entry into red-black tree for the appropriate swap type
- * lru - links the entry into the lru list for the appropriate swap type
+ * rbnode - links the entry into red-black tree of its shard
+ * lru - links the entry into the lru list of its shard
  * refcount - the number of outstanding reference to the entry. This is needed
  *            to protect against premature freeing of the entry by code
  *            concurent calls to load, invalidate, and writeback.  The lock
- *            for the zswap_tree structure that contains the entry must
+ *            for the zswap_shard structure that contains the entry must
  *            be held while changing the refcount.  Since the lock must
  *            be held, there is no reason to also make refcount atomic.
  * type - the swap type for the entry.  Used to map back to the zswap_tree
  *        structure that contains the entry.
  * offset - the swap offset for the entry.  Index into the red-black tree.
  * handle - zsmalloc allocation handle that stores the compressed page data
+ * value - the word a same-filled page is filled with
  * length - the length in bytes of the compressed page data.  Needed during
- *           decompression
+ *           decompression.  0 for a same-filled page, which is never on
+ *           the lru as writing it back would not shrink the pool.
  */
 struct zswap_entry {
 	struct rb_node rbnode;
 	struct list_head lru;
 	int refcount;
 	pgoff_t offset;
-	unsigned long handle;
+	union {
+		unsigned long handle;
+		unsigned long value;
+	};
 	unsigned int length;
 };
 
 /*
- * The tree lock in the zswap_tree struct protects a few things:
+ * The offsets of a swap type are spread over ZSWAP_TREE_SHARDS shards,
+ * in runs of 1 << ZSWAP_SHARD_SHIFT offsets so that neighbouring slots,
+ * which tend to be stored and written back together, share a shard.
+ *
+ * The shard lock protects a few things:
  * - the rbtree
  * - the lru list
- * - the refcount field of each entry in the tree
+ * - the refcount field of each entry in the shard
  */
-struct zswap_tree {
+#define ZSWAP_TREE_SHARDS	8
+#define ZSWAP_SHARD_SHIFT	4
+
+struct zswap_shard {
 	struct rb_root rbroot;
 	struct list_head lru;
 	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+struct zswap_tree {
+	struct zswap_shard shards[ZSWAP_TREE_SHARDS];
 	struct zs_pool *pool;
 	unsigned type;
+	unsigned int wb_shard;	/* next shard to write back from */
 };
 
+static inline struct zswap_shard *zswap_shard(struct zswap_tree *tree,
+						pgoff_t offset)
+{
+	return &tree->shards[(offset >> ZSWAP_SHARD_SHIFT) %
+				ZSWAP_TREE_SHARDS];
+}
+
+/* Takes the shard lock, counting how often it was already held */
+static inline void zswap_shard_lock(struct zswap_shard *shard)
+{
+	if (!spin_trylock(&shard->lock)) {
+		this_cpu_inc(zswap_tree_lock_contended);
+		spin_lock(&shard->lock);
+	}
+}
+
+static inline void zswap_shard_unlock(struct zswap_shard *shard)
+{
+	spin_unlock(&shard->lock);
+}
+
 static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
 
 /*********************************
@@ -260,21 +331,35 @@ static inline int zswap_entry_put(struct zswap_entry *entry)
 /*********************************
 * rbtree functions
 **********************************/
+/* Lookups and the nodes they visited, per cpu as every load does one */
+struct zswap_lookup_stat {
+	u64 lookups;
+	u64 depth;
+};
+
+static DEFINE_PER_CPU(struct zswap_lookup_stat, zswap_lookup_stat);
+
 static struct zswap_entry *zswap_rb_search(struct rb_root *root, pgoff_t offset)
 {
 	struct rb_node *node = root->rb_node;
-	struct zswap_entry *entry;
+	struct zswap_entry *entry = NULL;
+	unsigned int depth = 0;
 
 	while (node) {
+		depth++;
 		entry = rb_entry(node, struct zswap_entry, rbnode);
 		if (entry->offset > offset)
 			node = node->rb_left;
 		else if (entry->offset < offset)
 			node = node->rb_right;
 		else
-			return entry;
+			break;
+		entry = NULL;
 	}
-	return NULL;
+
+	this_cpu_inc(zswap_lookup_stat.lookups);
+	this_cpu_add(zswap_lookup_stat.depth, depth);
+	return entry;
 }
 
 /*
@@ -390,6 +475,31 @@ static inline unsigned int zswap_max_pool_pages(void)
 	return zswap_max_pool_percent * totalram_pages / 100;
 }
 
+#ifdef CONFIG_ZSWAP_ENABLE_WRITEBACK
+static struct task_struct *zswap_writeback_task;
+static DECLARE_WAIT_QUEUE_HEAD(zswap_writeback_wait);
+
+/* Is the pool at or above @percent of its maximum size? */
+static inline bool zswap_pool_above(unsigned int percent)
+{
+	return atomic_read(&zswap_pool_pages) >=
+		(unsigned long)zswap_max_pool_pages() * percent / 100;
+}
+
+/* Called as the pool grows, may be in atomic context */
+static void zswap_writeback_wakeup(void)
+{
+	if (!zswap_pool_above(zswap_writeback_start_percent))
+		return;
+	if (zswap_writeback_task && waitqueue_active(&zswap_writeback_wait)) {
+		zswap_writeback_wakeups++;
+		wake_up(&zswap_writeback_wait);
+	}
+}
+#else
+static inline void zswap_writeback_wakeup(void) { }
+#endif
+
 static inline int zswap_page_pool_create(void)
 {
 	/* TODO: dynamically size mempool */
@@ -408,6 +518,7 @@ static struct page *zswap_alloc_page(gfp_t flags)
 {
 	struct page *page;
 
+	zswap_writeback_wakeup();
 	if (atomic_read(&zswap_pool_pages) >= zswap_max_pool_pages()) {
 		zswap_pool_limit_hit++;
 		return NULL;
@@ -442,11 +553,40 @@ static struct zs_ops zswap_zs_ops = {
  */
 static void zswap_free_entry(struct zswap_tree *tree, struct zswap_entry *entry)
 {
-	zs_free(tree->pool, entry->handle);
+	if (entry->length)
+		zs_free(tree->pool, entry->handle);
+	else
+		atomic_dec(&zswap_same_filled_pages);
 	zswap_entry_cache_free(entry);
 	atomic_dec(&zswap_stored_pages);
 }
 
+static bool zswap_page_same_filled(void *ptr, unsigned long *value)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
+			return false;
+	}
+	*value = page[0];
+	return true;
+}
+
+static void zswap_fill_page(void *ptr, unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	if (!value) {
+		memset(page, 0, PAGE_SIZE);
+		return;
+	}
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
 #ifdef CONFIG_ZSWAP_ENABLE_WRITEBACK
 /*********************************
 * writeback code
@@ -484,7 +624,6 @@ static int zswap_get_swap_cache_page(swp_entry_t entry,
 				struct page **retpage)
 {
 	struct page *found_page, *new_page = NULL;
-	struct address_space *swapper_space = &swapper_spaces[swp_type(entry)];
 	int err;
 
 	*retpage = NULL;
@@ -494,7 +633,7 @@ static int zswap_get_swap_cache_page(swp_entry_t entry,
 		 * called after lookup_swap_cache() failed, re-calling
 		 * that would confuse statistics.
 		 */
-		found_page = find_get_page(swapper_space, entry.val);
+		found_page = find_get_page(&swapper_space, entry.val);
 		if (found_page)
 			break;
 
@@ -621,159 +760,246 @@ static int zswap_writeback_entry(struct zswap_tree *tree,
 }
 
 /*
- * Attempts to free nr of entries via writeback to the swap device.
+ * Drops the writeback reference taken on an entry and frees it if that
+ * was the last one. @ret is the result of zswap_writeback_entry().
+ * Returns 1 if the entry was freed.
+ */
+static int zswap_writeback_put(struct zswap_tree *tree,
+				struct zswap_entry *entry, int ret)
+{
+	struct zswap_shard *shard = zswap_shard(tree, entry->offset);
+	int refcount;
+
+	zswap_shard_lock(shard);
+
+	/* drop reference from zswap_writeback_entries() */
+	refcount = zswap_entry_put(entry);
+
+	if (!ret)
+		/* drop the initial reference from entry creation */
+		refcount = zswap_entry_put(entry);
+
+	/*
+	 * There are four possible values for refcount here:
+	 * (1) refcount is 2, writeback failed and load is in progress;
+	 *     do nothing, load will add us back to the LRU
+	 * (2) refcount is 1, writeback failed; do not free entry,
+	 *     add back to LRU. A page already in the swap cache is
+	 *     being faulted in, so it goes to the hot end; otherwise
+	 *     the entry keeps its place at the cold end.
+	 * (3) refcount is 0, (normal case) not invalidate yet;
+	 *     remove from rbtree and free entry
+	 * (4) refcount is -1, invalidate happened during writeback;
+	 *     free entry
+	 */
+	if (refcount == 1) {
+		if (ret == -EEXIST)
+			list_add_tail(&entry->lru, &shard->lru);
+		else
+			list_add(&entry->lru, &shard->lru);
+	}
+
+	if (refcount == 0) {
+		/* no invalidate yet, remove from rbtree */
+		rb_erase(&entry->rbnode, &shard->rbroot);
+	}
+	zswap_shard_unlock(shard);
+	if (refcount <= 0) {
+		/* free the entry */
+		zswap_free_entry(tree, entry);
+		return 1;
+	}
+	return 0;
+}
+
+static int zswap_entry_offset_cmp(const void *a, const void *b)
+{
+	const struct zswap_entry *ea = *(const struct zswap_entry **)a;
+	const struct zswap_entry *eb = *(const struct zswap_entry **)b;
+
+	if (ea->offset < eb->offset)
+		return -1;
+	return ea->offset > eb->offset;
+}
+
+/*
+ * Attempts to free up to nr (at most ZSWAP_WRITEBACK_BATCH) of the
+ * least recently used entries of one shard, taking the shards in
+ * turn, via writeback to the swap device.
+ * The batch is written in swap offset order under a plug, so that
+ * adjacent slots are merged into larger requests.
  * The number of entries that were actually freed is returned.
  */
 static int zswap_writeback_entries(struct zswap_tree *tree, int nr)
 {
+	struct zswap_entry *batch[ZSWAP_WRITEBACK_BATCH];
 	struct zswap_entry *entry;
-	int i, ret, refcount, freed_nr = 0;
+	struct zswap_shard *shard;
+	struct blk_plug plug;
+	int i, ret, n = 0, freed_nr = 0;
 
-	for (i = 0; i < nr; i++) {
-		/*
-		 * This limits is arbitrary for now until a better
-		 * policy can be implemented. This is so we don't
-		 * eat all of RAM decompressing pages for writeback.
-		 */
-		if (atomic_read(&zswap_outstanding_writebacks) >
-				ZSWAP_MAX_OUTSTANDING_FLUSHES)
-			break;
+	/*
+	 * This limits is arbitrary for now until a better
+	 * policy can be implemented. This is so we don't
+	 * eat all of RAM decompressing pages for writeback.
+	 */
+	nr = min(nr, ZSWAP_MAX_OUTSTANDING_FLUSHES -
+			atomic_read(&zswap_outstanding_writebacks));
+	nr = min(nr, ZSWAP_WRITEBACK_BATCH);
 
-		spin_lock(&tree->lock);
+	/* only the writeback thread advances the cursor */
+	shard = &tree->shards[tree->wb_shard++ % ZSWAP_TREE_SHARDS];
 
+	zswap_shard_lock(shard);
+	while (n < nr && !list_empty(&shard->lru)) {
 		/* dequeue from lru */
-		if (list_empty(&tree->lru)) {
-			spin_unlock(&tree->lock);
-			break;
-		}
-		entry = list_first_entry(&tree->lru,
+		entry = list_first_entry(&shard->lru,
 				struct zswap_entry, lru);
 		list_del_init(&entry->lru);
 
 		/* so invalidate doesn't free the entry from under us */
 		zswap_entry_get(entry);
+		batch[n++] = entry;
+	}
+	zswap_shard_unlock(shard);
 
-		spin_unlock(&tree->lock);
-
-		/* attempt writeback */
-		ret = zswap_writeback_entry(tree, entry);
-
-		spin_lock(&tree->lock);
-
-		/* drop reference from above */
-		refcount = zswap_entry_put(entry);
+	if (!n)
+		return 0;
 
-		if (!ret)
-			/* drop the initial reference from entry creation */
-			refcount = zswap_entry_put(entry);
+	sort(batch, n, sizeof(batch[0]), zswap_entry_offset_cmp, NULL);
 
-		/*
-		 * There are four possible values for refcount here:
-		 * (1) refcount is 2, writeback failed and load is in progress;
-		 *     do nothing, load will add us back to the LRU
-		 * (2) refcount is 1, writeback failed; do not free entry,
-		 *     add back to LRU
-		 * (3) refcount is 0, (normal case) not invalidate yet;
-		 *     remove from rbtree and free entry
-		 * (4) refcount is -1, invalidate happened during writeback;
-		 *     free entry
-		 */
-		if (refcount == 1)
-			list_add(&entry->lru, &tree->lru);
-
-		if (refcount == 0) {
-			/* no invalidate yet, remove from rbtree */
-			rb_erase(&entry->rbnode, &tree->rbroot);
-		}
-		spin_unlock(&tree->lock);
-		if (refcount <= 0) {
-			/* free the entry */
-			zswap_free_entry(tree, entry);
-			freed_nr++;
-		}
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		/* attempt writeback */
+		ret = zswap_writeback_entry(tree, batch[i]);
+		freed_nr += zswap_writeback_put(tree, batch[i], ret);
 	}
+	blk_finish_plug(&plug);
+
 	return freed_nr;
 }
-#endif /* CONFIG_ZSWAP_ENABLE_WRITEBACK */
-
-/*******************************************
-* page pool for temporary compression result
-********************************************/
-#define ZSWAP_TMPPAGE_POOL_PAGES 16
-static LIST_HEAD(zswap_tmppage_list);
-static DEFINE_SPINLOCK(zswap_tmppage_lock);
 
-static void zswap_tmppage_pool_destroy(void)
+/*
+ * One pass over the shards of all swap types; returns the number of
+ * entries freed
+ */
+static int zswap_writeback_round(void)
 {
-	struct page *page, *tmppage;
+	struct zswap_tree *tree;
+	int type, i, freed_nr = 0;
 
-	spin_lock(&zswap_tmppage_lock);
-	list_for_each_entry_safe(page, tmppage, &zswap_tmppage_list, lru) {
-		list_del(&page->lru);
-		__free_pages(page, 1);
+	for (type = 0; type < MAX_SWAPFILES; type++) {
+		tree = zswap_trees[type];
+		if (!tree)
+			continue;
+		for (i = 0; i < ZSWAP_TREE_SHARDS; i++)
+			freed_nr += zswap_writeback_entries(tree,
+						ZSWAP_WRITEBACK_BATCH);
 	}
-	spin_unlock(&zswap_tmppage_lock);
+	return freed_nr;
 }
 
-static int zswap_tmppage_pool_create(void)
+/*
+ * The writeback thread keeps the pool below its size limit in the
+ * background, so that stores do not have to decompress and write
+ * back entries themselves.
+ */
+static int zswap_writeback_thread(void *data)
 {
-	int i;
-	struct page *page;
-
-	for (i = 0; i < ZSWAP_TMPPAGE_POOL_PAGES; i++) {
-		page = alloc_pages(GFP_KERNEL, 1);
-		if (!page) {
-			zswap_tmppage_pool_destroy();
-			return -ENOMEM;
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(zswap_writeback_wait,
+			zswap_pool_above(zswap_writeback_start_percent) ||
+			kthread_should_stop());
+
+		while (zswap_pool_above(zswap_writeback_stop_percent) &&
+				!kthread_should_stop()) {
+			if (atomic_read(&zswap_outstanding_writebacks) >=
+					ZSWAP_MAX_OUTSTANDING_FLUSHES) {
+				congestion_wait(BLK_RW_ASYNC, HZ / 50);
+				continue;
+			}
+			if (!zswap_writeback_round()) {
+				/* nothing could be written back for now */
+				congestion_wait(BLK_RW_ASYNC, HZ / 10);
+				break;
+			}
+			cond_resched();
 		}
-		spin_lock(&zswap_tmppage_lock);
-		list_add(&page->lru, &zswap_tmppage_list);
-		spin_unlock(&zswap_tmppage_lock);
 	}
 	return 0;
 }
 
-static inline struct page *zswap_tmppage_alloc(void)
+static void __init zswap_writeback_init(void)
 {
-	struct page *page;
-
-	spin_lock(&zswap_tmppage_lock);
-	if (list_empty(&zswap_tmppage_list)) {
-		spin_unlock(&zswap_tmppage_lock);
-		return NULL;
+	zswap_writeback_task = kthread_run(zswap_writeback_thread, NULL,
+						"zswapd");
+	if (IS_ERR(zswap_writeback_task)) {
+		pr_warn("can't start writeback thread\n");
+		zswap_writeback_task = NULL;
 	}
-	page = list_first_entry(&zswap_tmppage_list, struct page, lru);
-	list_del(&page->lru);
-	spin_unlock(&zswap_tmppage_lock);
-	return page;
 }
+#else
+static inline void zswap_writeback_init(void) { }
+#endif /* CONFIG_ZSWAP_ENABLE_WRITEBACK */
+
+/*********************************
+* store latency histogram
+**********************************/
+#ifdef CONFIG_DEBUG_FS
+/*
+ * Bucket i counts the stores that took less than 2^i microseconds,
+ * the last one all slower stores. Kept per cpu so that accounting
+ * does not bounce a shared cache line between swapping tasks.
+ */
+#define ZSWAP_LATENCY_BUCKETS 16
+
+struct zswap_latency {
+	u64 bucket[ZSWAP_LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct zswap_latency, zswap_store_latency);
 
-static inline void zswap_tmppage_free(struct page *page)
+static inline u64 zswap_latency_start(void)
 {
-	spin_lock(&zswap_tmppage_lock);
-	list_add(&page->lru, &zswap_tmppage_list);
-	spin_unlock(&zswap_tmppage_lock);
+	return local_clock();
 }
 
+static inline void zswap_store_latency_account(u64 start)
+{
+	s64 delta = local_clock() - start;
+	int i = 0;
+
+	/* the clock is per cpu, ignore what a migration made negative */
+	if (delta > 0)
+		i = min(fls64((u64)delta >> 10), ZSWAP_LATENCY_BUCKETS - 1);
+	this_cpu_inc(zswap_store_latency.bucket[i]);
+}
+#else
+static inline u64 zswap_latency_start(void)
+{
+	return 0;
+}
+
+static inline void zswap_store_latency_account(u64 start) { }
+#endif
+
 /*********************************
 * frontswap hooks
 **********************************/
 /* attempts to compress and store an single page */
-static int zswap_frontswap_store(unsigned type, pgoff_t offset,
+static int __zswap_frontswap_store(unsigned type, pgoff_t offset,
 				struct page *page)
 {
 	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_shard *shard;
 	struct zswap_entry *entry, *dupentry;
 	int ret;
 	unsigned int dlen = PAGE_SIZE;
-	unsigned long handle;
+	unsigned long handle, value;
 	char *buf;
 	u8 *src, *dst;
-	struct page *tmppage;
-	bool writeback_attempted = 0;
-#ifdef CONFIG_ZSWAP_ENABLE_WRITEBACK
-	u8 *tmpdst;
-#endif
 
 	if (!tree) {
 		ret = -ENODEV;
@@ -794,9 +1020,19 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		goto reject;
 	}
 
+	src = kmap_atomic(page);
+	if (zswap_same_filled_pages_enabled &&
+	    zswap_page_same_filled(src, &value)) {
+		kunmap_atomic(src);
+		entry->offset = offset;
+		entry->value = value;
+		entry->length = 0;
+		atomic_inc(&zswap_same_filled_pages);
+		goto insert;
+	}
+
 	/* compress */
 	dst = get_cpu_var(zswap_dstmem);
-	src = kmap_atomic(page);
 	ret = zswap_comp_op(ZSWAP_COMPOP_COMPRESS, src, PAGE_SIZE, dst, &dlen);
 	kunmap_atomic(src);
 	if (ret) {
@@ -814,65 +1050,37 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		__GFP_NORETRY | __GFP_HIGHMEM | __GFP_NOMEMALLOC |
 			__GFP_NOWARN);
 	if (!handle) {
-#ifdef CONFIG_ZSWAP_ENABLE_WRITEBACK
-		zswap_writeback_attempted++;
 		/*
-		 * Copy compressed buffer out of per-cpu storage so
-		 * we can re-enable preemption.
-		*/
-		tmppage = zswap_tmppage_alloc();
-		if (!tmppage) {
-			zswap_reject_tmppage_fail++;
-			ret = -ENOMEM;
-			goto freepage;
-		}
-		writeback_attempted = 1;
-		tmpdst = page_address(tmppage);
-		memcpy(tmpdst, dst, dlen);
-		dst = tmpdst;
-		put_cpu_var(zswap_dstmem);
-
-		/* try to free up some space */
-		/* TODO: replace with more targeted policy */
-		zswap_writeback_entries(tree, 16);
-		/* try again, allowing wait */
-		handle = zs_malloc(tree->pool, dlen,
-			__GFP_NORETRY | __GFP_HIGHMEM | __GFP_NOMEMALLOC |
-				__GFP_NOWARN);
-		if (!handle) {
-			/* still no space, fail */
-			zswap_reject_zsmalloc_fail++;
-			ret = -ENOMEM;
-			goto freepage;
-		}
-		zswap_saved_by_writeback++;
-#else
+		 * Don't write back from here, that would put decompression
+		 * and swap I/O into the latency of the swapping task.
+		 * The writeback thread was woken as the pool filled up;
+		 * this page goes to the swap device directly.
+		 */
+		zswap_reject_zsmalloc_fail++;
 		ret = -ENOMEM;
 		goto freepage;
-#endif
 	}
 
 	buf = zs_map_object(tree->pool, handle, ZS_MM_WO);
 	memcpy(buf, dst, dlen);
 	zs_unmap_object(tree->pool, handle);
-	if (writeback_attempted)
-		zswap_tmppage_free(tmppage);
-	else
-		put_cpu_var(zswap_dstmem);
+	put_cpu_var(zswap_dstmem);
 
 	/* populate entry */
 	entry->offset = offset;
 	entry->handle = handle;
 	entry->length = dlen;
 
+insert:
 	/* map */
-	spin_lock(&tree->lock);
+	shard = zswap_shard(tree, offset);
+	zswap_shard_lock(shard);
 	do {
-		ret = zswap_rb_insert(&tree->rbroot, entry, &dupentry);
+		ret = zswap_rb_insert(&shard->rbroot, entry, &dupentry);
 		if (ret == -EEXIST) {
 			zswap_duplicate_entry++;
 			/* remove from rbtree and lru */
-			rb_erase(&dupentry->rbnode, &tree->rbroot);
+			rb_erase(&dupentry->rbnode, &shard->rbroot);
 			if (!list_empty(&dupentry->lru))
 				list_del_init(&dupentry->lru);
 			if (!zswap_entry_put(dupentry)) {
@@ -881,8 +1089,9 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 			}
 		}
 	} while (ret == -EEXIST);
-	list_add_tail(&entry->lru, &tree->lru);
-	spin_unlock(&tree->lock);
+	if (entry->length)
+		list_add_tail(&entry->lru, &shard->lru);
+	zswap_shard_unlock(shard);
 
 	/* update stats */
 	atomic_inc(&zswap_stored_pages);
@@ -890,15 +1099,23 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 	return 0;
 
 freepage:
-	if (writeback_attempted)
-		zswap_tmppage_free(tmppage);
-	else
-		put_cpu_var(zswap_dstmem);
+	put_cpu_var(zswap_dstmem);
 	zswap_entry_cache_free(entry);
 reject:
 	return ret;
 }
 
+static int zswap_frontswap_store(unsigned type, pgoff_t offset,
+				struct page *page)
+{
+	u64 start = zswap_latency_start();
+	int ret;
+
+	ret = __zswap_frontswap_store(type, offset, page);
+	zswap_store_latency_account(start);
+	return ret;
+}
+
 /*
  * returns 0 if the page was successfully decompressed
  * return -1 on entry not found or error
@@ -907,17 +1124,18 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 				struct page *page)
 {
 	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_shard *shard = zswap_shard(tree, offset);
 	struct zswap_entry *entry;
 	u8 *src, *dst;
 	unsigned int dlen;
 	int refcount;
 
 	/* find */
-	spin_lock(&tree->lock);
-	entry = zswap_rb_search(&tree->rbroot, offset);
+	zswap_shard_lock(shard);
+	entry = zswap_rb_search(&shard->rbroot, offset);
 	if (!entry) {
 		/* entry was written back */
-		spin_unlock(&tree->lock);
+		zswap_shard_unlock(shard);
 		return -1;
 	}
 	zswap_entry_get(entry);
@@ -925,7 +1143,14 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 	/* remove from lru */
 	if (!list_empty(&entry->lru))
 		list_del_init(&entry->lru);
-	spin_unlock(&tree->lock);
+	zswap_shard_unlock(shard);
+
+	if (!entry->length) {
+		dst = kmap_atomic(page);
+		zswap_fill_page(dst, entry->value);
+		kunmap_atomic(dst);
+		goto put;
+	}
 
 	/* decompress */
 	dlen = PAGE_SIZE;
@@ -936,14 +1161,16 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 	kunmap_atomic(dst);
 	zs_unmap_object(tree->pool, entry->handle);
 
-	spin_lock(&tree->lock);
+put:
+	zswap_shard_lock(shard);
 	refcount = zswap_entry_put(entry);
 	if (likely(refcount)) {
-		list_add_tail(&entry->lru, &tree->lru);
-		spin_unlock(&tree->lock);
+		if (entry->length)
+			list_add_tail(&entry->lru, &shard->lru);
+		zswap_shard_unlock(shard);
 		return 0;
 	}
-	spin_unlock(&tree->lock);
+	zswap_shard_unlock(shard);
 
 	/*
 	 * We don't have to unlink from the rbtree because
@@ -961,27 +1188,28 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 static void zswap_frontswap_invalidate_page(unsigned type, pgoff_t offset)
 {
 	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_shard *shard = zswap_shard(tree, offset);
 	struct zswap_entry *entry;
 	int refcount;
 
 	/* find */
-	spin_lock(&tree->lock);
-	entry = zswap_rb_search(&tree->rbroot, offset);
+	zswap_shard_lock(shard);
+	entry = zswap_rb_search(&shard->rbroot, offset);
 	if (!entry) {
 		/* entry was written back */
-		spin_unlock(&tree->lock);
+		zswap_shard_unlock(shard);
 		return;
 	}
 
 	/* remove from rbtree and lru */
-	rb_erase(&entry->rbnode, &tree->rbroot);
+	rb_erase(&entry->rbnode, &shard->rbroot);
 	if (!list_empty(&entry->lru))
 		list_del_init(&entry->lru);
 
 	/* drop the initial reference from entry creation */
 	refcount = zswap_entry_put(entry);
 
-	spin_unlock(&tree->lock);
+	zswap_shard_unlock(shard);
 
 	if (refcount) {
 		/* writeback in progress, writeback will free */
@@ -996,49 +1224,57 @@ static void zswap_frontswap_invalidate_page(unsigned type, pgoff_t offset)
 static void zswap_frontswap_invalidate_area(unsigned type)
 {
 	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_shard *shard;
 	struct rb_node *node;
 	struct zswap_entry *entry;
+	int i;
 
 	if (!tree)
 		return;
 
-	/* walk the tree and free everything */
-	spin_lock(&tree->lock);
-	/*
-	 * TODO: Even though this code should not be executed because
-	 * the try_to_unuse() in swapoff should have emptied the tree,
-	 * it is very wasteful to rebalance the tree after every
-	 * removal when we are freeing the whole tree.
-	 *
-	 * If post-order traversal code is ever added to the rbtree
-	 * implementation, it should be used here.
-	 */
-	while ((node = rb_first(&tree->rbroot))) {
-		entry = rb_entry(node, struct zswap_entry, rbnode);
-		rb_erase(&entry->rbnode, &tree->rbroot);
-		zs_free(tree->pool, entry->handle);
-		zswap_entry_cache_free(entry);
-		atomic_dec(&zswap_stored_pages);
+	/* walk the shards and free everything */
+	for (i = 0; i < ZSWAP_TREE_SHARDS; i++) {
+		shard = &tree->shards[i];
+		zswap_shard_lock(shard);
+		/*
+		 * TODO: Even though this code should not be executed because
+		 * the try_to_unuse() in swapoff should have emptied the tree,
+		 * it is very wasteful to rebalance the tree after every
+		 * removal when we are freeing the whole tree.
+		 *
+		 * If post-order traversal code is ever added to the rbtree
+		 * implementation, it should be used here.
+		 */
+		while ((node = rb_first(&shard->rbroot))) {
+			entry = rb_entry(node, struct zswap_entry, rbnode);
+			rb_erase(&entry->rbnode, &shard->rbroot);
+			zswap_free_entry(tree, entry);
+		}
+		shard->rbroot = RB_ROOT;
+		INIT_LIST_HEAD(&shard->lru);
+		zswap_shard_unlock(shard);
 	}
-	tree->rbroot = RB_ROOT;
-	INIT_LIST_HEAD(&tree->lru);
-	spin_unlock(&tree->lock);
 }
 
 /* NOTE: this is called in atomic context from swapon and must not sleep */
 static void zswap_frontswap_init(unsigned type)
 {
 	struct zswap_tree *tree;
+	struct zswap_shard *shard;
+	int i;
 
 	tree = kzalloc(sizeof(struct zswap_tree), GFP_ATOMIC);
 	if (!tree)
 		goto err;
-	tree->pool = zs_create_pool(GFP_NOWAIT, &zswap_zs_ops);
+	tree->pool = zs_create_pool(NULL, GFP_NOWAIT, &zswap_zs_ops);
 	if (!tree->pool)
 		goto freetree;
-	tree->rbroot = RB_ROOT;
-	INIT_LIST_HEAD(&tree->lru);
-	spin_lock_init(&tree->lock);
+	for (i = 0; i < ZSWAP_TREE_SHARDS; i++) {
+		shard = &tree->shards[i];
+		shard->rbroot = RB_ROOT;
+		INIT_LIST_HEAD(&shard->lru);
+		spin_lock_init(&shard->lock);
+	}
 	tree->type = type;
 	zswap_trees[type] = tree;
 	return;
@@ -1063,8 +1299,77 @@ static struct frontswap_ops zswap_frontswap_ops = {
 #ifdef CONFIG_DEBUG_FS
 #include <linux/debugfs.h>
 
+#include <linux/seq_file.h>
+
 static struct dentry *zswap_debugfs_root;
 
+static int zswap_store_latency_show(struct seq_file *s, void *v)
+{
+	u64 count;
+	int i, cpu;
+
+	for (i = 0; i < ZSWAP_LATENCY_BUCKETS; i++) {
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += per_cpu(zswap_store_latency, cpu).bucket[i];
+
+		if (i < ZSWAP_LATENCY_BUCKETS - 1)
+			seq_printf(s, "< %6luus %llu\n", 1UL << i, count);
+		else
+			seq_printf(s, ">=%6luus %llu\n", 1UL << (i - 1),
+					count);
+	}
+	return 0;
+}
+
+static int zswap_store_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zswap_store_latency_show, NULL);
+}
+
+static const struct file_operations zswap_store_latency_fops = {
+	.open		= zswap_store_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int zswap_tree_lookups_get(void *data, u64 *val)
+{
+	int cpu;
+
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += per_cpu(zswap_lookup_stat, cpu).lookups;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_tree_lookups_fops, zswap_tree_lookups_get,
+			NULL, "%llu\n");
+
+static int zswap_tree_lock_contended_get(void *data, u64 *val)
+{
+	int cpu;
+
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += per_cpu(zswap_tree_lock_contended, cpu);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_tree_lock_contended_fops,
+			zswap_tree_lock_contended_get, NULL, "%llu\n");
+
+static int zswap_tree_lookup_depth_get(void *data, u64 *val)
+{
+	int cpu;
+
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += per_cpu(zswap_lookup_stat, cpu).depth;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_tree_lookup_depth_fops,
+			zswap_tree_lookup_depth_get, NULL, "%llu\n");
+
 static int __init zswap_debugfs_init(void)
 {
 	if (!debugfs_initialized())
@@ -1074,14 +1379,8 @@ static int __init zswap_debugfs_init(void)
 	if (!zswap_debugfs_root)
 		return -ENOMEM;
 
-	debugfs_create_u64("saved_by_writeback", S_IRUGO,
-			zswap_debugfs_root, &zswap_saved_by_writeback);
 	debugfs_create_u64("pool_limit_hit", S_IRUGO,
 			zswap_debugfs_root, &zswap_pool_limit_hit);
-	debugfs_create_u64("reject_writeback_attempted", S_IRUGO,
-			zswap_debugfs_root, &zswap_writeback_attempted);
-	debugfs_create_u64("reject_tmppage_fail", S_IRUGO,
-			zswap_debugfs_root, &zswap_reject_tmppage_fail);
 	debugfs_create_u64("reject_zsmalloc_fail", S_IRUGO,
 			zswap_debugfs_root, &zswap_reject_zsmalloc_fail);
 	debugfs_create_u64("reject_kmemcache_fail", S_IRUGO,
@@ -1092,10 +1391,24 @@ static int __init zswap_debugfs_init(void)
 			zswap_debugfs_root, &zswap_written_back_pages);
 	debugfs_create_u64("duplicate_entry", S_IRUGO,
 			zswap_debugfs_root, &zswap_duplicate_entry);
+	debugfs_create_u64("writeback_wakeups", S_IRUGO,
+			zswap_debugfs_root, &zswap_writeback_wakeups);
+	debugfs_create_file("store_latency", S_IRUGO,
+			zswap_debugfs_root, NULL, &zswap_store_latency_fops);
+	debugfs_create_file("tree_lock_contended", S_IRUGO,
+			zswap_debugfs_root, NULL,
+			&zswap_tree_lock_contended_fops);
+	debugfs_create_file("tree_lookups", S_IRUGO,
+			zswap_debugfs_root, NULL, &zswap_tree_lookups_fops);
+	debugfs_create_file("tree_lookup_depth", S_IRUGO,
+			zswap_debugfs_root, NULL,
+			&zswap_tree_lookup_depth_fops);
 	debugfs_create_atomic_t("pool_pages", S_IRUGO,
 			zswap_debugfs_root, &zswap_pool_pages);
 	debugfs_create_atomic_t("stored_pages", S_IRUGO,
 			zswap_debugfs_root, &zswap_stored_pages);
+	debugfs_create_atomic_t("same_filled_pages", S_IRUGO,
+			zswap_debugfs_root, &zswap_same_filled_pages);
 	debugfs_create_atomic_t("outstanding_writebacks", S_IRUGO,
 			zswap_debugfs_root, &zswap_outstanding_writebacks);
 
@@ -1132,10 +1445,6 @@ static int __init init_zswap(void)
 		pr_err("page pool initialization failed\n");
 		goto pagepoolfail;
 	}
-	if (zswap_tmppage_pool_create()) {
-		pr_err("workmem pool initialization failed\n");
-		goto tmppoolfail;
-	}
 	if (zswap_comp_init()) {
 		pr_err("compressor initialization failed\n");
 		goto compfail;
@@ -1144,6 +1453,7 @@ static int __init init_zswap(void)
 		pr_err("per-cpu initialization failed\n");
 		goto pcpufail;
 	}
+	zswap_writeback_init();
 	frontswap_register_ops(&zswap_frontswap_ops);
 	if (zswap_debugfs_init())
 		pr_warn("debugfs initialization failed\n");
@@ -1151,8 +1461,6 @@ static int __init init_zswap(void)
 pcpufail:
 	zswap_comp_exit();
 compfail:
-	zswap_tmppage_pool_destroy();
-tmppoolfail:
 	zswap_page_pool_destroy();
 pagepoolfail:
 	zswap_entry_cache_destory();
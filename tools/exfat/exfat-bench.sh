@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# exfat-bench.sh: concurrent writer scaling on a loopback exFAT image
+#
+# Creates an image file, formats it exFAT, attaches it to a loop device
+# and mounts it with the kernel exfat driver. exfat-writers.fio then runs
+# once for each writer count, and the aggregate bandwidth of each group
+# is printed. Needs root, fio and mkfs.exfat.
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; version 2.
+
+IMAGE=/data/local/tmp/exfat-bench.img
+IMAGE_MB=2048
+JOBS_LIST="1 2 4 8"
+FILE_MB=128
+
+usage()
+{
+	echo "Usage: $0 [-i image] [-s image MB] [-j \"writer counts\"] [-f file MB]"
+	exit 1
+}
+
+while getopts "i:s:j:f:h" opt; do
+	case $opt in
+	i) IMAGE=$OPTARG ;;
+	s) IMAGE_MB=$OPTARG ;;
+	j) JOBS_LIST=$OPTARG ;;
+	f) FILE_MB=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+JOB_FILE=$(dirname "$0")/exfat-writers.fio
+MNT=$(mktemp -d) || exit 1
+LOOP=
+
+cleanup()
+{
+	umount "$MNT" 2>/dev/null
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rmdir "$MNT"
+	rm -f "$IMAGE"
+}
+trap cleanup EXIT
+
+dd if=/dev/zero of="$IMAGE" bs=1M count=0 seek="$IMAGE_MB" 2>/dev/null ||
+	exit 1
+LOOP=$(losetup -f --show "$IMAGE") || exit 1
+mkfs.exfat "$LOOP" >/dev/null || exit 1
+mount -t exfat "$LOOP" "$MNT" || exit 1
+
+for jobs in $JOBS_LIST; do
+	if [ $((jobs * FILE_MB)) -ge "$IMAGE_MB" ]; then
+		echo "$jobs writers of $FILE_MB MB do not fit in the image" >&2
+		exit 1
+	fi
+
+	rm -f "$MNT"/*
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+
+	echo "$jobs writers:"
+	DIR=$MNT JOBS=$jobs SIZE=${FILE_MB}m fio "$JOB_FILE" |
+		grep "WRITE: bw="
+done
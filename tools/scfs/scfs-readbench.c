@@ -0,0 +1,250 @@
+/*
+ * scfs-readbench: parallel cold read throughput of files on a mounted SCFS
+ *
+ * Every regular file under the given paths is read from start to end by a
+ * pool of threads, each taking the next file that nobody has read yet.
+ * Before each run the page cache and slab caches are dropped, which also
+ * empties the SCFS cluster cache through its shrinker, so every cluster is
+ * read from the lower file and decompressed again. The run is repeated for
+ * 1, 2, 4, ... threads up to the -t limit, and the best run for each
+ * thread count is reported.
+ *
+ * With one set of compressor transforms behind a mutex, throughput stays
+ * flat as threads are added once decompression is the bottleneck. With
+ * per-CPU transforms it should scale with the number of online CPUs.
+ * Run it on an SCFS mount, as root, on the kernels to compare.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2.
+ *
+ * Compile with:
+ *
+ * gcc -O2 -o scfs-readbench scfs-readbench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_THREADS		64
+
+static char **files;
+static size_t nr_files, files_alloc;
+
+static int max_threads;
+static int runs = 3;
+static size_t buf_size = 128 * 1024;
+static int drop_caches = 1;
+
+/* shared by the readers of one run */
+static size_t next_file;
+static unsigned long long bytes_read;
+static int read_errors;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int visit(const char *path, const struct stat *sb, int flag,
+		 struct FTW *ftw)
+{
+	(void)ftw;
+
+	if (flag != FTW_F || !S_ISREG(sb->st_mode) || !sb->st_size)
+		return 0;
+
+	if (nr_files == files_alloc) {
+		files_alloc = files_alloc ? files_alloc * 2 : 256;
+		files = realloc(files, files_alloc * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	files[nr_files++] = strdup(path);
+
+	return 0;
+}
+
+static void drop_all_caches(void)
+{
+	static int warned;
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd >= 0 && write(fd, "3", 1) == 1) {
+		close(fd);
+		return;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (!warned) {
+		fprintf(stderr, "cannot drop caches (%s), runs after the "
+			"first are warm\n", strerror(errno));
+		warned = 1;
+	}
+}
+
+static void *reader(void *arg)
+{
+	unsigned long long bytes = 0;
+	char *buf;
+	size_t i;
+	ssize_t ret;
+	int fd;
+
+	(void)arg;
+
+	buf = malloc(buf_size);
+	if (!buf) {
+		__sync_fetch_and_add(&read_errors, 1);
+		return NULL;
+	}
+
+	while ((i = __sync_fetch_and_add(&next_file, 1)) < nr_files) {
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0) {
+			__sync_fetch_and_add(&read_errors, 1);
+			continue;
+		}
+		while ((ret = read(fd, buf, buf_size)) > 0)
+			bytes += ret;
+		if (ret < 0)
+			__sync_fetch_and_add(&read_errors, 1);
+		close(fd);
+	}
+
+	__sync_fetch_and_add(&bytes_read, bytes);
+	free(buf);
+
+	return NULL;
+}
+
+/* returns the throughput of one run in MB/s */
+static double run_once(int threads)
+{
+	pthread_t tids[MAX_THREADS];
+	unsigned long long start, elapsed;
+	int i;
+
+	if (drop_caches)
+		drop_all_caches();
+
+	next_file = 0;
+	bytes_read = 0;
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, reader, NULL)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	return elapsed ? bytes_read * 1000.0 / elapsed : 0.0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <file or dir>...\n"
+	       "  -t <count>   most reader threads (default: online CPUs)\n"
+	       "  -r <count>   runs per thread count, best is shown (default %d)\n"
+	       "  -b <bytes>   read size (default %zu)\n"
+	       "  -w           don't drop caches between runs (warm reads)\n",
+	       prog, runs, buf_size);
+}
+
+int main(int argc, char **argv)
+{
+	double mbs, best, base = 0.0;
+	unsigned long long total;
+	int threads, r, c;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "t:r:b:wh")) != -1) {
+		switch (c) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'b':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			drop_caches = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind == argc || runs < 1 || !buf_size ||
+	    max_threads < 1 || max_threads > MAX_THREADS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		if (nftw(argv[optind], visit, 64, FTW_PHYS)) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+	if (!nr_files) {
+		fprintf(stderr, "no regular files to read\n");
+		return 1;
+	}
+
+	printf("%zu files, %s reads\n", nr_files, drop_caches ? "cold" : "warm");
+	printf("%8s %10s %10s %8s\n", "threads", "MB", "MB/s", "speedup");
+
+	threads = 1;
+	for (;;) {
+		best = 0.0;
+		total = 0;
+		for (r = 0; r < runs; r++) {
+			mbs = run_once(threads);
+			if (mbs > best)
+				best = mbs;
+			total = bytes_read;
+		}
+		if (threads == 1)
+			base = best;
+
+		printf("%8d %10llu %10.1f %7.2fx\n", threads, total >> 20,
+		       best, base ? best / base : 0.0);
+
+		if (threads == max_threads)
+			break;
+		threads = threads * 2 > max_threads ? max_threads : threads * 2;
+	}
+
+	if (read_errors)
+		fprintf(stderr, "%d files could not be read\n", read_errors);
+
+	return read_errors ? 1 : 0;
+}
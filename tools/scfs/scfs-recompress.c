@@ -0,0 +1,646 @@
+/*
+ * scfs-recompress: recompress the files of an SCFS image and report the
+ * size and read latency of each algorithm
+ *
+ * Every regular file under the source directory, either already in SCFS
+ * format or plain, is cut into clusters and compressed with lzo, zlib and
+ * lz4 the way fs/scfs does it. For each algorithm the tool reports the
+ * image size and the time to decompress a cluster, for all files and for
+ * the "hot" ones (those a readpage storm hits: shared libraries, odex,
+ * anything in the -H list), and then for the per-file selection the
+ * kernel makes with the comp_type, fast_comp_type and fast_ext mount
+ * options. With -o, the image is written out in SCFS format using that
+ * selection.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2.
+ *
+ * Compile with:
+ *
+ * gcc -O2 -o scfs-recompress scfs-recompress.c -llzo2 -lz -llz4
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <lzo/lzo1x.h>
+#include <zlib.h>
+#include <lz4.h>
+
+/* on-disk format, see fs/scfs/scfs.h */
+#define SCFS_MAGIC			0x53305955
+#define SCFS_CLUSTER_ALIGN_BYTE		4
+#define SCFS_CLUSTER_SIZE_MIN		(4 * 1024)
+#define SCFS_CLUSTER_SIZE_MAX		(16 * 1024)
+
+enum comp_type {
+	SCFS_COMP_NONE = 0,
+	SCFS_COMP_LZO,
+	SCFS_COMP_ZLIB,
+	SCFS_COMP_BZIP2,
+	SCFS_COMP_FASTLZO,
+	SCFS_COMP_LZ4,
+	SCFS_COMP_TOTAL_TYPES,
+};
+
+struct scfs_cinfo {
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct comp_footer {
+	int32_t footer_size;
+	int32_t cluster_size;
+	int64_t original_file_size;
+	int32_t comp_type;
+	int32_t magic;
+};
+
+/* the kernel's "deflate" transform is raw deflate with a 2KB window */
+#define DEFLATE_DEF_WINBITS		11
+#define DEFLATE_DEF_MEMLEVEL		9
+
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((a) - 1))
+#define OUT_BUF_SIZE		(SCFS_CLUSTER_SIZE_MAX * 2)
+
+static const char *comp_names[SCFS_COMP_TOTAL_TYPES] = {
+	"none", "lzo", "zlib", "bzip2", "fastlzo", "lz4",
+};
+
+/* algorithms the report covers */
+static const int report_types[] = { SCFS_COMP_LZO, SCFS_COMP_ZLIB, SCFS_COMP_LZ4 };
+#define NR_REPORT_TYPES		(sizeof(report_types) / sizeof(report_types[0]))
+
+struct comp_stat {
+	unsigned long long files;
+	unsigned long long clusters;
+	unsigned long long orig_bytes;
+	unsigned long long comp_bytes;
+	unsigned long long decomp_ns;
+};
+
+/* [algorithm][0: all files, 1: hot files], and the mount's selection */
+static struct comp_stat stats[SCFS_COMP_TOTAL_TYPES][2];
+static struct comp_stat selected;
+
+static int cluster_size = 16 * 1024;
+static int comp_threshold = 75;
+static int comp_type = SCFS_COMP_LZO;
+static int fast_comp_type = SCFS_COMP_LZ4;
+static const char *fast_ext = "so:odex:oat";
+static int repeat = 3;
+static const char *src_root;
+static const char *out_root;
+static char **hot_list;
+static size_t nr_hot;
+
+static unsigned char lzo_wrkmem[LZO1X_1_MEM_COMPRESS];
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_comp_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int)NR_REPORT_TYPES; i++)
+		if (!strcmp(name, comp_names[report_types[i]]))
+			return report_types[i];
+
+	fprintf(stderr, "unsupported compression type %s\n", name);
+	exit(1);
+}
+
+/* returns the compressed length, or 0 if the cluster doesn't compress */
+static size_t compress_cluster(int type, const unsigned char *in, size_t len,
+			       unsigned char *out)
+{
+	lzo_uint lzo_len;
+	z_stream zs;
+	int ret;
+
+	switch (type) {
+	case SCFS_COMP_LZO:
+		if (lzo1x_1_compress(in, len, out, &lzo_len, lzo_wrkmem) != LZO_E_OK)
+			return 0;
+		return lzo_len;
+	case SCFS_COMP_ZLIB:
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
+				 Z_DEFAULT_STRATEGY) != Z_OK)
+			return 0;
+		zs.next_in = (unsigned char *)in;
+		zs.avail_in = len;
+		zs.next_out = out;
+		zs.avail_out = OUT_BUF_SIZE;
+		ret = deflate(&zs, Z_FINISH);
+		deflateEnd(&zs);
+		return ret == Z_STREAM_END ? zs.total_out : 0;
+	case SCFS_COMP_LZ4:
+		ret = LZ4_compress_default((const char *)in, (char *)out, len,
+					   OUT_BUF_SIZE);
+		return ret > 0 ? (size_t)ret : 0;
+	}
+
+	return 0;
+}
+
+/* returns the decompressed length, or -1 on corrupted input */
+static long decompress_cluster(int type, const unsigned char *in, size_t len,
+			       unsigned char *out, size_t out_len)
+{
+	lzo_uint lzo_len = out_len;
+	z_stream zs;
+	int ret;
+
+	switch (type) {
+	case SCFS_COMP_LZO:
+		if (lzo1x_decompress_safe(in, len, out, &lzo_len, NULL) != LZO_E_OK)
+			return -1;
+		return lzo_len;
+	case SCFS_COMP_ZLIB:
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, -DEFLATE_DEF_WINBITS) != Z_OK)
+			return -1;
+		zs.next_in = (unsigned char *)in;
+		zs.avail_in = len;
+		zs.next_out = out;
+		zs.avail_out = out_len;
+		ret = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+		return ret == Z_STREAM_END ? (long)zs.total_out : -1;
+	case SCFS_COMP_LZ4:
+		ret = LZ4_decompress_safe((const char *)in, (char *)out, len,
+					  out_len);
+		return ret >= 0 ? ret : -1;
+	}
+
+	return -1;
+}
+
+static int read_file(const char *path, unsigned char **buf, size_t *len)
+{
+	struct stat st;
+	ssize_t ret;
+	size_t done = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	*len = st.st_size;
+	*buf = malloc(*len + 1);
+	if (!*buf) {
+		close(fd);
+		return -1;
+	}
+
+	while (done < *len) {
+		ret = read(fd, *buf + done, *len - done);
+		if (ret <= 0) {
+			perror(path);
+			free(*buf);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * If @buf holds a file in SCFS format, replace it with the original
+ * data, the way scfs_read_cluster() rebuilds it.
+ */
+static int decode_scfs(const char *path, unsigned char **buf, size_t *len)
+{
+	struct comp_footer cf;
+	struct scfs_cinfo *ci;
+	unsigned char *out;
+	size_t nr, i, left, csize;
+	long ret;
+
+	if (*len < sizeof(cf))
+		return 0;
+	memcpy(&cf, *buf + *len - sizeof(cf), sizeof(cf));
+	if (cf.magic != SCFS_MAGIC || cf.footer_size < (int)sizeof(cf) ||
+	    (size_t)cf.footer_size > *len || cf.cluster_size <= 0 ||
+	    cf.cluster_size > SCFS_CLUSTER_SIZE_MAX || cf.original_file_size < 0)
+		return 0;
+
+	out = malloc(cf.original_file_size + 1);
+	if (!out)
+		return -1;
+
+	nr = (cf.footer_size - sizeof(cf)) / sizeof(*ci);
+	if (!nr) {
+		/* stored without compression */
+		if ((size_t)cf.original_file_size > *len - sizeof(cf))
+			goto corrupt;
+		memcpy(out, *buf, cf.original_file_size);
+		goto done;
+	}
+
+	ci = (struct scfs_cinfo *)(*buf + *len - cf.footer_size);
+	for (i = 0; i < nr; i++) {
+		left = cf.original_file_size - i * cf.cluster_size;
+		csize = left < (size_t)cf.cluster_size ? left : (size_t)cf.cluster_size;
+		if ((size_t)ci[i].offset + ci[i].size > *len)
+			goto corrupt;
+
+		if (ci[i].size == csize) {
+			memcpy(out + i * cf.cluster_size, *buf + ci[i].offset, csize);
+			continue;
+		}
+		if (cf.comp_type < 0 || cf.comp_type >= SCFS_COMP_TOTAL_TYPES)
+			goto corrupt;
+		ret = decompress_cluster(cf.comp_type, *buf + ci[i].offset,
+					 ci[i].size, out + i * cf.cluster_size, csize);
+		if (ret != (long)csize)
+			goto corrupt;
+	}
+done:
+	free(*buf);
+	*buf = out;
+	*len = cf.original_file_size;
+	return 0;
+corrupt:
+	fprintf(stderr, "%s: corrupted SCFS file\n", path);
+	free(out);
+	return -1;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void load_hot_list(const char *path)
+{
+	char line[4096];
+	size_t cap = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0] || line[0] == '#')
+			continue;
+		if (nr_hot == cap) {
+			cap = cap ? cap * 2 : 256;
+			hot_list = realloc(hot_list, cap * sizeof(*hot_list));
+			if (!hot_list)
+				exit(1);
+		}
+		/* entries are relative to the image root */
+		hot_list[nr_hot++] = strdup(line[0] == '/' ? line + 1 : line);
+	}
+	fclose(f);
+	qsort(hot_list, nr_hot, sizeof(*hot_list), cmp_str);
+}
+
+/* same rule as scfs_select_comp_type(), plus the profiled hot list */
+static int is_hot(const char *rel)
+{
+	const char *name, *ext, *p, *end;
+	size_t len;
+
+	if (nr_hot && bsearch(&rel, hot_list, nr_hot, sizeof(*hot_list), cmp_str))
+		return 1;
+
+	name = strrchr(rel, '/');
+	name = name ? name + 1 : rel;
+	ext = strrchr(name, '.');
+	if (!ext || ext == name)
+		return 0;
+	ext++;
+	len = strlen(ext);
+
+	for (p = fast_ext; *p; p = end + 1) {
+		end = strchr(p, ':');
+		if (!end)
+			end = p + strlen(p);
+		if ((size_t)(end - p) == len && !strncmp(p, ext, len))
+			return 1;
+		if (!*end)
+			break;
+	}
+
+	return 0;
+}
+
+static void stat_add(struct comp_stat *dst, const struct comp_stat *src)
+{
+	dst->files += src->files;
+	dst->clusters += src->clusters;
+	dst->orig_bytes += src->orig_bytes;
+	dst->comp_bytes += src->comp_bytes;
+	dst->decomp_ns += src->decomp_ns;
+}
+
+static int mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			perror(path);
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/*
+ * Compress @buf with @type like scfs_write_meta() lays it out: clusters
+ * from offset 0, each 4-byte aligned, then the cinfo array and the footer.
+ * Fills in @st, and writes the result to @fd if it is not negative.
+ */
+static int pack_file(const char *path, int type, const unsigned char *buf,
+		     size_t len, struct comp_stat *st, int fd)
+{
+	static unsigned char cbuf[OUT_BUF_SIZE], ubuf[OUT_BUF_SIZE];
+	static const unsigned char zero[SCFS_CLUSTER_ALIGN_BYTE];
+	size_t nr = (len + cluster_size - 1) / cluster_size;
+	struct scfs_cinfo *ci;
+	struct comp_footer cf;
+	unsigned long long t, best;
+	size_t i, ulen, clen, pos = 0;
+	int compressed = 0, r, ret = -1;
+	const unsigned char *src;
+
+	ci = calloc(nr ? nr : 1, sizeof(*ci));
+	if (!ci)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		ulen = len - i * cluster_size;
+		if (ulen > (size_t)cluster_size)
+			ulen = cluster_size;
+
+		clen = compress_cluster(type, buf + i * cluster_size, ulen, cbuf);
+		if (clen && clen < ulen * comp_threshold / 100) {
+			src = cbuf;
+			compressed = 1;
+		} else {
+			src = buf + i * cluster_size;
+			clen = ulen;
+		}
+		ci[i].offset = pos;
+		ci[i].size = clen;
+
+		/* read latency: best of @repeat decompressions of the cluster */
+		best = ~0ULL;
+		for (r = 0; r < repeat; r++) {
+			t = now_ns();
+			if (src == cbuf) {
+				if (decompress_cluster(type, cbuf, clen, ubuf,
+						       sizeof(ubuf)) != (long)ulen) {
+					fprintf(stderr, "%s: %s round trip failed\n",
+						path, comp_names[type]);
+					goto out;
+				}
+			} else {
+				memcpy(ubuf, src, ulen);
+			}
+			t = now_ns() - t;
+			if (t < best)
+				best = t;
+		}
+		st->decomp_ns += best;
+		st->clusters++;
+
+		if (fd >= 0 &&
+		    (write(fd, src, clen) != (ssize_t)clen ||
+		     write(fd, zero, ALIGN(clen, SCFS_CLUSTER_ALIGN_BYTE) - clen) !=
+		     (ssize_t)(ALIGN(clen, SCFS_CLUSTER_ALIGN_BYTE) - clen)))
+			goto write_err;
+		pos = ALIGN(pos + clen, SCFS_CLUSTER_ALIGN_BYTE);
+	}
+
+	memset(&cf, 0, sizeof(cf));
+	cf.footer_size = sizeof(cf);
+	if (compressed) {
+		cf.footer_size += nr * sizeof(*ci);
+		if (fd >= 0 && write(fd, ci, nr * sizeof(*ci)) !=
+		    (ssize_t)(nr * sizeof(*ci)))
+			goto write_err;
+	} else {
+		/* a file with no compressed cluster is stored as is */
+		pos = ALIGN(len, SCFS_CLUSTER_ALIGN_BYTE);
+	}
+	cf.cluster_size = cluster_size;
+	cf.original_file_size = len;
+	cf.comp_type = type;
+	cf.magic = SCFS_MAGIC;
+	if (fd >= 0 && write(fd, &cf, sizeof(cf)) != sizeof(cf))
+		goto write_err;
+
+	st->files++;
+	st->orig_bytes += len;
+	st->comp_bytes += pos + cf.footer_size;
+	ret = 0;
+	goto out;
+
+write_err:
+	perror(path);
+out:
+	free(ci);
+	return ret;
+}
+
+static int visit(const char *path, const struct stat *sb, int flag,
+		 struct FTW *ftw)
+{
+	struct comp_stat st;
+	unsigned char *buf;
+	const char *rel;
+	char *out = NULL;
+	size_t i, len;
+	int hot, type, fd = -1;
+
+	(void)sb;
+	(void)ftw;
+	if (flag != FTW_F)
+		return 0;
+
+	rel = path + strlen(src_root);
+	while (*rel == '/')
+		rel++;
+
+	if (read_file(path, &buf, &len) || decode_scfs(path, &buf, &len)) {
+		fprintf(stderr, "%s: skipped\n", path);
+		return 0;
+	}
+	hot = is_hot(rel);
+
+	for (i = 0; i < NR_REPORT_TYPES; i++) {
+		type = report_types[i];
+		memset(&st, 0, sizeof(st));
+		if (pack_file(path, type, buf, len, &st, -1))
+			continue;
+		stat_add(&stats[type][0], &st);
+		if (hot)
+			stat_add(&stats[type][1], &st);
+	}
+
+	type = hot ? fast_comp_type : comp_type;
+	if (out_root) {
+		if (asprintf(&out, "%s/%s", out_root, rel) < 0)
+			exit(1);
+		if (mkdir_p(out) ||
+		    (fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror(out);
+			exit(1);
+		}
+	}
+	memset(&st, 0, sizeof(st));
+	if (!pack_file(path, type, buf, len, &st, fd))
+		stat_add(&selected, &st);
+	if (fd >= 0)
+		close(fd);
+
+	free(out);
+	free(buf);
+	return 0;
+}
+
+static void print_stat(const char *name, const char *set,
+		       const struct comp_stat *st)
+{
+	if (!st->clusters) {
+		printf("%-12s %-5s %10s\n", name, set, "-");
+		return;
+	}
+	printf("%-12s %-5s %10llu %10llu %6.1f%% %10.2f %10.1f\n",
+	       name, set, st->orig_bytes >> 10, st->comp_bytes >> 10,
+	       100.0 * st->comp_bytes / st->orig_bytes,
+	       st->decomp_ns / 1000.0 / st->clusters,
+	       st->decomp_ns ? st->orig_bytes * 1000.0 / st->decomp_ns : 0.0);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <image dir>\n"
+	       "  -c <bytes>   cluster size (default %d)\n"
+	       "  -t <pct>     compression threshold (default %d)\n"
+	       "  -a <algo>    comp_type for other files (default %s)\n"
+	       "  -f <algo>    fast_comp_type for hot files (default %s)\n"
+	       "  -e <exts>    fast_ext, ':' separated (default %s)\n"
+	       "  -H <file>    profiled hot files, one path per line\n"
+	       "  -r <count>   decompressions per cluster to time (default %d)\n"
+	       "  -o <dir>     write the recompressed image there\n"
+	       "algorithms: lzo, zlib, lz4\n",
+	       prog, cluster_size, comp_threshold, comp_names[comp_type],
+	       comp_names[fast_comp_type], fast_ext, repeat);
+}
+
+int main(int argc, char **argv)
+{
+	char *root;
+	size_t i;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:t:a:f:e:H:r:o:h")) != -1) {
+		switch (c) {
+		case 'c':
+			cluster_size = atoi(optarg);
+			break;
+		case 't':
+			comp_threshold = atoi(optarg);
+			break;
+		case 'a':
+			comp_type = parse_comp_type(optarg);
+			break;
+		case 'f':
+			fast_comp_type = parse_comp_type(optarg);
+			break;
+		case 'e':
+			fast_ext = optarg;
+			break;
+		case 'H':
+			load_hot_list(optarg);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'o':
+			out_root = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1 || repeat < 1 ||
+	    comp_threshold < 0 || comp_threshold > 100 ||
+	    cluster_size < SCFS_CLUSTER_SIZE_MIN ||
+	    cluster_size > SCFS_CLUSTER_SIZE_MAX ||
+	    (cluster_size & (cluster_size - 1))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (lzo_init() != LZO_E_OK) {
+		fprintf(stderr, "lzo_init failed\n");
+		return 1;
+	}
+
+	root = strdup(argv[optind]);
+	while (strlen(root) > 1 && root[strlen(root) - 1] == '/')
+		root[strlen(root) - 1] = '\0';
+	src_root = root;
+
+	if (nftw(src_root, visit, 64, FTW_PHYS)) {
+		perror(src_root);
+		return 1;
+	}
+
+	printf("%-12s %-5s %10s %10s %7s %10s %10s\n", "algorithm", "files",
+	       "orig KB", "comp KB", "ratio", "us/clust", "MB/s");
+	for (i = 0; i < NR_REPORT_TYPES; i++) {
+		print_stat(comp_names[report_types[i]], "all",
+			   &stats[report_types[i]][0]);
+		print_stat(comp_names[report_types[i]], "hot",
+			   &stats[report_types[i]][1]);
+	}
+	printf("\nselected: %s for hot files, %s for the rest\n",
+	       comp_names[fast_comp_type], comp_names[comp_type]);
+	print_stat("selected", "all", &selected);
+
+	return 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * zram-swapbench: multi-threaded swap-out throughput to a zram device
+ *
+ * Sets up the zram device as the only swap device, then has a number of
+ * threads dirty more anonymous memory than they are allowed to keep
+ * resident. Memory is limited either by a memory cgroup (-g) or by
+ * locking a balloon of memory in this process (-l). Every pass rewrites
+ * every page, so pages keep being swapped out and back in while the
+ * threads run. Swap-out throughput is taken from pswpout in /proc/vmstat.
+ *
+ * The run is repeated for each max_comp_streams value given with -s, the
+ * device being reset in between. With one compression stream, swap-out
+ * from several reclaiming tasks is serialized on it; with more streams
+ * it should scale up to the number of online CPUs.
+ *
+ * Run it as root, with no other swap device active. The pages are filled
+ * with data that compresses to about half, never with a single repeated
+ * value, which zram stores without compressing.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2.
+ *
+ * Compile with:
+ *
+ * gcc -O2 -o zram-swapbench zram-swapbench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/swap.h>
+#include <sys/types.h>
+
+#define MAX_THREADS		64
+#define MAX_STREAMS		32
+
+static const char *dev = "zram0";
+static int nr_threads;
+static unsigned long thread_mb = 64;
+static unsigned long balloon_mb;
+static const char *memcg;
+static unsigned long memcg_mb;
+static int passes = 3;
+static int streams[MAX_STREAMS];
+static int nr_streams;
+
+static long page_size;
+static int failed;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_file(const char *path, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int write_file(const char *path, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	int fd, len, ret = 0;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, buf, len) != len) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+static int write_attr(const char *attr, const char *fmt, unsigned long val)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", dev, attr);
+	return write_file(path, fmt, val);
+}
+
+static unsigned long long vmstat(const char *name)
+{
+	char key[64];
+	unsigned long long val;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		return 0;
+	while (fscanf(f, "%63s %llu", key, &val) == 2) {
+		if (!strcmp(key, name)) {
+			fclose(f);
+			return val;
+		}
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/* the number of active swap devices, from /proc/swaps */
+static int swap_devices(void)
+{
+	char line[256];
+	int n = -1;
+	FILE *f;
+
+	f = fopen("/proc/swaps", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		n++;
+	fclose(f);
+
+	return n;
+}
+
+static int setup_swap(int nr_strm, unsigned long disk_mb)
+{
+	char path[64], cmd[96];
+
+	snprintf(path, sizeof(path), "/dev/%s", dev);
+	swapoff(path);
+
+	if (write_attr("reset", "%lu", 1) ||
+	    write_attr("max_comp_streams", "%lu", nr_strm) ||
+	    write_attr("disksize", "%lu", disk_mb << 20))
+		return -1;
+
+	snprintf(cmd, sizeof(cmd), "mkswap %s >/dev/null", path);
+	if (system(cmd)) {
+		fprintf(stderr, "mkswap %s failed\n", path);
+		return -1;
+	}
+	if (swapon(path, 0)) {
+		fprintf(stderr, "swapon %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (swap_devices() != 1) {
+		fprintf(stderr, "%s must be the only active swap device\n", path);
+		swapoff(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void teardown_swap(void)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/dev/%s", dev);
+	swapoff(path);
+	write_attr("reset", "%lu", 1);
+}
+
+/* about half of each byte is random: compresses to roughly 50% */
+static void fill_page(unsigned char *p, unsigned int *seed)
+{
+	long i;
+
+	for (i = 0; i < page_size; i++) {
+		*seed = *seed * 1103515245 + 12345;
+		p[i] = 'a' + ((*seed >> 16) & 0x0f);
+	}
+}
+
+static void *dirtier(void *arg)
+{
+	unsigned int seed = (unsigned long)arg;
+	unsigned long size = thread_mb << 20;
+	unsigned char *mem;
+	unsigned long off, word;
+	int pass;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		__sync_fetch_and_add(&failed, 1);
+		return NULL;
+	}
+
+	for (off = 0; off < size; off += page_size)
+		fill_page(mem + off, &seed);
+
+	/* touching a swapped out page brings it back and dirties it again */
+	for (pass = 0; pass < passes; pass++)
+		for (off = 0; off < size; off += page_size) {
+			word = (seed++ % page_size) & ~3UL;
+			*(unsigned int *)(mem + off + word) = seed;
+		}
+
+	munmap(mem, size);
+
+	return NULL;
+}
+
+static int run_once(int nr_strm)
+{
+	pthread_t tids[MAX_THREADS];
+	unsigned long long start, elapsed, out, in;
+	unsigned long disk_mb;
+	int i;
+
+	/* room for every page the threads dirty, plus slack */
+	disk_mb = nr_threads * thread_mb * 2;
+	if (setup_swap(nr_strm, disk_mb))
+		return -1;
+
+	out = vmstat("pswpout");
+	in = vmstat("pswpin");
+	failed = 0;
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&tids[i], NULL, dirtier,
+				   (void *)(unsigned long)(i + 1))) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	out = vmstat("pswpout") - out;
+	in = vmstat("pswpin") - in;
+	teardown_swap();
+
+	if (failed) {
+		fprintf(stderr, "%d threads could not map their memory\n",
+			failed);
+		return -1;
+	}
+	if (!out)
+		fprintf(stderr, "nothing was swapped out, "
+			"increase -m or the memory pressure\n");
+
+	printf("%8d %10llu %10llu %10.1f %8.2f\n", nr_strm,
+	       out * page_size >> 20, in * page_size >> 20,
+	       elapsed ? (out * page_size) * 1000.0 / elapsed : 0.0,
+	       elapsed / 1e9);
+
+	return 0;
+}
+
+static void *balloon;
+
+static int apply_pressure(void)
+{
+	char path[256];
+
+	if (memcg) {
+		snprintf(path, sizeof(path), "%s/memory.limit_in_bytes", memcg);
+		if (write_file(path, "%lu", memcg_mb << 20))
+			return -1;
+		/* the threads created later inherit the cgroup */
+		snprintf(path, sizeof(path), "%s/tasks", memcg);
+		if (write_file(path, "%d", getpid()))
+			return -1;
+	}
+
+	if (balloon_mb) {
+		balloon = mmap(NULL, balloon_mb << 20, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED |
+			       MAP_POPULATE, -1, 0);
+		if (balloon == MAP_FAILED) {
+			perror("locking the balloon");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void default_streams(void)
+{
+	int n;
+
+	for (n = 1; n < nr_threads && nr_streams < MAX_STREAMS; n *= 2)
+		streams[nr_streams++] = n;
+	streams[nr_streams++] = nr_threads;
+}
+
+static int parse_streams(char *list)
+{
+	char *tok;
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (nr_streams == MAX_STREAMS || atoi(tok) < 1)
+			return -1;
+		streams[nr_streams++] = atoi(tok);
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "  -d <name>    zram device (default %s)\n"
+	       "  -t <count>   dirtying threads (default: online CPUs)\n"
+	       "  -m <MB>      memory dirtied by each thread (default %lu)\n"
+	       "  -p <count>   passes over the memory (default %d)\n"
+	       "  -s <list>    max_comp_streams values, comma separated\n"
+	       "               (default: 1, 2, 4, ... up to the thread count)\n"
+	       "  -g <dir> -c <MB>\n"
+	       "               run in the memory cgroup <dir>, limited to <MB>\n"
+	       "  -l <MB>      lock <MB> of memory to leave less for the threads\n",
+	       prog, dev, thread_mb, passes);
+}
+
+int main(int argc, char **argv)
+{
+	int i, c;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "d:t:m:p:s:g:c:l:h")) != -1) {
+		switch (c) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'm':
+			thread_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 's':
+			if (parse_streams(optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'g':
+			memcg = optarg;
+			break;
+		case 'c':
+			memcg_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			balloon_mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (nr_threads < 1 || nr_threads > MAX_THREADS || !thread_mb ||
+	    passes < 1 || (memcg && !memcg_mb) || (!memcg && !balloon_mb)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!nr_streams)
+		default_streams();
+
+	if (apply_pressure())
+		return 1;
+
+	printf("%d threads, %lu MB each, %d passes\n", nr_threads, thread_mb,
+	       passes);
+	printf("%8s %10s %10s %10s %8s\n", "streams", "out MB", "in MB",
+	       "out MB/s", "secs");
+
+	for (i = 0; i < nr_streams; i++)
+		if (run_once(streams[i]))
+			return 1;
+
+	return 0;
+}